@@ -0,0 +1,113 @@
+/*
+
+    flow: activenotes.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "activenotes.h"
+#include "physics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int insertActiveNote(ActiveNotes *active, NoteRef *ref)
+{
+    void *mem = NULL;
+
+    if (active->nNotes == active->allocatedNotes)
+    {
+        mem = realloc(active->notes, (active->allocatedNotes + ACTIVE_NOTES_ALLOCATION_INCREMENT) * sizeof *active->notes);
+        if (mem == NULL)
+            return MIDI_MEMORY;
+        active->notes = mem;
+        active->allocatedNotes += ACTIVE_NOTES_ALLOCATION_INCREMENT;
+    }
+
+    // Binary search for the insertion point in (track, index) order
+    int lo = 0;
+    int hi = active->nNotes;
+    int mid = 0;
+    NoteRef *r = NULL;
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        r = &active->notes[mid];
+        if (r->track < ref->track || (r->track == ref->track && r->index < ref->index))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    memmove(&active->notes[lo + 1], &active->notes[lo], (active->nNotes - lo) * sizeof *active->notes);
+    active->notes[lo] = *ref;
+    active->nNotes++;
+
+    return MIDI_OK;
+}
+
+int updateActiveNotes(ActiveNotes *active, MidiSong *song, double videoTime, double windowTimeSpan, struct PhysicsBatch *physics)
+{
+    if (active == NULL || song == NULL)
+        return MIDI_ARG;
+
+    int status = MIDI_OK;
+    NoteRef *ref = NULL;
+    MidiNote *note = NULL;
+
+    // Notes leave once their trail has had windowTimeSpan to fall off screen.
+    // Stop times can change while a note is on screen, so test the current value.
+    int kept = 0;
+    for (int i = 0; i < active->nNotes; i++)
+    {
+        ref = &active->notes[i];
+        note = &song->tracks[ref->track].notes[ref->index];
+        if (note->stopTime + windowTimeSpan > videoTime)
+            active->notes[kept++] = *ref;
+        else if (physics != NULL)
+            releaseNoteDynamics(physics, note);
+    }
+    active->nNotes = kept;
+
+    // Sweep the cursor over notes that have started
+    while (active->cursor < song->nIndexedNotes && song->noteIndex[active->cursor].startTime <= videoTime)
+    {
+        ref = &song->noteIndex[active->cursor++];
+        note = &song->tracks[ref->track].notes[ref->index];
+        // Skip notes that were over before we got here (e.g. fast-forwarding)
+        if (note->stopTime + windowTimeSpan <= videoTime)
+            continue;
+        status = insertActiveNote(active, ref);
+        if (status != MIDI_OK)
+            return status;
+    }
+
+    return MIDI_OK;
+}
+
+void freeActiveNotes(ActiveNotes *active)
+{
+    if (active == NULL)
+        return;
+
+    free(active->notes);
+    active->notes = NULL;
+    active->nNotes = 0;
+    active->allocatedNotes = 0;
+    active->cursor = 0;
+
+    return;
+}
@@ -0,0 +1,48 @@
+/*
+
+    flow: activenotes.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _ACTIVENOTES_H
+#define _ACTIVENOTES_H
+
+#include "midi.h"
+
+#define ACTIVE_NOTES_ALLOCATION_INCREMENT 256
+
+// Notes currently on screen, kept in (track, index) order so that
+// drawing order matches a full scan of the tracks
+typedef struct ActiveNotes
+{
+    NoteRef *notes;
+    int nNotes;
+    int allocatedNotes;
+
+    // Next entry of song->noteIndex to enter the active set
+    int cursor;
+
+} ActiveNotes;
+
+struct PhysicsBatch;
+
+// Notes leaving the screen give their control points back to physics (may be NULL)
+int updateActiveNotes(ActiveNotes *active, MidiSong *song, double videoTime, double windowTimeSpan, struct PhysicsBatch *physics);
+
+void freeActiveNotes(ActiveNotes *active);
+
+#endif // _ACTIVENOTES_H
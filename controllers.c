@@ -0,0 +1,176 @@
+/*
+
+    flow: controllers.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "controllers.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Event and the track it came from, for a stable merge of the tracks
+typedef struct SortableEvent
+{
+    ControllerEvent event;
+    int order;
+} SortableEvent;
+
+int addControllerEvent(MidiTrack *track, uint64_t tick, int channel, int controller, int value)
+{
+    if (track == NULL || channel < 0 || channel >= MIDI_CHANNELS || controller < 0 || controller >= MIDI_CONTROLLERS)
+        return MIDI_ARG;
+
+    void *mem = NULL;
+    if (track->nControllerEvents == track->allocatedControllerEvents)
+    {
+        mem = realloc(track->controllerEvents, (track->allocatedControllerEvents + CONTROLLER_ALLOCATION_INCREMENT) * sizeof *track->controllerEvents);
+        if (mem == NULL)
+            return MIDI_MEMORY;
+        track->controllerEvents = mem;
+        track->allocatedControllerEvents += CONTROLLER_ALLOCATION_INCREMENT;
+    }
+
+    ControllerEvent *event = &track->controllerEvents[track->nControllerEvents++];
+    event->tick = tick;
+    event->channel = channel;
+    event->controller = controller;
+    event->value = value;
+
+    return MIDI_OK;
+}
+
+static int compareEvents(const void *a, const void *b)
+{
+    const SortableEvent *e1 = (const SortableEvent *)a;
+    const SortableEvent *e2 = (const SortableEvent *)b;
+
+    if (e1->event.channel != e2->event.channel)
+        return e1->event.channel - e2->event.channel;
+    if (e1->event.controller != e2->event.controller)
+        return e1->event.controller - e2->event.controller;
+    if (e1->event.tick != e2->event.tick)
+        return e1->event.tick < e2->event.tick ? -1 : 1;
+
+    return e1->order - e2->order;
+}
+
+int buildControllerTimelines(MidiSong *song)
+{
+    if (song == NULL || song->tracks == NULL)
+        return MIDI_ARG;
+
+    free(song->controllers);
+    free(song->controllerTime);
+    free(song->controllerValue);
+    song->controllers = NULL;
+    song->controllerTime = NULL;
+    song->controllerValue = NULL;
+    song->nControllerPoints = 0;
+
+    song->controllers = calloc(MIDI_CHANNELS * MIDI_CONTROLLERS, sizeof *song->controllers);
+    if (song->controllers == NULL)
+        return MIDI_MEMORY;
+
+    int nEvents = 0;
+    for (int tr = 0; tr < song->nTracks; tr++)
+        nEvents += song->tracks[tr].nControllerEvents;
+
+    SortableEvent *events = NULL;
+    if (nEvents > 0)
+    {
+        events = malloc(nEvents * sizeof *events);
+        song->controllerTime = malloc(nEvents * sizeof *song->controllerTime);
+        song->controllerValue = malloc(nEvents * sizeof *song->controllerValue);
+        if (events == NULL || song->controllerTime == NULL || song->controllerValue == NULL)
+        {
+            free(events);
+            return MIDI_MEMORY;
+        }
+    }
+
+    MidiTrack *track = NULL;
+    int n = 0;
+    for (int tr = 0; tr < song->nTracks; tr++)
+    {
+        track = &song->tracks[tr];
+        for (int e = 0; e < track->nControllerEvents; e++, n++)
+        {
+            events[n].event = track->controllerEvents[e];
+            events[n].order = n;
+        }
+        free(track->controllerEvents);
+        track->controllerEvents = NULL;
+        track->nControllerEvents = 0;
+        track->allocatedControllerEvents = 0;
+    }
+    if (nEvents > 1)
+        qsort(events, nEvents, sizeof *events, compareEvents);
+
+    ControllerTimeline *timeline = NULL;
+    for (int i = 0; i < nEvents; i++)
+    {
+        timeline = &song->controllers[events[i].event.channel * MIDI_CONTROLLERS + events[i].event.controller];
+        if (timeline->nPoints == 0)
+            timeline->first = i;
+        timeline->nPoints++;
+        song->controllerTime[i] = songTime(song, events[i].event.tick);
+        song->controllerValue[i] = events[i].event.value;
+    }
+    song->nControllerPoints = nEvents;
+    free(events);
+
+    return MIDI_OK;
+}
+
+uint16_t controllerValue(const MidiSong *song, int channel, int controller, double time, ControllerCursor *cursor)
+{
+    uint16_t defaultValue = controller == MIDI_CONTROLLER_PITCH_BEND ? MIDI_PITCH_BEND_CENTRE : 0;
+    if (song == NULL || song->controllers == NULL || channel < 0 || channel >= MIDI_CHANNELS || controller < 0 || controller >= MIDI_CONTROLLERS || cursor == NULL)
+        return defaultValue;
+
+    const ControllerTimeline *timeline = &song->controllers[channel * MIDI_CONTROLLERS + controller];
+    const double *times = song->controllerTime + timeline->first;
+    int next = cursor->next;
+    if (next < 0 || next > timeline->nPoints)
+        next = 0;
+
+    if (next > 0 && times[next - 1] > time)
+    {
+        // Went back in time: binary search for the first point after time
+        int lo = 0;
+        int hi = next - 1;
+        int mid = 0;
+        while (lo < hi)
+        {
+            mid = lo + (hi - lo) / 2;
+            if (times[mid] > time)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        next = lo;
+    }
+    while (next < timeline->nPoints && times[next] <= time)
+        next++;
+    cursor->next = next;
+
+    if (next == 0)
+        return defaultValue;
+
+    return song->controllerValue[timeline->first + next - 1];
+}
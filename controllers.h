@@ -0,0 +1,46 @@
+/*
+
+    flow: controllers.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CONTROLLERS_H
+#define _CONTROLLERS_H
+
+#include "midi.h"
+
+#include <stdint.h>
+
+#define CONTROLLER_ALLOCATION_INCREMENT 256
+
+// Position in one timeline, carried from frame to frame. Starts zeroed.
+typedef struct ControllerCursor
+{
+    int next; // first point after the previous query time
+} ControllerCursor;
+
+int addControllerEvent(MidiTrack *track, uint64_t tick, int channel, int controller, int value);
+
+// Merges the tracks' controller events into the song's timelines, converting
+// ticks with the tempo map. The tracks' event lists are freed.
+int buildControllerTimelines(MidiSong *song);
+
+// Controller value in effect at time: the default before the first change
+// (centred for pitch bend, zero otherwise). Amortized O(1) for increasing times.
+uint16_t controllerValue(const MidiSong *song, int channel, int controller, double time, ControllerCursor *cursor);
+
+#endif // _CONTROLLERS_H
@@ -0,0 +1,257 @@
+/*
+
+    flow: density.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "density.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+int initDensityBuffer(DensityBuffer *density, int width, int height)
+{
+    if (density == NULL || width < 1 || height < 1)
+        return DENSITY_ARG;
+
+    density->width = width;
+    density->height = height;
+    density->cells = calloc((size_t)(width + 2) * height * 4, sizeof *density->cells);
+    density->rowStart = malloc(height * sizeof *density->rowStart);
+    density->rowEnd = malloc(height * sizeof *density->rowEnd);
+    density->rgba = calloc((size_t)width * 2, 4);
+    if (density->cells == NULL || density->rowStart == NULL || density->rowEnd == NULL || density->rgba == NULL)
+    {
+        freeDensityBuffer(density);
+        return DENSITY_MEMORY;
+    }
+    for (int y = 0; y < height; y++)
+    {
+        density->rowStart[y] = width;
+        density->rowEnd[y] = 0;
+    }
+
+    return DENSITY_OK;
+}
+
+void freeDensityBuffer(DensityBuffer *density)
+{
+    if (density == NULL)
+        return;
+
+    free(density->cells);
+    free(density->rowStart);
+    free(density->rowEnd);
+    free(density->rgba);
+    density->cells = NULL;
+    density->rowStart = NULL;
+    density->rowEnd = NULL;
+    density->rgba = NULL;
+
+    return;
+}
+
+static inline void addCell(float *cell, float weight, const float colour[3])
+{
+    cell[0] += weight;
+    cell[1] += weight * colour[0];
+    cell[2] += weight * colour[1];
+    cell[3] += weight * colour[2];
+
+    return;
+}
+
+// Adds the depth of [left, right) to part of a row, as differences along the
+// row: a pixel's value is the sum of the cells up to it. Pixels cut by an edge
+// take the depth of their partial coverage, as blending would.
+static void splatSpan(DensityBuffer *density, int row, float left, float right, float height, float alpha, float depth, const float colour[3])
+{
+    if (left < 0.0f)
+        left = 0.0f;
+    if (right > (float)density->width)
+        right = (float)density->width;
+    if (left >= right)
+        return;
+
+    float *cells = density->cells + (size_t)row * (density->width + 2) * 4;
+    int i = (int)left;
+    int j = (int)right;
+    float edge = 0.0f;
+
+    if (i == j)
+    {
+        edge = -height * logf(1.0f - (right - left) * alpha);
+        addCell(cells + (size_t)4 * i, edge, colour);
+        addCell(cells + (size_t)4 * (i + 1), -edge, colour);
+    }
+    else
+    {
+        edge = -height * logf(1.0f - ((float)(i + 1) - left) * alpha);
+        addCell(cells + (size_t)4 * i, edge, colour);
+        addCell(cells + (size_t)4 * (i + 1), height * depth - edge, colour);
+        edge = -height * logf(1.0f - (right - (float)j) * alpha);
+        addCell(cells + (size_t)4 * j, edge - height * depth, colour);
+        addCell(cells + (size_t)4 * (j + 1), -edge, colour);
+    }
+
+    if (i < density->rowStart[row])
+        density->rowStart[row] = i;
+    if (j + 2 > density->rowEnd[row])
+        density->rowEnd[row] = j + 2;
+
+    return;
+}
+
+void splatDensityNote(DensityBuffer *density, const float *x, const float *y, int nPoints, float lineWidth, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    if (density == NULL || density->cells == NULL || x == NULL || y == NULL || a == 0)
+        return;
+
+    float alpha = fminf((float)a / 255.0f, DENSITY_MAX_ALPHA);
+    float depth = -logf(1.0f - alpha);
+    const float colour[3] = {r / 255.0f, g / 255.0f, b / 255.0f};
+    float half = 0.5f * lineWidth;
+    float y0 = 0.0f;
+    float y1 = 0.0f;
+    float top = 0.0f;
+    float bottom = 0.0f;
+    float mid = 0.0f;
+    float centre = 0.0f;
+    float slope = 0.0f;
+    float height = 0.0f;
+    int slices = 0;
+    int rowFirst = 0;
+    int rowLast = 0;
+
+    // Each segment of the centre line covers its rows for the fraction of each it spans
+    for (int i = 0; i + 1 < nPoints; i++)
+    {
+        y0 = y[i];
+        y1 = y[i + 1];
+        if (y0 == y1)
+            continue;
+        slope = (x[i + 1] - x[i]) / (y1 - y0);
+        top = fminf(y0, y1);
+        bottom = fmaxf(y0, y1);
+        rowFirst = top > 0.0f ? (int)top : 0;
+        rowLast = bottom < (float)density->height ? (int)ceilf(bottom) : density->height;
+        for (int row = rowFirst; row < rowLast; row++)
+        {
+            top = fmaxf(fminf(y0, y1), (float)row);
+            bottom = fminf(fmaxf(y0, y1), (float)(row + 1));
+            if (bottom <= top)
+                continue;
+            // Slanted pieces in slices that each shift by under a pixel
+            slices = (int)ceilf(fabsf(slope) * (bottom - top));
+            if (slices < 1)
+                slices = 1;
+            height = (bottom - top) / (float)slices;
+            for (int k = 0; k < slices; k++)
+            {
+                mid = top + ((float)k + 0.5f) * height;
+                centre = x[i] + slope * (mid - y0);
+                splatSpan(density, row, centre - half, centre + half, height, alpha, depth, colour);
+            }
+        }
+    }
+
+    return;
+}
+
+// Resolved colours of one row's pixels start to end - 1 from running sums of
+// the differences, emptying cells start to clear - 1
+static void resolveRow(DensityBuffer *density, int row, int start, int end, int clear, uint8_t *rgba)
+{
+    float *cell = density->cells + ((size_t)row * (density->width + 2) + start) * 4;
+    uint8_t *p = rgba + 4 * start;
+    float sum[4] = {0.0f};
+    float scale = 0.0f;
+    int i = start;
+
+    for (; i < end; i++, cell += 4, p += 4)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            sum[c] += cell[c];
+            cell[c] = 0.0f;
+        }
+        // Rounding leaves crumbs where spans cancel
+        if (sum[0] <= 1e-6f)
+        {
+            p[3] = 0;
+            continue;
+        }
+        scale = 255.0f / sum[0];
+        p[0] = (uint8_t)fminf(fmaxf(sum[1] * scale + 0.5f, 0.0f), 255.0f);
+        p[1] = (uint8_t)fminf(fmaxf(sum[2] * scale + 0.5f, 0.0f), 255.0f);
+        p[2] = (uint8_t)fminf(fmaxf(sum[3] * scale + 0.5f, 0.0f), 255.0f);
+        p[3] = (uint8_t)((1.0f - expf(-sum[0])) * 255.0f + 0.5f);
+    }
+    for (; i < clear; i++, cell += 4)
+        cell[0] = cell[1] = cell[2] = cell[3] = 0.0f;
+
+    return;
+}
+
+void resolveDensity(DensityBuffer *density, Raster *raster)
+{
+    if (density == NULL || density->cells == NULL || raster == NULL)
+        return;
+
+    int width = density->width < raster->width ? density->width : raster->width;
+    int height = density->height < raster->height ? density->height : raster->height;
+    uint8_t *rgba[2] = {density->rgba, density->rgba + (size_t)4 * density->width};
+    int start = 0;
+    int end = 0;
+    int clear = 0;
+
+    // Row pairs, so chroma blocks see both of their rows
+    for (int row = 0; row < height; row += 2)
+    {
+        start = density->rowStart[row];
+        end = density->rowEnd[row];
+        if (row + 1 < height)
+        {
+            if (density->rowStart[row + 1] < start)
+                start = density->rowStart[row + 1];
+            if (density->rowEnd[row + 1] > end)
+                end = density->rowEnd[row + 1];
+        }
+        if (start >= end)
+            continue;
+
+        // Whole chroma blocks
+        clear = end;
+        start &= ~1;
+        end = end + 1 < width ? (end + 1) & ~1 : width;
+        resolveRow(density, row, start, end, clear, rgba[0]);
+        if (row + 1 < height)
+            resolveRow(density, row + 1, start, end, clear, rgba[1]);
+        rasterBlendRows(raster, row, start, end, rgba[0], row + 1 < height ? rgba[1] : NULL);
+
+        density->rowStart[row] = density->width;
+        density->rowEnd[row] = 0;
+        if (row + 1 < height)
+        {
+            density->rowStart[row + 1] = density->width;
+            density->rowEnd[row + 1] = 0;
+        }
+    }
+
+    return;
+}
@@ -0,0 +1,61 @@
+/*
+
+    flow: density.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DENSITY_H
+#define _DENSITY_H
+
+#include "raster.h"
+
+#include <stdint.h>
+
+#define DENSITY_MAX_ALPHA 0.999f // opaque notes still leave a finite optical depth
+
+enum DENSITY_ERR
+{
+    DENSITY_OK = 0,
+    DENSITY_ARG = -1,
+    DENSITY_MEMORY = -2
+};
+
+// Notes splatted into per-pixel sums instead of blended one polygon at a time.
+// Each note adds its optical depth, -log(1 - alpha) times the pixel's coverage,
+// and its colour weighted by that depth. Resolving blends 1 - exp(-depth) of
+// the depth-weighted mean colour: one note looks as it does when blended, a
+// stack of them the same whatever the drawing order.
+typedef struct DensityBuffer
+{
+    int width;
+    int height;
+    float *cells; // depth, red, green, blue per pixel as differences along the row, (width + 2) per row
+    int *rowStart; // touched pixels of each row
+    int *rowEnd;
+    uint8_t *rgba; // two rows of resolved colour
+} DensityBuffer;
+
+int initDensityBuffer(DensityBuffer *density, int width, int height);
+void freeDensityBuffer(DensityBuffer *density);
+
+// A note ribbon lineWidth pixels wide about its centre line, in pixel units
+void splatDensityNote(DensityBuffer *density, const float *x, const float *y, int nPoints, float lineWidth, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+// Blends the sums into the raster's target and empties the buffer
+void resolveDensity(DensityBuffer *density, Raster *raster);
+
+#endif // _DENSITY_H
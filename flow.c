@@ -24,6 +24,13 @@
 #include "colour.h"
 #include "physics.h"
 #include "options.h"
+#include "activenotes.h"
+#include "controllers.h"
+#include "pipeline.h"
+#include "segment.h"
+#include "text.h"
+#include "geometry.h"
+#include "density.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -33,13 +40,10 @@
 #include <math.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include <SDL2/SDL_ttf.h>
 
-static MidiNote noteStatus[MIDI_NOTE_RANGE][MIDI_CHANNELS] = {0};
-uint64_t counter = 0;
-double noteLengthCounter = 0.0;
-
 int main(int argc, char **argv)
 {
     int status = FLOW_OK;
@@ -67,6 +71,18 @@ int main(int argc, char **argv)
         goto cleanup;
     }
 
+    if (state.nSegments > 1)
+    {
+        status = readMidi(&state);
+        if (status != MIDI_OK)
+        {
+            fprintf(stderr, "Unable to read MIDI file %s\n", state.audioState.midiFilename);
+            exit(EXIT_FAILURE);
+        }
+        status = flowSegments(&state);
+        goto cleanup;
+    }
+
     // Loads audio file, prepares output MP4
     status = initVideoProcessor(&state.videoState);
     if (status < 0)
@@ -114,11 +130,13 @@ cleanup:
 
     cleanupAudio(&state.audioState);
     cleanupVideo(&state.videoState);
+    freeShearField(&state.shearField);
 
     // One-time operation, let the OS free Song memory after exit.
 
     fflush(stdout);
 
+    closeTextFonts();
     TTF_Quit();
 
     exit(status);
@@ -136,11 +154,19 @@ int initState(State *state)
     state->maxNoteWidth = DEFAULT_MAX_NOTE_WIDTH;
     // state->videoFilterGraph = "gblur=sigma=2:steps=2";
     // state->videoFilterGraph = "avgblur=sizeX=2";
-    state->videoState.videoFilterGraph = "boxblur";
+    state->videoState.videoFilterGraph = NULL; // Native boxblur equivalent
+    state->videoState.postOptions.blurRadius = POSTPROCESS_DEFAULT_BLUR_RADIUS;
+    state->videoState.postOptions.blurPasses = POSTPROCESS_DEFAULT_BLUR_PASSES;
+    state->videoState.postOptions.bloomThreshold = POSTPROCESS_DEFAULT_BLOOM_THRESHOLD;
     state->videoState.frameWidth = DEFAULT_IMAGE_WIDTH;
     state->videoState.frameHeight = DEFAULT_IMAGE_HEIGHT;
     state->videoState.applyVideoFilter = true;
+    state->videoState.noteRasterizer = NOTE_RASTERIZER_NATIVE;
+    state->videoState.videoThreads = 1;
+    state->videoState.reuseStaticFrames = true;
+    state->videoState.sparseTiles = true;
     state->trackToDisplay = -1; // All tracks
+    state->useSongCache = true;
     state->startTime = 0.0; // seconds
     state->stopTime = -1.0; // Automatic: use song duration
     state->audioState.startTime = state->startTime;
@@ -150,15 +176,20 @@ int initState(State *state)
     state->nShearYPoints = DEFAULT_SHEAR_Y_POINTS;
     state->shearDeltaT = DEFAULT_SHEAR_DELTAT;
     state->wigglePeriod = DEFAULT_WIGGLE_PERIOD;
-    state->nShearTimes = 1;
     state->wiggleOffset = DEFAULT_WIGGLE_OFFSET;
     state->wiggleAmplitude = DEFAULT_WIGGLE_AMPLITUDE;
     state->wiggleWavelength = DEFAULT_WIGGLE_WAVELENGTH;
     state->flowShearScale = DEFAULT_FLOW_SHEAR_SCALE;
     state->noteAcceleration = DEFAULT_NOTE_ACCELERATION; // pixels per second per second
+    state->noteLodError = DEFAULT_NOTE_LOD_ERROR;
+    state->densityThreshold = DEFAULT_DENSITY_THRESHOLD;
+    state->closedFormPhysics = false;
     state->randomSeed = -1; // Seed from system clock
     state->colourTable = DEFAULT_COLOUR_TABLE;
     state->cycleColourTables = -1; // Cycling is off
+    state->pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+    state->pipelineThreads = DEFAULT_PIPELINE_THREADS;
+    state->nSegments = DEFAULT_VIDEO_SEGMENTS;
 
     state->videoState.videoTitleFont = DEFAULT_VIDEO_TITLE_FONT;
     state->videoState.videoTitlefontSize = DEFAULT_VIDEO_TITLE_FONTSIZE;
@@ -168,15 +199,99 @@ int initState(State *state)
     return FLOW_OK;
 }
 
+double videoStopTime(State *state)
+{
+    if (state == NULL || state->song == NULL)
+        return 0.0;
+
+    if (state->stopTime < 0.0)
+        return state->song->maxTime + state->extraTime;
+
+    return state->stopTime;
+}
+
+double videoGridStart(State *state)
+{
+    if (state == NULL)
+        return 0.0;
+
+    // Fast-forward from one window time span before the requested start
+    double gridStart = state->startTime - state->windowTimeSpan;
+    if (gridStart < 0.)
+        gridStart = 0.;
+
+    return gridStart;
+}
+
+int64_t firstGridFrame(State *state, double t)
+{
+    if (state == NULL)
+        return 0;
+
+    // Frame k is at gridStart + k * framePeriod; evaluate it the same way flow() does
+    double gridStart = videoGridStart(state);
+    double framePeriod = 1.0 / state->videoState.frameRate;
+    int64_t k = (int64_t)floor((t - gridStart) / framePeriod);
+    if (k < 0)
+        k = 0;
+    while (k > 0 && gridStart + (double)(k - 1) * framePeriod >= t)
+        k--;
+    while (gridStart + (double)k * framePeriod < t)
+        k++;
+
+    return k;
+}
+
+int64_t countVideoFrames(State *state)
+{
+    if (state == NULL)
+        return 0;
+
+    int64_t first = firstGridFrame(state, state->startTime);
+    int64_t stop = firstGridFrame(state, videoStopTime(state));
+
+    return stop > first ? stop - first : 0;
+}
+
+// Earliest time a render must start from so that frames from segmentStart onwards
+// match a render of the whole video: every note still on screen at segmentStart
+// needs its dynamics integrated from its first frame.
+static double warmUpTime(State *state, double segmentStart)
+{
+    MidiSong *song = state->song;
+    NoteRef *ref = NULL;
+    MidiNote *note = NULL;
+
+    double warmTime = segmentStart - state->windowTimeSpan;
+    for (int i = 0; i < song->nIndexedNotes && song->noteIndex[i].startTime <= segmentStart; i++)
+    {
+        ref = &song->noteIndex[i];
+        note = &song->tracks[ref->track].notes[ref->index];
+        // Pedals have no dynamics; they only need to be in the active set
+        if (note->isPedal)
+            continue;
+        if (note->stopTime + state->windowTimeSpan > segmentStart && note->startTime < warmTime)
+            warmTime = note->startTime;
+    }
+
+    // The title falls during the first window time span
+    if (warmTime < state->windowTimeSpan)
+        warmTime = 0.0;
+
+    return warmTime;
+}
+
 int flow(State *state)
 {
     if (state == NULL)
         return VIDEO_ARG;
 
-    int frameCounter = 0;
+    int64_t frameCounter = 0;
     double elapsedAudioTime = 0;
     bool moreAudio = true;
     int status = VIDEO_OK;
+    // First failure of the frame pipeline, which outlives the loop
+    int pipelineStatus = VIDEO_OK;
 
     int w = 0, h = 0;
     SDL_QueryTexture(state->videoState.videoTexture, NULL, NULL, &w, &h);
@@ -211,25 +326,43 @@ int flow(State *state)
     MidiTrack *track = NULL;
     MidiNote *note = NULL;
 
+    uint64_t counter = 0;
+    double noteLengthCounter = 0.0;
+
+    // The title drifts like a note
+    const char *titleText = state->videoState.videoTitleText;
     MidiNote titleTextNote = {0};
     titleTextNote.startTime = 0;
-    titleTextNote.message = strdup(state->videoState.videoTitleText);
-    if (titleTextNote.message == NULL)
-        return VIDEO_MEMORY;
     titleTextNote.note = (minNote + maxNote) / 2;
 
-    initializeNoteDynamics(state, &titleTextNote, song->noteSpan, minNote);
-    titleTextNote.dynamics.y[0] = state->videoState.frameHeight / 2;
+    // Reproducible randomness. Segmented renders share a field made up front.
+    if (state->shearField.table == NULL)
+    {
+        if (state->randomSeed != (unsigned int)-1)
+            srand(state->randomSeed);
+        status = initShearField(&state->shearField, state->nShearYPoints, state->shearDeltaT, song->maxTime, state->videoState.frameHeight);
+        if (status != SHEAR_OK)
+            return VIDEO_MEMORY;
+    }
+
+    // Control points of the notes on screen
+    PhysicsBatch physics = {0};
+    status = initPhysicsBatch(state, &physics);
+    if (status != PHYSICS_OK)
+    {
+        freePhysicsBatch(&physics);
+        return VIDEO_MEMORY;
+    }
+
+    initializeNoteDynamics(state, &physics, &titleTextNote, song->noteSpan, minNote);
+    placeNoteHead(&physics, &titleTextNote, state->videoState.frameHeight / 2);
 
     double x = 0;
     double noteLength = 0;
     RGBAColour noteColour = {0};
 
-    double maxTime = song->maxTime + state->extraTime;
     double startTime = state->startTime;
-    double stopTime = state->stopTime;
-    if (stopTime < 0.0)
-        stopTime = maxTime;
+    double stopTime = videoStopTime(state);
 
     double videoSeconds = stopTime + state->windowTimeSpan - startTime;
     state->remainingTime = videoSeconds;
@@ -241,7 +374,7 @@ int flow(State *state)
     int minutesLeft = 0;
     double secondsLeft = 0.0;
 
-    if (state->verbose)
+    if (state->verbose && !state->segmentWorker)
     {
         double hours = floor(videoSeconds / 3600.0);
         double minutes = floor((videoSeconds - (3600.0 * hours)) / 60.0);
@@ -249,60 +382,96 @@ int flow(State *state)
         printf("Video duration: %02.0lf:%02.0lf:%03.1lf\n", hours, minutes, seconds);
     }
 
-    state->nShearTimes = (int) floor(song->maxTime / state->shearDeltaT) + 1;
-
     RGBAColour c = state->backgroundColour;
 
     // Bezier curve control points
-    Sint16 xp[NOTE_DYNAMICS_POINTS * 2] = {0};
-    Sint16 yp[NOTE_DYNAMICS_POINTS * 2] = {0};
+    Sint16 xp[NOTE_TESSELLATION_POINTS * 2] = {0};
+    Sint16 yp[NOTE_TESSELLATION_POINTS * 2] = {0};
     // SDL_Point points[22] = {0};
 
     double x1 = 0;
     double lineWidth = 0;
 
-    NoteDynamics *d = NULL;
-
-    // Reproducible randomness
-    if (state->randomSeed >= 0)
-        srand(state->randomSeed);
+    float *dx = NULL;
+    float *dy = NULL;
+    bool showTitle = false;
 
-    TTF_Font* Sans = TTF_OpenFont("DejaVuSans.ttf", 24);
-    SDL_Color White = {255, 255, 255, 255};
-    int ctWidth = 0;
-    int ctHeight = 0;
+    // Frames drawn straight into the encoder's YUV planes, text included
+    bool yuvTarget = state->videoState.yuvRenderTarget;
 
-    TTF_Font* titleFont = TTF_OpenFont(state->videoState.videoTitleFont, state->videoState.videoTitlefontSize);
-    int titleWidth = 0;
-    int titleHeight = 0;
-    TTF_SizeText(titleFont, titleTextNote.message, &titleWidth, &titleHeight);
-
-    SDL_SetRenderTarget(state->videoState.renderer, state->videoState.videoTexture);
+    // Strings are rendered once and reused every frame
+    TextCache textCache = {0};
+    if (initTextCache(&textCache, state->videoState.renderer, yuvTarget ? &state->videoState.raster : NULL) != TEXT_OK)
+    {
+        freePhysicsBatch(&physics);
+        return VIDEO_MEMORY;
+    }
+    TextTexture *title = cachedText(&textCache, state->videoState.videoTitleFont, state->videoState.videoTitlefontSize, titleText);
+    int titleWidth = title != NULL ? title->width : 0;
+    int titleHeight = title != NULL ? title->height : 0;
+
+    // Natively rasterized frames are drawn on the renderer's surface, which is the frame buffer
+    bool nativeRaster = state->videoState.noteRasterizer == NOTE_RASTERIZER_NATIVE;
+    // SDL_RenderGeometry draws every note of a frame in one call
+    bool geometryRaster = state->videoState.noteRasterizer == NOTE_RASTERIZER_SDL_GEOMETRY;
+    GeometryBatch geometry = {0};
+    float xf[NOTE_TESSELLATION_POINTS * 2] = {0};
+    float yf[NOTE_TESSELLATION_POINTS * 2] = {0};
+    // Centre line of one note
+    float cx[NOTE_TESSELLATION_POINTS] = {0};
+    float cy[NOTE_TESSELLATION_POINTS] = {0};
+
+    // Crowded frames sum notes per pixel instead of blending each, natively rasterized only
+    DensityBuffer density = {0};
+    bool dense = false;
+    int64_t denseFrames = 0;
+
+    if (!nativeRaster)
+        SDL_SetRenderTarget(state->videoState.renderer, state->videoState.videoTexture);
     SDL_SetRenderDrawBlendMode(state->videoState.renderer, SDL_BLENDMODE_BLEND);
-    SDL_Rect message_rect;
-    message_rect.x = state->videoState.frameWidth / 2 - titleWidth / 2;
-    message_rect.y = 0;
-    message_rect.w = titleWidth;
-    message_rect.h = titleHeight;
-
     SDL_Rect titleRect;
     titleRect.x = state->videoState.frameWidth / 2 - titleWidth / 2; 
     titleRect.y = state->videoState.frameHeight / 2 - titleHeight / 2;
     titleRect.w = titleWidth;
     titleRect.h = titleHeight;
-    titleTextNote.dynamics.y[0] = titleRect.y;
+    dynamicsY(&physics, &titleTextNote)[0] = titleRect.y;
 
     RGBAColour tc = state->videoState.videoTitleColour;
     double titleAl = 255.0;
 
-    MidiNote *pedal = NULL;
+    ControllerCursor sustainCursor[MIDI_CHANNELS] = {0};
+    uint16_t sustain = 0;
+    uint16_t channelSustain = 0;
     RGBAColour defaultBg = c;
     RGBAColour bg = defaultBg;
     double colourScaling = 1.0;
     int notePoints = 0;
 
-    MidiNote *statusNote = NULL;
-    MidiNote *refNote = NULL;
+
+    ActiveNotes active = {0};
+    NoteRef *ref = NULL;
+    int activeInd = 0;
+
+    // Frames of bare background like the one before are not drawn or converted again
+    bool reuseStatic = state->videoState.reuseStaticFrames;
+    bool sceneEmpty = false;
+    bool lastSceneEmpty = false;
+    bool staticFrame = false;
+    bool drawFrame = false;
+    bool finalFrame = false;
+    bool dropFrame = false;
+    RGBAColour lastBg = {0};
+    int64_t staticFrames = 0;
+
+    // Tiles drawn on each frame. Conversion and blur fill the others with the background.
+    bool sparse = state->videoState.sparseTiles;
+    TileMask *tiles = &state->videoState.tiles;
+    bool tilesCleared = false;
+    RGBAColour clearedBg = {0};
+    double left = 0.0;
+    double right = 0.0;
+    double top = 0.0;
+    double bottom = 0.0;
 
     SDL_Event sdlEvent = {0};
 
@@ -314,11 +483,60 @@ int flow(State *state)
     double lastRealtime = (double)clockTime.tv_sec + (double)clockTime.tv_usec/1000000.0;
     double currentRealtime = lastRealtime;
 
-    videoTime = state->startTime - state->windowTimeSpan;
-    if (videoTime < 0.)
-        videoTime = 0.;
-    for (; videoTime < stopTime && running == true; videoTime += framePeriod, state->remainingTime -= framePeriod)
+    // Frames are on a fixed grid so that separate renders of parts of the video agree
+    double gridStart = videoGridStart(state);
+    int64_t firstOutputFrame = firstGridFrame(state, state->startTime);
+    int64_t gridFrame = 0;
+    int64_t lastFrame = -1;
+    bool emitFrame = false;
+
+    // A segment of the video: output frames firstFrame to firstFrame + nFrames - 1
+    if (state->nFrames > 0)
+    {
+        lastFrame = state->firstFrame + state->nFrames - 1;
+        if (state->firstFrame > 0 && !state->closedFormPhysics)
+        {
+            gridFrame = firstGridFrame(state, warmUpTime(state, gridStart + (double)(firstOutputFrame + state->firstFrame) * framePeriod));
+            if (gridFrame > firstOutputFrame)
+                frameCounter = gridFrame - firstOutputFrame;
+        }
+    }
+
+    // Closed-form physics places notes without the frames before: start at the first one to emit
+    if (state->closedFormPhysics)
     {
+        // The title fades once per frame it is shown
+        for (int64_t k = 0; k < firstOutputFrame + state->firstFrame && gridStart + (double)k * framePeriod < state->windowTimeSpan; k++)
+        {
+            titleAl -= titleAl * framePeriod / (state->videoState.videoTitleDecayTime / 20.0);
+            if (titleAl < 1.0)
+                titleAl = 1.0;
+        }
+        gridFrame = firstOutputFrame + state->firstFrame;
+        frameCounter = state->firstFrame;
+    }
+
+    // Render on this thread, convert / filter / encode on others
+    Pipeline pipeline = {0};
+    bool pipelined = state->pipelineDepth > 0;
+    if (pipelined)
+    {
+        status = initPipeline(&pipeline, &state->videoState, &state->audioState, state->pipelineDepth, state->pipelineThreads);
+        if (status != VIDEO_OK)
+        {
+            fprintf(stderr, "Problem starting the frame pipeline.\n");
+            goto cleanup;
+        }
+    }
+
+    for (; running == true; gridFrame++, state->remainingTime -= framePeriod)
+    {
+        videoTime = gridStart + (double)gridFrame * framePeriod;
+        if (videoTime >= stopTime || (lastFrame >= 0 && frameCounter > lastFrame))
+            break;
+        // Frames before the start time (and before a segment) only advance the physics
+        emitFrame = videoTime >= state->startTime && frameCounter >= state->firstFrame;
+
         if (state->videoState.sdlRendering)
         {
             if (SDL_PollEvent(&sdlEvent))
@@ -338,9 +556,28 @@ int flow(State *state)
         hoursMinutesSeconds(videoTime, &hours, &minutes, &seconds);
         hoursMinutesSeconds(state->remainingTime, &hoursLeft, &minutesLeft, &secondsLeft);
 
-        if (state->pedalModifiesBackground && pedal != NULL && pedal->startTime <= videoTime && pedal->stopTime > videoTime)
+        // Notes that should appear on screen
+        status = updateActiveNotes(&active, song, videoTime, state->windowTimeSpan, &physics);
+        if (status != MIDI_OK)
+        {
+            status = VIDEO_MEMORY;
+            goto cleanup;
+        }
+
+        // Deepest sustain pedal of any channel
+        sustain = 0;
+        if (state->pedalModifiesBackground)
+        {
+            for (int ch = 0; ch < MIDI_CHANNELS; ch++)
+            {
+                channelSustain = controllerValue(song, ch, MIDI_CONTROLLER_SUSTAIN, videoTime, &sustainCursor[ch]);
+                if (channelSustain > sustain)
+                    sustain = channelSustain;
+            }
+        }
+        if (sustain > 0)
         {
-            colourScaling = (double)pedal->speed / 127.0;
+            colourScaling = 1.0 - (double)sustain / 127.0;
             bg.r = (int) (defaultBg.r * colourScaling);
             bg.g = (int) (defaultBg.g * colourScaling);
             bg.b = (int) (defaultBg.b * colourScaling);
@@ -348,10 +585,7 @@ int flow(State *state)
         else
             bg = defaultBg;
 
-        SDL_SetRenderDrawColor(state->videoState.renderer, bg.r, bg.g, bg.b, bg.a);
-        SDL_RenderClear(state->videoState.renderer);
-
-        if (frameCounter % ((int)updateRate) == 0)
+        if (!state->segmentWorker && frameCounter % ((int)updateRate) == 0)
         {
             if (videoTime >= state->startTime)
             {
@@ -365,7 +599,7 @@ int flow(State *state)
                     else
                         fps = 0.0;
                     lastRealtime = currentRealtime;
-                    printf("  (notes-per-frame: %llu, notelengths=%.1lf, fps=%.1lf          )", (uint64_t)((double)counter / updateRate), noteLengthCounter, fps);
+                    printf("  (notes-per-frame: %llu, visible-notes: %d, notelengths=%.1lf, fps=%.1lf          )", (uint64_t)((double)counter / updateRate), active.nNotes, noteLengthCounter, fps);
                 }
                 counter = 0;
                 noteLengthCounter = 0.0;
@@ -376,23 +610,129 @@ int flow(State *state)
             fflush(stdout);
         }
 
+        // Move the title and every note on screen in one batch
+        showTitle = strlen(titleText) > 0 && videoTime < state->windowTimeSpan;
+        status = PHYSICS_OK;
+        if (showTitle)
+            status = queueNoteDynamics(&physics, &titleTextNote, 0);
+        for (int i = 0; i < active.nNotes && status == PHYSICS_OK; i++)
+        {
+            ref = &active.notes[i];
+            note = &song->tracks[ref->track].notes[ref->index];
+            if (note->isPedal)
+                continue;
+            if (!note->playing)
+            {
+                note->screenTime = videoTime - note->startTime;
+                note->playing = true;
+                status = initializeNoteDynamics(state, &physics, note, song->noteSpan, minNote);
+                if (status != PHYSICS_OK)
+                    break;
+            }
+            status = queueNoteDynamics(&physics, note, ref->track);
+        }
+        if (status != PHYSICS_OK)
+            goto cleanup;
+        updateNoteDynamics(state, &physics, framePeriod, videoTime);
+
+        // Nothing on screen but the background: the same frame as the last if that was too
+        sceneEmpty = !(showTitle && title != NULL) && (state->replaceTrackColour || state->cycleColourTables < 0);
+        for (int i = 0; i < active.nNotes && sceneEmpty; i++)
+        {
+            ref = &active.notes[i];
+            track = &song->tracks[ref->track];
+            note = &track->notes[ref->index];
+            if (ref->track < 1 || track->tempoTrack || track->transportTrack || note->isPedal)
+                continue;
+            if (dynamicsY(&physics, note)[dynamicsPoints(&physics, note)-1] <= state->videoState.frameHeight - 1)
+                sceneEmpty = false;
+        }
+        staticFrame = emitFrame && reuseStatic && sceneEmpty && lastSceneEmpty && memcmp(&bg, &lastBg, sizeof bg) == 0;
+        drawFrame = emitFrame && !staticFrame;
+        if (emitFrame)
+        {
+            lastSceneEmpty = sceneEmpty;
+            lastBg = bg;
+        }
+
+        if (drawFrame && yuvTarget)
+        {
+            // The encoder or filter graph may still hold the last frame
+            if (av_frame_make_writable(state->videoState.videoFrame) < 0)
+            {
+                status = VIDEO_MEMORY;
+                goto cleanup;
+            }
+            rasterTargetPlanes(&state->videoState.raster, state->videoState.videoFrame->data, state->videoState.videoFrame->linesize);
+        }
+        if (drawFrame && nativeRaster)
+        {
+            // Only the tiles drawn on the last frame, when the rest is this background already
+            if (sparse && tilesCleared && memcmp(&bg, &clearedBg, sizeof bg) == 0)
+                rasterClearTiles(&state->videoState.raster, tiles, bg.r, bg.g, bg.b, bg.a);
+            else
+                rasterClear(&state->videoState.raster, bg.r, bg.g, bg.b, bg.a);
+            tilesCleared = true;
+            clearedBg = bg;
+        }
+        else if (drawFrame)
+        {
+            SDL_SetRenderDrawColor(state->videoState.renderer, bg.r, bg.g, bg.b, bg.a);
+            SDL_RenderClear(state->videoState.renderer);
+        }
+        if (drawFrame && sparse)
+            resetTileMask(tiles, bg.r, bg.g, bg.b);
+
+        dense = drawFrame && nativeRaster && state->densityThreshold > 0 && active.nNotes >= state->densityThreshold;
+        if (dense && density.cells == NULL && initDensityBuffer(&density, state->videoState.frameWidth, state->videoState.frameHeight) != DENSITY_OK)
+        {
+            status = VIDEO_MEMORY;
+            goto cleanup;
+        }
+        if (dense)
+            denseFrames++;
+
         // Video title
-        if (strlen(titleTextNote.message) > 0 && videoTime < state->windowTimeSpan)
+        if (showTitle)
         {
-            updateNoteDynamics(state, &titleTextNote, 0, framePeriod, videoTime, pedal);
             titleAl -= titleAl * framePeriod / (state->videoState.videoTitleDecayTime / 20.0);
             if (titleAl < 1.0)
                 titleAl = 1.0;
             tc.a = (int)titleAl;
-            SDL_Surface* videoTitleSurface = TTF_RenderText_Blended(titleFont, titleTextNote.message, (SDL_Color){tc.r, tc.g, tc.b, tc.a});
-            SDL_Texture* titleTexture = SDL_CreateTextureFromSurface(state->videoState.renderer, videoTitleSurface);
-            titleRect.y = titleTextNote.dynamics.y[0];
-            SDL_RenderCopy(state->videoState.renderer, titleTexture, NULL, &titleRect);
-            SDL_FreeSurface(videoTitleSurface);
-            SDL_DestroyTexture(titleTexture);        
+            // Looked up again each frame: other strings may have evicted the entry since
+            if (drawFrame)
+                title = cachedText(&textCache, state->videoState.videoTitleFont, state->videoState.videoTitlefontSize, titleText);
+            if (drawFrame && title != NULL)
+            {
+                titleRect.y = dynamicsY(&physics, &titleTextNote)[0];
+                drawText(&textCache, title, titleRect.x, titleRect.y, tc);
+                if (sparse)
+                    markTiles(tiles, titleRect.x, titleRect.y, titleRect.x + titleWidth, titleRect.y + titleHeight);
+                // Queued SDL drawing must land before notes are drawn natively
+                if (nativeRaster)
+                    SDL_RenderFlush(state->videoState.renderer);
+            }
+        }
+
+        // Colour table label, drawn once per frame at the top centre
+        if (drawFrame && !state->replaceTrackColour && state->cycleColourTables > -1)
+        {
+            int ct = (frameCounter/(int)state->videoState.frameRate) % NCOLOURTABLES;
+            char msg[256] = {0};
+            snprintf(msg, 256, "colourTables[%d][%d]", ct, state->cycleColourTables);
+            TextTexture *label = cachedText(&textCache, TEXT_OVERLAY_FONT, TEXT_OVERLAY_FONTSIZE, msg);
+            if (label != NULL)
+            {
+                drawText(&textCache, label, state->videoState.frameWidth / 2 - label->width / 2, 0, (RGBAColour){255, 255, 255, 255});
+                if (sparse)
+                    markTiles(tiles, state->videoState.frameWidth / 2 - label->width / 2, 0, state->videoState.frameWidth / 2 - label->width / 2 + label->width, label->height);
+                if (nativeRaster)
+                    SDL_RenderFlush(state->videoState.renderer);
+            }
         }
 
         // Loop over tracks
+        activeInd = 0;
         for (int tr = 1; tr < song->nTracks; tr++)
         {
             track = &song->tracks[tr];
@@ -407,126 +747,192 @@ int flow(State *state)
             {
                 int ct = (frameCounter/(int)state->videoState.frameRate) % NCOLOURTABLES;
                 noteColour = colourFromTable(ct, state->cycleColourTables);
-                // TTF howto at https://stackoverflow.com/questions/22886500/how-to-render-text-in-sdl2
-                char msg[256] = {0};
-                snprintf(msg, 256, "colourTables[%d][%d]", ct, state->cycleColourTables);
-                SDL_Surface* surfaceMessage = TTF_RenderText_Blended(Sans, msg, White); 
-                // printf("%p\n", Sans);
-                SDL_Texture* message = SDL_CreateTextureFromSurface(state->videoState.renderer, surfaceMessage);
-                status = SDL_RenderCopy(state->videoState.renderer, message, NULL, &message_rect);
-                SDL_FreeSurface(surfaceMessage);
-                SDL_DestroyTexture(message);
             }
             else
                 noteColour = colourFromTable(state->colourTable, tr);
 
 
-            // Draw each note that should be on the screen
+            // Draw each note of this track that is on the screen
+            // Active notes are sorted by track, so pick up where the last track left off
+            while (activeInd < active.nNotes && active.notes[activeInd].track < tr)
+                activeInd++;
 
-            for (int n = 0; n < track->nNotes; n++)
+            for (; activeInd < active.nNotes && active.notes[activeInd].track == tr; activeInd++)
             {
-                // Operate only on notes that should appear on screen
-                note = &track->notes[n];
-                if ((note->startTime <= videoTime && note->stopTime + state->windowTimeSpan > videoTime))
+                ref = &active.notes[activeInd];
+                note = &track->notes[ref->index];
+                if (note->isPedal)
                 {
-                    if (note->isPedal)
-                    {
-                        if (note->startTime <= videoTime && note->stopTime > videoTime)
-                            pedal = note;
-                        // const Sint16 px[4] = {0, 50, 50, 0};
-                        // const Sint16 py[4] = {0, 0, 50, 50};
-                        // filledPolygonRGBA(state->videoState.renderer, px, py, 4, 255, 255, 255, pedal->speed * 2);
-                        continue;
-                    }
-                    if (!note->playing)
-                    {
-                        note->screenTime = videoTime - note->startTime;
-                        note->playing = true;
-                        status = initializeNoteDynamics(state, note, song->noteSpan, minNote);
-                        if (status != PHYSICS_OK)
-                            return status;
-                    }
-                    statusNote = &noteStatus[note->note][note->channel];
-                    refNote = (MidiNote*)statusNote->referenceMidiNote;
-                    if (refNote && statusNote->playing && refNote->stopTime < videoTime)
-                    {
-                        statusNote->playing = false;
-                        statusNote->referenceMidiNote = NULL;
-                    }
-
-                    alphaF = (255.0 * (0.2 + exp(-note->screenTime / state->noteVisibilityHalfLife) * (double)note->speed / (double)NOTE_MAX_SPEED));
+                    // const Sint16 px[4] = {0, 50, 50, 0};
+                    // const Sint16 py[4] = {0, 0, 50, 50};
+                    // filledPolygonRGBA(state->videoState.renderer, px, py, 4, 255, 255, 255, pedal->speed * 2);
+                    continue;
+                }
+                alphaF = (255.0 * (0.2 + exp(-note->screenTime / state->noteVisibilityHalfLife) * (double)note->speed / (double)NOTE_MAX_SPEED));
 
-                    if (alphaF > 255)
-                        alphaF = 255;
-                    
-                    alpha = (int) floor(alphaF);
+                if (alphaF > 255)
+                    alphaF = 255;
+                
+                alpha = (int) floor(alphaF);
 
-                    // Update note dynamics
-                    updateNoteDynamics(state, note, tr, framePeriod, videoTime, pedal);
+                dx = dynamicsX(&physics, note);
+                dy = dynamicsY(&physics, note);
+                if (dy[dynamicsPoints(&physics, note)-1] > state->videoState.frameHeight - 1)
+                    continue;
 
-                    d = &note->dynamics;
-                    if (d->y[NOTE_DYNAMICS_POINTS-1] > state->videoState.frameHeight - 1)
-                        continue;
+                lineWidth = (state->maxNoteWidth * note->speed) / 127.0;
 
-                    lineWidth = (state->maxNoteWidth * note->speed) / 127.0;
+                // Fill polygon points
+                if (videoTime >= state->startTime)
+                {
+                    noteLengthCounter += note->stopTime - note->startTime;
+                    for (int u = 0; u < dynamicsPoints(&physics, note); u++)
+                        if (dy[u] >= (int)(-state->videoState.frameHeight / 100.0))
+                            notePoints = u + 1;
+                        else
+                            break;
+
+                    // Curve through the control points, or the points themselves
+                    if (state->noteLodError > 0.0)
+                        notePoints = tessellateNote(dx, dy, notePoints, (float)state->noteLodError, cx, cy, NOTE_TESSELLATION_POINTS);
+                    else
+                    {
+                        memcpy(cx, dx, notePoints * sizeof *cx);
+                        memcpy(cy, dy, notePoints * sizeof *cy);
+                    }
 
-                    // Fill polygon points
-                    if (videoTime >= state->startTime)
+                    counter++;
+                    for (int u = 0; u < notePoints; u++)
                     {
-                        noteLengthCounter += note->length;
-                        for (int u = 0; u < NOTE_DYNAMICS_POINTS; u++)
-                            if (d->y[u] >= (int)(-state->videoState.frameHeight / 100.0))
-                                notePoints = u + 1;
-                            else
-                                break;
-
-                        counter++;
-                        for (int u = 0; u < notePoints; u++)
+                        x1 = cx[u] - lineWidth / 2.0;
+                        // Bounding box, for the tile mask
+                        if (u == 0 || x1 < left)
+                            left = x1;
+                        if (u == 0 || x1 + lineWidth > right)
+                            right = x1 + lineWidth;
+                        if (u == 0 || cy[u] < top)
+                            top = cy[u];
+                        if (u == 0 || cy[u] > bottom)
+                            bottom = cy[u];
+                        if (nativeRaster || geometryRaster)
+                        {
+                            // Sub-pixel edges for anti-aliasing
+                            yf[u] = cy[u];
+                            yf[notePoints*2 - 1 - u] = yf[u];
+                            xf[u] = (float) x1;
+                            xf[notePoints*2 - 1 - u] = (float) (x1 + lineWidth);
+                        }
+                        else
                         {
-                            yp[u] = d->y[u];
+                            yp[u] = cy[u];
                             yp[notePoints*2 - 1 - u] = yp[u];
-                            x1 = d->x[u] - lineWidth / 2.0;
                             xp[u] = (int) x1;
                             xp[notePoints*2 - 1 - u] = (int) (x1 + lineWidth);
                         }
-                        // Turn off any playing note
-                        if (statusNote->playing)
+                    }
+                    if (dense)
+                        splatDensityNote(&density, cx, cy, notePoints, (float)lineWidth, noteColour.r, noteColour.g, noteColour.b, alpha);
+                    else if (drawFrame && nativeRaster)
+                        rasterFillPolygon(&state->videoState.raster, xf, yf, notePoints * 2, noteColour.r, noteColour.g, noteColour.b, alpha);
+                    else if (drawFrame && geometryRaster)
+                    {
+                        status = addGeometryStrip(&geometry, xf, yf, notePoints * 2, noteColour.r, noteColour.g, noteColour.b, alpha);
+                        if (status != GEOMETRY_OK)
                         {
-                            if (refNote)
-                            {
-                                refNote->stopTime = videoTime;
-                            }
+                            status = VIDEO_MEMORY;
+                            goto cleanup;
                         }
-
-                        statusNote->playing = true;
-                        statusNote->referenceMidiNote = (void*)note;
-
-                        filledPolygonRGBA(state->videoState.renderer, xp, yp, notePoints * 2, noteColour.r, noteColour.g, noteColour.b, alpha);
-                        note->screenTime += framePeriod;
                     }
+                    else if (drawFrame)
+                        filledPolygonRGBA(state->videoState.renderer, xp, yp, notePoints * 2, noteColour.r, noteColour.g, noteColour.b, alpha);
+                    if (drawFrame && sparse && notePoints > 0)
+                        markTiles(tiles, left, top, right, bottom);
+                    note->screenTime += framePeriod;
                 }
-
             }
         }
 
-        if (videoTime >= state->startTime)
+        if (drawFrame && geometryRaster)
+            drawGeometryBatch(&geometry, state->videoState.renderer);
+        else if (dense)
+            resolveDensity(&density, &state->videoState.raster);
+
+        // Clean tiles must stay background out to the reach of the blur
+        if (drawFrame && sparse)
+            dilateTileMask(tiles, state->videoState.tileHalo);
+
+        // With variable frame rate output a static frame is dropped, unless it ends the video
+        finalFrame = videoTime + framePeriod >= stopTime || frameCounter == lastFrame;
+        dropFrame = staticFrame && state->videoState.variableFrameRate && !finalFrame;
+        if (staticFrame)
+            staticFrames++;
+
+        if (emitFrame)
         {
-            generateFrame(&state->videoState, frameCounter);
-            while (state->audioState.haveAudio && elapsedAudioTime < videoTime && moreAudio)
+            if (pipelined)
             {
-                status = transcodeAudioFrames(&state->audioState, frameCounter, &elapsedAudioTime, state->videoState.videoContext, state->videoState.videoCodecContext);
-                if (status == VIDEO_AUDIO_EOF)
-                    moreAudio = false;
+                if (staticFrame)
+                    status = pipelineRepeatFrame(&pipeline, frameCounter - state->firstFrame, videoTime, dropFrame);
+                else
+                    status = pipelineSubmitFrame(&pipeline, frameCounter - state->firstFrame, videoTime, sceneEmpty);
+                if (status != VIDEO_OK)
+                {
+                    fprintf(stderr, "\nProblem in frame pipeline: got status %d.\n", status);
+                    pipelineStatus = status;
+                    running = false;
+                }
+            }
+            else
+            {
+                if (!staticFrame)
+                    generateFrame(&state->videoState, frameCounter - state->firstFrame);
+                else if (!dropFrame)
+                    repeatFrame(&state->videoState, frameCounter - state->firstFrame);
+                while (state->audioState.haveAudio && elapsedAudioTime < videoTime && moreAudio)
+                {
+                    status = transcodeAudioFrames(&state->audioState, frameCounter, &elapsedAudioTime, state->videoState.videoContext, state->videoState.videoCodecContext);
+                    if (status == VIDEO_AUDIO_EOF)
+                        moreAudio = false;
+                }
             }
-            frameCounter++;
             fps++;
+            __atomic_store_n(&state->framesRendered, frameCounter - state->firstFrame + 1, __ATOMIC_RELEASE);
         }
+        if (videoTime >= state->startTime)
+            frameCounter++;
     }
-    
+
+    if (pipelined)
+    {
+        status = finishPipeline(&pipeline);
+        if (pipelineStatus == VIDEO_OK)
+            pipelineStatus = status;
+    }
+
+    if (state->verbose && !state->segmentWorker && staticFrames > 0)
+        printf("\nStatic frames %s: %lld\n", state->videoState.variableFrameRate ? "dropped or repeated" : "repeated", (long long)staticFrames);
+    if (state->verbose && !state->segmentWorker && denseFrames > 0)
+        printf("\nFrames drawn by note density: %lld\n", (long long)denseFrames);
+
     finishVideo(&state->videoState);
 
     finishAudio(&state->audioState, state->videoState.videoContext, state->videoState.videoCodecContext);
 
-    return VIDEO_OK;
+    // A failed stage leaves a truncated video, which is not a success
+    status = pipelineStatus;
+
+cleanup:
+    if (pipelined)
+    {
+        finishPipeline(&pipeline);
+        cleanupPipeline(&pipeline);
+    }
+    freeActiveNotes(&active);
+    freePhysicsBatch(&physics);
+    freeTextCache(&textCache);
+    freeGeometryBatch(&geometry);
+    freeDensityBuffer(&density);
+
+    return status;
 }
 
@@ -24,8 +24,10 @@
 #include "colour.h"
 #include "audio.h"
 #include "video.h"
+#include "shear.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #define FLOW_VERSION "0.1.0"
 
@@ -44,7 +46,10 @@
 #define DEFAULT_NOTE_ACCELERATION 1.0 // pixels per second per second
 #define DEFAULT_FLOW_SHEAR_SCALE 1.0
 #define DEFAULT_WIGGLE_WAVELENGTH 0.1
+#define DEFAULT_NOTE_LOD_ERROR 0.25 // pixels
+#define DEFAULT_DENSITY_THRESHOLD 20000 // notes on screen
 #define DEFAULT_COLOUR_TABLE 0
+#define DEFAULT_VIDEO_SEGMENTS 1
 
 #define DEFAULT_VIDEO_TITLE_FONT "DejaVuSans.ttf"
 #define DEFAULT_VIDEO_TITLE_FONTSIZE 160
@@ -77,12 +82,15 @@ typedef struct State
     int nShearYPoints;
     double shearDeltaT;
     double wigglePeriod;
-    int nShearTimes;
+    ShearField shearField; // read-only once built, shared by segments
     double wiggleOffset;
     double wiggleAmplitude;
     double wiggleWavelength; // as a fraction of frame height
     double flowShearScale;
     double noteAcceleration;
+    double noteLodError; // pixels a note may stray from NOTE_DYNAMICS_POINTS control points; 0: always use them all
+    int densityThreshold; // notes on screen from which they are splatted into a density buffer; 0: never
+    bool closedFormPhysics; // note positions as functions of time, so any frame can be drawn without those before
     unsigned int randomSeed;
     RGBAColour backgroundColour;
     RGBAColour trackColour;
@@ -100,7 +108,18 @@ typedef struct State
     double extraTime;
     double remainingTime;
 
+    int pipelineDepth;
+    int pipelineThreads;
+
+    // Segmented rendering: nSegments renders of consecutive output frames
+    int nSegments;
+    bool segmentWorker;
+    int64_t firstFrame;
+    int64_t nFrames; // 0: to the end of the video
+    int64_t framesRendered;
+
     bool verbose;
+    bool useSongCache; // load and save the parsed song in <midifile>.flowcache
 
 } State;
 
@@ -108,5 +127,10 @@ int initState(State *state);
 
 int flow(State *state);
 
+double videoStopTime(State *state);
+double videoGridStart(State *state);
+int64_t firstGridFrame(State *state, double t);
+int64_t countVideoFrames(State *state);
+
 #endif // _FLOW_H
 
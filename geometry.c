@@ -0,0 +1,122 @@
+/*
+
+    flow: geometry.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "geometry.h"
+
+#include <stdlib.h>
+
+void freeGeometryBatch(GeometryBatch *batch)
+{
+    if (batch == NULL)
+        return;
+
+    free(batch->vertices);
+    free(batch->indices);
+    batch->vertices = NULL;
+    batch->indices = NULL;
+    batch->nVertices = 0;
+    batch->allocatedVertices = 0;
+    batch->nIndices = 0;
+    batch->allocatedIndices = 0;
+
+    return;
+}
+
+static int reserveGeometry(GeometryBatch *batch, int nVertices, int nIndices)
+{
+    if (batch->nVertices + nVertices > batch->allocatedVertices)
+    {
+        int allocated = batch->allocatedVertices > 0 ? batch->allocatedVertices : GEOMETRY_ALLOCATION_INCREMENT;
+        while (batch->nVertices + nVertices > allocated)
+            allocated *= 2;
+        SDL_Vertex *mem = realloc(batch->vertices, allocated * sizeof *batch->vertices);
+        if (mem == NULL)
+            return GEOMETRY_MEMORY;
+        batch->vertices = mem;
+        batch->allocatedVertices = allocated;
+    }
+    if (batch->nIndices + nIndices > batch->allocatedIndices)
+    {
+        int allocated = batch->allocatedIndices > 0 ? batch->allocatedIndices : GEOMETRY_ALLOCATION_INCREMENT;
+        while (batch->nIndices + nIndices > allocated)
+            allocated *= 2;
+        int *mem = realloc(batch->indices, allocated * sizeof *batch->indices);
+        if (mem == NULL)
+            return GEOMETRY_MEMORY;
+        batch->indices = mem;
+        batch->allocatedIndices = allocated;
+    }
+
+    return GEOMETRY_OK;
+}
+
+int addGeometryStrip(GeometryBatch *batch, const float *x, const float *y, int nPoints, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    if (batch == NULL || x == NULL || y == NULL)
+        return GEOMETRY_ARG;
+
+    int nRungs = nPoints / 2;
+    if (nRungs < 2)
+        return GEOMETRY_OK;
+
+    int status = reserveGeometry(batch, 2 * nRungs, 6 * (nRungs - 1));
+    if (status != GEOMETRY_OK)
+        return status;
+
+    SDL_Color colour = {r, g, b, a};
+    int first = batch->nVertices;
+    SDL_Vertex *v = batch->vertices + first;
+    for (int u = 0; u < nRungs; u++)
+    {
+        v[2*u] = (SDL_Vertex){{x[u], y[u]}, colour, {0.0f, 0.0f}};
+        v[2*u + 1] = (SDL_Vertex){{x[nPoints - 1 - u], y[nPoints - 1 - u]}, colour, {0.0f, 0.0f}};
+    }
+    batch->nVertices += 2 * nRungs;
+
+    int *index = batch->indices + batch->nIndices;
+    for (int u = 0; u < nRungs - 1; u++)
+    {
+        int left = first + 2*u;
+        index[0] = left;
+        index[1] = left + 1;
+        index[2] = left + 2;
+        index[3] = left + 1;
+        index[4] = left + 3;
+        index[5] = left + 2;
+        index += 6;
+    }
+    batch->nIndices += 6 * (nRungs - 1);
+
+    return GEOMETRY_OK;
+}
+
+int drawGeometryBatch(GeometryBatch *batch, SDL_Renderer *renderer)
+{
+    if (batch == NULL || renderer == NULL)
+        return GEOMETRY_ARG;
+
+    int status = GEOMETRY_OK;
+    if (batch->nIndices > 0 && SDL_RenderGeometry(renderer, NULL, batch->vertices, batch->nVertices, batch->indices, batch->nIndices) != 0)
+        status = GEOMETRY_RENDER;
+    batch->nVertices = 0;
+    batch->nIndices = 0;
+
+    return status;
+}
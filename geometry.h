@@ -0,0 +1,59 @@
+/*
+
+    flow: geometry.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GEOMETRY_H
+#define _GEOMETRY_H
+
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+#define GEOMETRY_ALLOCATION_INCREMENT 4096
+
+enum GEOMETRY_ERR
+{
+    GEOMETRY_OK = 0,
+    GEOMETRY_ARG = -1,
+    GEOMETRY_MEMORY = -2,
+    GEOMETRY_RENDER = -3
+};
+
+// Triangles of all notes in a frame, submitted to SDL in one call
+typedef struct GeometryBatch
+{
+    SDL_Vertex *vertices;
+    int nVertices;
+    int allocatedVertices;
+    int *indices;
+    int nIndices;
+    int allocatedIndices;
+} GeometryBatch;
+
+void freeGeometryBatch(GeometryBatch *batch);
+
+// Adds a note ribbon given as a polygon in the rasterFillPolygon layout:
+// points 0..n/2-1 down one edge and n/2..n-1 back up the other, pairing
+// point u with point n-1-u. Each pair of rungs becomes two triangles.
+int addGeometryStrip(GeometryBatch *batch, const float *x, const float *y, int nPoints, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+// Draws and empties the batch
+int drawGeometryBatch(GeometryBatch *batch, SDL_Renderer *renderer);
+
+#endif // _GEOMETRY_H
@@ -1,53 +1,114 @@
 #include "flow.h"
 #include "midi.h"
+#include "workers.h"
+#include "songcache.h"
+#include "controllers.h"
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-// TODO handle multiple voices per track?
-static MidiNote storageNotes[MIDI_NOTE_RANGE][MIDI_CHANNELS] = {0};
-static MidiNote pedal[MIDI_CHANNELS] = {0};
-static int currentStatusByte = 0;
-static int currentChannel = 0;
-static int currentChannelMode = 0;
-static int currentSystemChannel = 0;
+// Tracks to parse on the worker pool, one job per track
+typedef struct TrackParseTask
+{
+    MidiTrack *tracks;
+    MidiChunk *chunks;
+    int *status;
+} TrackParseTask;
+
+static void parseTrackJob(void *arg, int index)
+{
+    TrackParseTask *task = (TrackParseTask *)arg;
+
+    MidiParser *parser = calloc(1, sizeof *parser);
+    if (parser == NULL)
+    {
+        task->status[index] = MIDI_MEMORY;
+        return;
+    }
+    task->status[index] = parseMidiTrack(parser, &task->tracks[index], task->chunks[index].data, task->chunks[index].length);
+    free(parser);
+
+    return;
+}
 
 int readMidi(State *state)
 {
 
     int status = MIDI_OK;
 
-    FILE *f = fopen(state->audioState.midiFilename, "r");
-    if (f == NULL)
+    int fd = open(state->audioState.midiFilename, O_RDONLY);
+    if (fd < 0)
     {
         return MIDI_FILE;
     }
 
+    // Tracks are parsed in place, straight from the page cache
+    struct stat fileStat = {0};
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0)
+    {
+        close(fd);
+        return MIDI_FILE;
+    }
+    size_t fileSize = (size_t) fileStat.st_size;
+    const uint8_t *file = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+        return MIDI_READ;
+    madvise((void *)file, fileSize, MADV_SEQUENTIAL);
+
+    // A cache of the parsed song is used as-is if it matches the file and options
+    uint64_t midiHash = 0;
+    if (state->useSongCache)
+    {
+        midiHash = songCacheHash(file, fileSize);
+        if (loadSongCache(state, midiHash, fileSize) == SONG_CACHE_OK)
+        {
+            if (state->verbose)
+            {
+                fprintf(stdout, "Tracks found in %s%s\n", state->audioState.midiFilename, SONG_CACHE_SUFFIX);
+                for (int tr = 0; tr < state->song->nTracks; tr++)
+                    fprintf(stdout, "%4d   \"%s\"\n", tr, state->song->tracks[tr].trackName);
+            }
+            munmap((void *)file, fileSize);
+            return MIDI_OK;
+        }
+    }
+
+    size_t fileOffset = 0;
     MidiChunk c = {0};
+    MidiChunk *chunks = NULL;
+    int *trackStatus = NULL;
+    WorkerPool pool = {0};
 
     // Look for header
-    status = readMidiChunk(f, &c);
-    if (status != MIDI_OK || strcmp("MThd", (const char *)c.hdr) != 0)
+    status = readMidiChunk(file, fileSize, &fileOffset, &c);
+    if (status != MIDI_OK || strcmp("MThd", (const char *)c.hdr) != 0 || c.length < 6)
+    {
+        status = MIDI_FILE;
         goto done;
+    }
 
     MidiSong *song = calloc(1, sizeof *song);
     state->song = song;
-    // Default values
-    song->tempo = 500000; // micro-seconds per quarter note (= 120 beats per minute)
-    song->timeSignatureTop = 4; // 4/4 time
-    song->timeSignatureBottom = 4;
-
     if (song == NULL)
     {
         fprintf(stderr, "Unable to allocate memory for MIDI song.\n");
         status = MIDI_MEMORY;
         goto done;
     }
-    song->format = c.data[0] * 256 + c.data[1];
-    int nTracks = c.data[2] * 256 + c.data[3];
+    // Default values
+    song->tempo = 500000; // micro-seconds per quarter note (= 120 beats per minute)
+    song->timeSignatureTop = 4; // 4/4 time
+    song->timeSignatureBottom = 4;
+
+    song->format = readMidiU16(c.data);
+    int nTracks = readMidiU16(c.data + 2);
     // if most-sig-bit is 0, this is the number of ticks per quarter note
-    // if a 1, this is more complicated...
-    song->division = c.data[4] * 256 + c.data[5];
-    free(c.data);
+    // if a 1, this is the SMPTE frame rate and ticks per frame
+    song->division = readMidiU16(c.data + 4);
 
     // Read Tracks
     if (song->format == 2)
@@ -76,202 +137,297 @@ int readMidi(State *state)
         goto done;
     }
 
-    MidiTrack *track = NULL;
-    int trackByte = 0;
-    uint64_t currentTick = 0;
-
-    if (state->verbose)
-        fprintf(stdout, "Tracks found in %s\n", state->audioState.midiFilename);
+    chunks = calloc(song->nTracks, sizeof *chunks);
+    trackStatus = calloc(song->nTracks, sizeof *trackStatus);
+    if (chunks == NULL || trackStatus == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for MIDI tracks.\n");
+        status = MIDI_MEMORY;
+        goto done;
+    }
 
+    // Find the tracks to parse
     int trackInd = 0;
-    for (int tr = 0; tr < nTracks; tr++)
+    for (int tr = 0; tr < nTracks && trackInd < song->nTracks; tr++)
     {
         // Read track
-        status = readMidiChunk(f, &c);
+        status = readMidiChunk(file, fileSize, &fileOffset, &c);
         if (status != MIDI_OK || strcmp("MTrk", (const char *)c.hdr) != 0)
             goto done;
 
-        // Parse and store track
-        trackByte = 0;
-        currentTick = 0;
         if ((state->trackToDisplay == -1 || state->trackToDisplay == tr || tr == 0))
-        {
-            track = &song->tracks[trackInd];
-            while (trackByte < c.length)
-            {
-                status = getTrackEvent(track, c.data, c.length, &trackByte, &currentTick);
-                if (status != MIDI_OK)
-                {
-                    if (pedal[currentChannel].playing)
-                    {
-                        pedal[currentChannel].stopTick = currentTick;
-                        status = addNote(track);
-                        if (status != MIDI_OK)
-                            return status;
-                        track->notes[track->nNotes-1] = pedal[currentChannel];
-                        track->notes[track->nNotes-1].isPedal = true;
-                    }
-                    goto done;
-                }
-            }
-            if (state->verbose)
-                fprintf(stdout, "%4d   \"%s\"\n", trackInd, track->trackName);
-            trackInd++;
-        }
+            chunks[trackInd++] = c;
+    }
+    if (trackInd < song->nTracks)
+    {
+        fprintf(stderr, "Track %d to display is not in %s, which has %d tracks.\n", state->trackToDisplay, state->audioState.midiFilename, nTracks);
+        status = MIDI_FILE;
+        goto done;
+    }
+
+    // Tracks are independent until their times are set against the tempo track
+    int nHelpers = availableProcessors();
+    if (nHelpers > song->nTracks)
+        nHelpers = song->nTracks;
+    if (nHelpers > WORKERS_MAX_THREADS)
+        nHelpers = WORKERS_MAX_THREADS;
+    nHelpers--;
+    if (nHelpers > 0 && initWorkerPool(&pool, nHelpers) != WORKERS_OK)
+        fprintf(stderr, "Unable to start MIDI parsing threads, parsing serially.\n");
+
+    TrackParseTask task = {.tracks = song->tracks, .chunks = chunks, .status = trackStatus};
+    runWorkers(&pool, parseTrackJob, &task, song->nTracks);
 
-        // Free data
-        free(c.data);
+    if (state->verbose)
+        fprintf(stdout, "Tracks found in %s\n", state->audioState.midiFilename);
+    for (int tr = 0; tr < song->nTracks; tr++)
+    {
+        status = trackStatus[tr];
+        if (status != MIDI_OK)
+            goto done;
+        if (state->verbose)
+            fprintf(stdout, "%4d   \"%s\"\n", tr, song->tracks[tr].trackName);
     }
 
     // Get timings
-    setNoteTimes(song);
+    status = setNoteTimes(song, &pool);
+    if (status != MIDI_OK)
+    {
+        fprintf(stderr, "Unable to convert MIDI ticks to times.\n");
+        goto done;
+    }
+
+    status = buildControllerTimelines(song);
+    if (status != MIDI_OK)
+    {
+        fprintf(stderr, "Unable to allocate memory for controller timelines.\n");
+        goto done;
+    }
+
+    status = buildNoteIndex(song);
+    if (status != MIDI_OK)
+    {
+        fprintf(stderr, "Unable to allocate memory for the note index.\n");
+        goto done;
+    }
+
+    status = normalizeNotes(song, state->pedalModifiesNotelength);
+    if (status != MIDI_OK)
+    {
+        fprintf(stderr, "Unable to allocate memory to normalize notes.\n");
+        goto done;
+    }
+
+    // Not fatal, the song is parsed again next time
+    if (state->useSongCache && writeSongCache(state, midiHash, fileSize) != SONG_CACHE_OK && state->verbose)
+        fprintf(stderr, "Unable to write %s%s\n", state->audioState.midiFilename, SONG_CACHE_SUFFIX);
 
 done:
-    fclose(f);
+    freeWorkerPool(&pool);
+    free(chunks);
+    free(trackStatus);
+    munmap((void *)file, fileSize);
     return status;
 }
 
-int readMidiChunk(FILE *f, MidiChunk *c)
+// Points the chunk at its data in the mapped file and moves past it
+int readMidiChunk(const uint8_t *file, size_t fileSize, size_t *offset, MidiChunk *c)
 {
-    if (f == NULL || c == NULL)
+    if (file == NULL || offset == NULL || c == NULL)
         return MIDI_ARG;
 
-    int status = MIDI_OK;
-
-    size_t bytesRead = 0;
-    bytesRead = fread(c->hdr, 1, 4, f);
-    if (bytesRead != 4)
+    if (*offset > fileSize || fileSize - *offset < 8)
         return MIDI_READ;
 
-    status = readMidiU32(f, &c->length);
-    if (status != MIDI_OK)
-        return status;
+    memcpy(c->hdr, file + *offset, 4);
+    c->hdr[4] = '\0';
+    c->length = readMidiU32(file + *offset + 4);
+    *offset += 8;
 
-    c->data = calloc(c->length, sizeof *c->data);
-    if (c->data == NULL)
-        return MIDI_MEMORY;
-
-    bytesRead = fread(c->data, 1, c->length, f);
-    if (bytesRead != c->length)
+    if (fileSize - *offset < c->length)
         return MIDI_READ;
 
+    c->data = file + *offset;
+    *offset += c->length;
+
     return MIDI_OK;
 
 }
 
-int readMidiU32(FILE *f, uint32_t *length)
+uint32_t readMidiU32(const uint8_t *bytes)
+{
+    return (uint32_t)bytes[3] + (uint32_t)bytes[2] * 256 + (uint32_t)bytes[1] * 256*256 + (uint32_t)bytes[0] * 256 * 256 * 256;
+}
+
+uint16_t readMidiU16(const uint8_t *bytes)
+{
+    return (uint16_t)(bytes[1] + bytes[0] * 256);
+}
+
+// Fresh state for a track: running status and held notes do not carry over
+void initMidiParser(MidiParser *parser, const uint8_t *data, uint32_t length)
+{
+    memset(parser, 0, sizeof *parser);
+    parser->data = data;
+    parser->length = length;
+    // Notes get a physics slot only once they are drawn
+    for (int n = 0; n <= MIDI_NOTE_RANGE; n++)
+        for (int ch = 0; ch < MIDI_CHANNELS; ch++)
+            parser->storageNotes[n][ch].dynamicsSlot = -1;
+    for (int ch = 0; ch < MIDI_CHANNELS; ch++)
+        parser->pedal[ch].dynamicsSlot = -1;
+
+    return;
+}
+
+int parseMidiTrack(MidiParser *parser, MidiTrack *track, const uint8_t *data, uint32_t length)
 {
-    if (f == NULL || length == NULL)
+    if (parser == NULL || track == NULL || data == NULL)
         return MIDI_ARG;
 
-    uint8_t bytes[4] = {0};
+    int status = MIDI_OK;
+    MidiNote *pedal = NULL;
 
-    size_t nbytes = fread(bytes, 1, 4, f);
-    if (nbytes != 4)
-        return MIDI_READ;
+    initMidiParser(parser, data, length);
+    while (parser->offset < parser->length)
+    {
+        status = getTrackEvent(parser, track);
+        if (status != MIDI_OK)
+            return status;
+    }
 
-    *length = bytes[3] + bytes[2] * 256 + bytes[1] * 256*256 + bytes[0] * 256 * 256 * 256;
+    // Close pedals still held at the end of the track
+    for (int ch = 0; ch < MIDI_CHANNELS; ch++)
+    {
+        pedal = &parser->pedal[ch];
+        if (!pedal->playing)
+            continue;
+        pedal->stopTick = parser->currentTick;
+        status = addNote(track);
+        if (status != MIDI_OK)
+            return status;
+        track->notes[track->nNotes-1] = *pedal;
+        track->notes[track->nNotes-1].isPedal = true;
+        track->notes[track->nNotes-1].playing = false;
+    }
 
     return MIDI_OK;
 }
 
-int readMidiU16(FILE *f, uint16_t *length)
+static inline int nextByte(MidiParser *parser, uint8_t *byte)
 {
-    if (f == NULL || length == NULL)
-        return MIDI_ARG;
+    if (parser->offset >= parser->length)
+        return MIDI_READ;
+    *byte = parser->data[parser->offset++];
 
-    uint8_t bytes[2] = {0};
+    return MIDI_OK;
+}
 
-    size_t nbytes = fread(bytes, 1, 2, f);
-    if (nbytes != 2)
+static inline int skipBytes(MidiParser *parser, uint64_t nBytes)
+{
+    if (nBytes > parser->length - parser->offset)
         return MIDI_READ;
-
-    *length = bytes[1] + bytes[0] * 256;
+    parser->offset += nBytes;
 
     return MIDI_OK;
 }
 
-int getTrackEvent(MidiTrack *track, uint8_t *data, int length, int *trackByte, uint64_t *currentTick)
+// Reads the next byte of the event into the named variable, or gives up on the track
+#define NEXT_BYTE(b) do { if (nextByte(parser, &(b)) != MIDI_OK) return MIDI_READ; } while (0)
+
+int getTrackEvent(MidiParser *parser, MidiTrack *track)
 {
-    static int called = 0;
     int status = MIDI_OK;
-    called++;
-    if (track == NULL || data == NULL || trackByte == NULL || *trackByte >= length)
-        return MIDI_MEMORY;
+    if (parser == NULL || track == NULL || parser->offset >= parser->length)
+        return MIDI_ARG;
 
-    uint8_t byte1;
-    uint8_t byte2;
+    uint8_t byte1 = 0;
+    uint8_t byte2 = 0;
     void *mem = NULL;
     uint64_t nDataBytes = 0;
+    MidiNote *storage = NULL;
+    MidiNote *pedal = NULL;
 
     // Read delta time
-
-    uint64_t deltaTime = readVariableLengthQuantity(data, trackByte);
-    (*currentTick) += deltaTime;
+    uint64_t deltaTime = 0;
+    status = readVariableLengthQuantity(parser, &deltaTime);
+    if (status != MIDI_OK)
+        return status;
+    parser->currentTick += deltaTime;
 
     // Read the event
-     uint8_t midiByte = data[(*trackByte)++];
+    uint8_t midiByte = 0;
+    NEXT_BYTE(midiByte);
 
     if (midiByte & 0x80)
     {
-        currentStatusByte = midiByte & CONTROLMASK;
-        if (currentStatusByte != 0xF0)
-            currentChannel = midiByte & CHANNELMASK;
+        parser->currentStatusByte = midiByte & CONTROLMASK;
+        if (parser->currentStatusByte != 0xF0)
+            parser->currentChannel = midiByte & CHANNELMASK;
         else
-            currentSystemChannel = midiByte & CHANNELMASK;
+            parser->currentSystemChannel = midiByte & CHANNELMASK;
     }
     else
     {
         // using previous control status byte (running status)
         // Back up one byte
-        (*trackByte)--;
+        parser->offset--;
     }
 
-    switch(currentStatusByte)
+    int currentChannel = parser->currentChannel;
+    pedal = &parser->pedal[currentChannel];
+
+    switch(parser->currentStatusByte)
     {
         case NOTEON:
         case NOTEOFF:
-            byte1 = data[(*trackByte)++];
-            byte2 = data[(*trackByte)++];
-            storageNotes[byte1][currentChannel].channel = currentChannel;
+            NEXT_BYTE(byte1);
+            NEXT_BYTE(byte2);
+            if (byte1 > MIDI_NOTE_RANGE)
+                return MIDI_FILE;
+            storage = &parser->storageNotes[byte1][currentChannel];
+            storage->channel = currentChannel;
             // Do not add the note if it is already playing
             // Can happen with a note on a note due to playing glitch
-            if (currentStatusByte == NOTEON && byte2 > 0 && !storageNotes[byte1][currentChannel].playing)
+            if (parser->currentStatusByte == NOTEON && byte2 > 0 && !storage->playing)
             {
-                storageNotes[byte1][currentChannel].playing = true;
-                storageNotes[byte1][currentChannel].startDeltaTick = deltaTime;
-                storageNotes[byte1][currentChannel].startTick = *currentTick;
-                storageNotes[byte1][currentChannel].speed = byte2;
+                storage->playing = true;
+                storage->startTick = parser->currentTick;
+                storage->speed = byte2;
             }
             else
             {
                 // If the note was not playing, do not try to stop it
-                if (storageNotes[byte1][currentChannel].playing)
+                if (storage->playing)
                 {
-                    storageNotes[byte1][currentChannel].playing = false;
-                    storageNotes[byte1][currentChannel].stopDeltaTick = deltaTime;
-                    storageNotes[byte1][currentChannel].stopTick = *currentTick;
+                    storage->playing = false;
+                    storage->stopTick = parser->currentTick;
                     status = addNote(track);
                     if (status != MIDI_OK)
                         return status;
-                    track->notes[track->nNotes-1] = storageNotes[byte1][currentChannel];
+                    track->notes[track->nNotes-1] = *storage;
                     track->notes[track->nNotes-1].note = byte1;
-                    storageNotes[byte1][currentChannel].startTick = 0;
-                    storageNotes[byte1][currentChannel].stopTick = 0;
+                    storage->startTick = 0;
+                    storage->stopTick = 0;
                 }
             }
             break;
 
         case POLYKEYPRESSURE:
-            byte1 = data[(*trackByte)++];
-            byte2 = data[(*trackByte)++];
+            NEXT_BYTE(byte1);
+            NEXT_BYTE(byte2);
             // TODO adjust colour / opacity based on aftertouch
             break;
 
         case CONTROLCHANGE:
-            byte1 = data[(*trackByte)++];
-            byte2 = data[(*trackByte)++];
-            // TODO handle control change
+            NEXT_BYTE(byte1);
+            NEXT_BYTE(byte2);
+            if (byte1 < 120)
+            {
+                status = addControllerEvent(track, parser->currentTick, currentChannel, byte1, byte2 & 0x7f);
+                if (status != MIDI_OK)
+                    return status;
+            }
             if (byte1 >= 121 && byte1 <= 127)
             {
                 // Channel mode change
@@ -283,30 +439,30 @@ int getTrackEvent(MidiTrack *track, uint8_t *data, int length, int *trackByte, u
                 switch (byte1)
                 {
                     case 0x40:
-                        if (!pedal[currentChannel].playing)
+                        if (!pedal->playing)
                         {
-                            pedal[currentChannel].playing = true;
-                            pedal[currentChannel].startDeltaTick = deltaTime;
-                            pedal[currentChannel].startTick = *currentTick;
-                            pedal[currentChannel].speed = byte2;
+                            pedal->playing = true;
+                            pedal->channel = currentChannel;
+                            pedal->startTick = parser->currentTick;
+                            pedal->speed = byte2;
                         }
-                        else if (pedal[currentChannel].playing)
+                        else if (pedal->playing)
                         {
                             if (byte2 == 0)
-                                pedal[currentChannel].playing = false;
+                                pedal->playing = false;
                             else
-                                pedal[currentChannel].playing = true;
+                                pedal->playing = true;
                             
-                            pedal[currentChannel].stopDeltaTick = deltaTime;
-                            pedal[currentChannel].stopTick = *currentTick;
+                            pedal->stopTick = parser->currentTick;
                             status = addNote(track);
                             if (status != MIDI_OK)
                                 return status;
-                            track->notes[track->nNotes-1] = pedal[currentChannel];
+                            track->notes[track->nNotes-1] = *pedal;
                             track->notes[track->nNotes-1].isPedal = true;
+                            // Playing marks notes that hold a physics slot, not a held pedal
+                            track->notes[track->nNotes-1].playing = false;
 
-                            pedal[currentChannel].startDeltaTick = deltaTime;
-                            pedal[currentChannel].startTick = *currentTick;
+                            pedal->startTick = parser->currentTick;
                             track->notes[track->nNotes-1].speed = byte2;
                         }
                     
@@ -317,34 +473,40 @@ int getTrackEvent(MidiTrack *track, uint8_t *data, int length, int *trackByte, u
             break;
 
         case PROGRAMCHANGE:
-            byte1 = data[(*trackByte)++];
+            NEXT_BYTE(byte1);
             // TODO handle program change
             break;
 
         case CHANNELPRESSURE:
-            byte1 = data[(*trackByte)++];
-            // TODO handle channel pressure / aftertouch
+            NEXT_BYTE(byte1);
+            status = addControllerEvent(track, parser->currentTick, currentChannel, MIDI_CONTROLLER_CHANNEL_PRESSURE, byte1 & 0x7f);
+            if (status != MIDI_OK)
+                return status;
             break;
 
         case PITCHBEND:
-            byte1 = data[(*trackByte)++];
-            byte2 = data[(*trackByte)++];
-            // TODO handle pitch bend change
+            NEXT_BYTE(byte1);
+            NEXT_BYTE(byte2);
+            // Least significant 7 bits first
+            status = addControllerEvent(track, parser->currentTick, currentChannel, MIDI_CONTROLLER_PITCH_BEND, (byte1 & 0x7f) | (byte2 & 0x7f) << 7);
+            if (status != MIDI_OK)
+                return status;
             break;
 
         // System messages
         case SYSTEMMSG:
             if (midiByte == 0xFF)
             {
-                // Meta event
-                // Type
-                byte1 = data[(*trackByte)++];
+                // Meta event: type, length, data
+                NEXT_BYTE(byte1);
+                status = readVariableLengthQuantity(parser, &nDataBytes);
+                if (status != MIDI_OK)
+                    return status;
+                if (nDataBytes > parser->length - parser->offset)
+                    return MIDI_READ;
+                const uint8_t *metaData = parser->data + parser->offset;
                 switch(byte1)
                 {
-                    case 0x00:
-                        // Sequence number
-                        (*trackByte) += 3;
-                        break;
                     case 0x01:
                     case 0x02:
                     case 0x03:
@@ -354,121 +516,87 @@ int getTrackEvent(MidiTrack *track, uint8_t *data, int length, int *trackByte, u
                     case 0x07:
                     case 0x7F:
                         // Text
-                        nDataBytes = readVariableLengthQuantity(data, trackByte);
                         mem = calloc(nDataBytes + 1, 1);
                         if (mem == NULL)
                             return MIDI_MEMORY;
+                        memcpy(mem, metaData, nDataBytes);
                         switch(byte1)
                         {
                             case 0x01:
-                                memcpy(mem, data + *trackByte, nDataBytes);
                                 track->text = mem;
                                 break;
                             case 0x02:
-                                memcpy(mem, data + *trackByte, nDataBytes);
                                 track->copyright = mem;
                                 break;
                             case 0x03:
-                                memcpy(mem, data + *trackByte, nDataBytes);
                                 track->trackName = mem;
                                 if (strcmp("Transport", track->trackName) == 0)
                                     track->transportTrack = true;
                                 break;
                             case 0x04:
-                                memcpy(mem, data + *trackByte, nDataBytes);
                                 track->instrumentName = mem;
                                 break;
                             case 0x05:
-                                memcpy(mem, data + *trackByte, nDataBytes);
                                 track->lyric = mem;
                                 break;
                             case 0x06:
-                                memcpy(mem, data + *trackByte, nDataBytes);
                                 track->marker = mem;
                                 break;
-                            case 0x07:                       
-                                memcpy(mem, data + *trackByte, nDataBytes);
+                            case 0x07:
                                 track->cuePoint = mem;
+                                break;
                             case 0x7F:
-                                memcpy(mem, data + *trackByte, nDataBytes);
                                 track->sequencerMetaData = mem;
+                                break;
                         }
-                        (*trackByte) += nDataBytes;
-                        break;
-                    case 0x20:
-                        // MIDI channel prefix
-                        (*trackByte) += 2;
-                        break;
-                    case 0x2F:
-                        // End of track
-                        (*trackByte) += 1;
                         break;
                     case 0x51:
                         // Set tempo
-                        (*trackByte)++;
+                        if (nDataBytes < 3)
+                            return MIDI_FILE;
                         status = addNote(track);
                         if (status != MIDI_OK)
                             return status;
                         track->tempoTrack = true;
                         track->notes[track->nNotes-1].isTempo = true;
-                        track->notes[track->nNotes-1].startTick = *currentTick;
-                        track->notes[track->nNotes-1].tempo = data[*trackByte] * 256 * 256 + data[*trackByte + 1] * 256 + data[*trackByte + 2];
-                        (*trackByte) += 3;
-                        break;
-                    case 0x54:
-                        // SMPTE offset (start time of track)
-                        (*trackByte) += 6; // Ignored
-                        break;
-                    case 0x58:
-                        // Time Signature
-                        (*trackByte) += 5; // Ignored
-                        break;
-                    case 0x59:
-                        // Key Signature
-                        (*trackByte) += 3; // Ignored
+                        track->notes[track->nNotes-1].startTick = parser->currentTick;
+                        track->notes[track->nNotes-1].tempo = metaData[0] * 256 * 256 + metaData[1] * 256 + metaData[2];
                         break;
+                    // Sequence number (0x00), MIDI channel prefix (0x20), end of track (0x2F),
+                    // SMPTE offset (0x54), time and key signatures (0x58, 0x59) are ignored
                     default:
-                        nDataBytes = readVariableLengthQuantity(data, trackByte);
-                        (*trackByte) += nDataBytes;
+                        break;
                 }
-
-                
+                parser->offset += nDataBytes;
             }
-            else if (midiByte == 0xF0)
+            else if (midiByte == 0xF0 || midiByte == 0xF7)
             {
-                // System Exclusive message
-                while (byte1 != 0xF7)
-                    byte1 = data[(*trackByte)++];
-                
-            }
-            else if ((currentStatusByte & 0b11111000) == 0b11111000)
-            {
-                // 0 to two bytes, how many?
-                byte1 = data[(*trackByte)++];
-                byte2 = data[(*trackByte)++];
+                // System Exclusive message, or an escaped one
+                status = readVariableLengthQuantity(parser, &nDataBytes);
+                if (status != MIDI_OK)
+                    return status;
+                status = skipBytes(parser, nDataBytes);
+                if (status != MIDI_OK)
+                    return status;
             }
             else if (midiByte <= 0xF7)
             {
                 switch(midiByte)
                 {
-                    // Handel system exclusive message
-                    case 0xF0:
-                        // Read bytes
-                        break;
                     case 0xF1:
                         // Midi time code quarter frame
-                        byte1 = data[(*trackByte)++];
+                        NEXT_BYTE(byte1);
                         break;
                     case 0xF2:
                         // Song position pointer
                         // Least significant byte
-                        byte1 = data[(*trackByte)++];
+                        NEXT_BYTE(byte1);
                         // Most significant byte
-                        byte2 = data[(*trackByte)++];
+                        NEXT_BYTE(byte2);
                         break;
                     case 0xF3:
                         // Song select
-                        byte1 = data[(*trackByte)++];
+                        NEXT_BYTE(byte1);
                         break;
                    case 0xF4:
                    case 0xF5:
@@ -477,43 +605,9 @@ int getTrackEvent(MidiTrack *track, uint8_t *data, int length, int *trackByte, u
                    case 0xF6:
                         // Tune request
                         break;
-                   case 0xF7:
-                        // EOX End of System Exclusive message
-                        break;
- 
                  }
             }
-            else
-            {
-                // System real time
-                switch(midiByte)
-                {
-                    case 0xF8:
-                        // Timing clock
-                        break;
-                    case 0xF9:
-                        // Undefined
-                        break;
-                    case 0xFA:
-                        // Start
-                        break;
-                    case 0xFB:
-                        // Continue
-                        break;
-                    case 0xFC:
-                        // Stop
-                        break;
-                    case 0xFD:
-                        // Undefine
-                        break;
-                    case 0xFE:
-                        // Active Sensing
-                        break;
-                    case 0xFF:
-                        // System Reset
-                        break;
-                }
-            }
+            // System real time messages (0xF8 to 0xFE) have no data bytes
             break;
 
 
@@ -523,142 +617,444 @@ int getTrackEvent(MidiTrack *track, uint8_t *data, int length, int *trackByte, u
     return MIDI_OK;
 }
 
-size_t readVariableLengthQuantity(uint8_t *data, int *offset)
+#undef NEXT_BYTE
+
+// Variable length quantities are at most four bytes
+int readVariableLengthQuantity(MidiParser *parser, uint64_t *value)
 {
-    if (data == NULL || offset == NULL)
-        return 0;
-
-    int vlqByte = data[(*offset)++];
-    long long vlq = 0;
-    while (vlqByte & 0x80)
-    {
-        vlq += (vlqByte & 0x7f);
-        vlq *= 128;
-        vlqByte = data[(*offset)++];
-    }
-    vlq += vlqByte;
-
-    return vlq;
-
-    // register uint64_t value;
-    // register uint8_t c;
-    // if ((value = data[(*offset)++]) & 0x80)
-    // {
-    //     value &= 0x7f;
-    //     do
-    //     {
-    //         value = (value << 7) + ((c = data[(*offset)++]) & 0x7f);
-    //     } while (c & 0x80);
-    // }
-    // return value;
+    if (parser == NULL || value == NULL)
+        return MIDI_ARG;
+
+    uint8_t vlqByte = 0;
+    uint64_t vlq = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (nextByte(parser, &vlqByte) != MIDI_OK)
+            return MIDI_READ;
+        vlq = (vlq << 7) | (vlqByte & 0x7f);
+        if ((vlqByte & 0x80) == 0)
+        {
+            *value = vlq;
+            return MIDI_OK;
+        }
+    }
+
+    return MIDI_FILE;
 }
 
 int addNote(MidiTrack *track)
 {
     // Add the note to the track
     void *mem = NULL;
-    size_t offset = 0;
+    int allocated = 0;
 
-    track->nNotes++;
-    if (track->nNotes > track->allocatedNotes)
+    if (track->nNotes == track->allocatedNotes)
     {
-        offset = track->allocatedNotes * sizeof *track->notes;
-        track->allocatedNotes += MIDI_CHUNK_ALLOCATION_INCREMENT;
-        mem = realloc(track->notes, track->allocatedNotes * sizeof *track->notes);
+        // Geometric growth keeps million-note tracks from reallocating constantly
+        allocated = track->allocatedNotes > 0 ? 2 * track->allocatedNotes : MIDI_CHUNK_ALLOCATION_INCREMENT;
+        mem = realloc(track->notes, (size_t)allocated * sizeof *track->notes);
         if (mem == NULL)
             return MIDI_MEMORY;
         track->notes = mem;
-        bzero((uint8_t*)track->notes + offset, MIDI_CHUNK_ALLOCATION_INCREMENT * sizeof *track->notes);
+        bzero(track->notes + track->allocatedNotes, (size_t)(allocated - track->allocatedNotes) * sizeof *track->notes);
+        track->allocatedNotes = allocated;
     }
+    track->notes[track->nNotes].dynamicsSlot = -1;
+    track->nNotes++;
 
     return MIDI_OK;
 }
 
-double songTime(MidiSong *song, uint64_t currentTick)
+// Cumulative seconds at each tempo change. The sums are accumulated in the
+// same order as a scan from the start of the song, so looked-up times match it exactly.
+int buildTempoMap(MidiSong *song)
 {
     if (song == NULL)
         return MIDI_ARG;
 
-    double tempo = song->tempo;
+    free(song->tempoMap);
+    song->tempoMap = NULL;
+    song->nTempoPoints = 0;
+
+    MidiTrack *track = NULL;
+    bool smpte = (song->division & 0x8000) != 0;
+    int nPoints = 1;
+    if (!smpte && song->nTracks > 0 && song->tracks[0].tempoTrack)
+    {
+        track = &song->tracks[0];
+        for (int i = 0; i < track->nNotes; i++)
+            if (track->notes[i].isTempo)
+                nPoints++;
+    }
+
+    TempoPoint *map = calloc(nPoints, sizeof *map);
+    if (map == NULL)
+        return MIDI_MEMORY;
+
     double division = (double) song->division;
+    map[0].tempo = (uint64_t) song->tempo;
+    map[0].secondsPerTick = song->tempo / division / 1000000.0;
+    if (smpte)
+    {
+        // Frames per second in the (negative) high byte, ticks per frame in the low byte
+        int framesPerSecond = -(int8_t)(song->division >> 8);
+        int ticksPerFrame = song->division & 0xff;
+        double frameRate = framesPerSecond == 29 ? 30000.0 / 1001.0 : (double) framesPerSecond;
+        if (frameRate <= 0.0 || ticksPerFrame == 0)
+        {
+            free(map);
+            return MIDI_FILE;
+        }
+        map[0].secondsPerTick = 1.0 / (frameRate * (double) ticksPerFrame);
+    }
 
-    double rate = tempo / division / 1000000.0;
-
-    // Default assumes constant tempo
-    double t = rate * (double) currentTick;
-    double cumulativeTime = 0.0;
-    double lastTick = 0;
-    double newTicks = 0;
-    // If there is a tempo track, revise the track time
-    if (song->nTracks > 0 && song->tracks[0].tempoTrack)
-    {
-        MidiTrack *track = &song->tracks[0];
-        double noteTime = 0.0;
-        // Sum up times over intervals of constant tempo
-        // Until we get to the current tick
-        // Assumes constant tempo between ticks
+    TempoPoint *point = map;
+    if (track != NULL)
+    {
         for (int i = 0; i < track->nNotes; i++)
         {
-            if (track->notes[i].startTick <= currentTick)
-            {
-                newTicks = track->notes[i].startTick - lastTick;
-                lastTick = track->notes[i].startTick;
-                cumulativeTime += rate * newTicks;
-                tempo = (double)track->notes[i].tempo;
-                rate = tempo / division / 1000000.0;
-            }
-            else
-                break;
+            if (!track->notes[i].isTempo)
+                continue;
+            point++;
+            point->ticks = track->notes[i].startTick;
+            point->time = point[-1].time + point[-1].secondsPerTick * ((double) point->ticks - (double) point[-1].ticks);
+            point->tempo = track->notes[i].tempo;
+            point->secondsPerTick = (double) point->tempo / division / 1000000.0;
         }
-        newTicks = currentTick - lastTick;
-        cumulativeTime += rate * newTicks;
-        t = cumulativeTime;
     }
 
-    return t;
+    song->tempoMap = map;
+    song->nTempoPoints = nPoints;
+
+    return MIDI_OK;
 }
 
-void setNoteTimes(MidiSong *song)
+double songTime(MidiSong *song, uint64_t currentTick)
 {
-    if (song == NULL || song->tracks == NULL)
-        return;
+    if (song == NULL)
+        return MIDI_ARG;
 
-    MidiTrack *track = NULL;
+    // Constant tempo until the map is built
+    if (song->tempoMap == NULL)
+        return song->tempo / (double) song->division / 1000000.0 * (double) currentTick;
+
+    // Last tempo change at or before the tick
+    int lo = 0;
+    int hi = song->nTempoPoints - 1;
+    int mid = 0;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo + 1) / 2;
+        if (song->tempoMap[mid].ticks <= currentTick)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    TempoPoint *point = &song->tempoMap[lo];
+
+    return point->time + point->secondsPerTick * ((double) currentTick - (double) point->ticks);
+}
+
+// Note range and song duration of one track
+typedef struct TrackTiming
+{
+    double maxTime;
+    int minNote;
+    int maxNote;
+} TrackTiming;
+
+typedef struct NoteTimesTask
+{
+    MidiSong *song;
+    TrackTiming *timing;
+} NoteTimesTask;
+
+static void trackTimesJob(void *arg, int index)
+{
+    NoteTimesTask *task = (NoteTimesTask *)arg;
+    MidiSong *song = task->song;
+    MidiTrack *track = &song->tracks[index];
+    TrackTiming *timing = &task->timing[index];
     MidiNote *note = NULL;
 
+    timing->maxTime = 0.0;
+    timing->minNote = 255;
+    timing->maxNote = 0;
+
+    for (int n = 0; n < track->nNotes; n++)
+    {
+        note = &track->notes[n];
+        
+        if (note->startTick != 0)
+            note->startTime = songTime(song, note->startTick);
+        if (note->stopTick != 0)
+            note->stopTime = songTime(song, note->stopTick);
+
+        if (!track->tempoTrack && !note->isPedal)
+        {
+            if (note->note > timing->maxNote)
+                timing->maxNote = note->note;
+            if (note->note < timing->minNote)
+                timing->minNote = note->note;
+            if (note->startTime > timing->maxTime)
+                timing->maxTime = note->startTime;
+            if (note->stopTime > timing->maxTime)
+                timing->maxTime = note->stopTime;
+        }
+
+    }
+
+    return;
+}
+
+// Tracks are timed in parallel on the pool, or serially if pool is NULL
+int setNoteTimes(MidiSong *song, WorkerPool *pool)
+{
+    if (song == NULL || song->tracks == NULL)
+        return MIDI_ARG;
+
+    int status = buildTempoMap(song);
+    if (status != MIDI_OK)
+        return status;
+
+    TrackTiming *timing = calloc(song->nTracks, sizeof *timing);
+    if (timing == NULL)
+        return MIDI_MEMORY;
+
+    NoteTimesTask task = {.song = song, .timing = timing};
+    runWorkers(pool, trackTimesJob, &task, song->nTracks);
+
     double maxTime = 0.0;
     int minNote = 255;
     int maxNote = 0;
 
     for (int tr = 0; tr < song->nTracks; tr++)
+    {
+        if (timing[tr].maxNote > maxNote)
+            maxNote = timing[tr].maxNote;
+        if (timing[tr].minNote < minNote)
+            minNote = timing[tr].minNote;
+        if (timing[tr].maxTime > maxTime)
+            maxTime = timing[tr].maxTime;
+    }
+    free(timing);
+
+    song->maxTime = maxTime;
+    song->minNote = minNote;
+    song->maxNote = maxNote;
+
+    return MIDI_OK;
+}
+
+static int compareNoteRefs(const void *a, const void *b)
+{
+    const NoteRef *r1 = (const NoteRef *)a;
+    const NoteRef *r2 = (const NoteRef *)b;
+
+    if (r1->startTime < r2->startTime)
+        return -1;
+    if (r1->startTime > r2->startTime)
+        return 1;
+    if (r1->track != r2->track)
+        return r1->track - r2->track;
+
+    return r1->index - r2->index;
+}
+
+int buildNoteIndex(MidiSong *song)
+{
+    if (song == NULL || song->tracks == NULL)
+        return MIDI_ARG;
+
+    MidiTrack *track = NULL;
+    int nNotes = 0;
+
+    // Only tracks that flow() draws: track 0 and tempo / transport tracks are skipped
+    for (int tr = 1; tr < song->nTracks; tr++)
+    {
+        track = &song->tracks[tr];
+        if (!track->tempoTrack && !track->transportTrack)
+            nNotes += track->nNotes;
+    }
+
+    free(song->noteIndex);
+    song->noteIndex = NULL;
+    song->nIndexedNotes = 0;
+    if (nNotes == 0)
+        return MIDI_OK;
+
+    song->noteIndex = calloc(nNotes, sizeof *song->noteIndex);
+    if (song->noteIndex == NULL)
+        return MIDI_MEMORY;
+
+    NoteRef *ref = song->noteIndex;
+    for (int tr = 1; tr < song->nTracks; tr++)
     {
         track = &song->tracks[tr];
+        if (track->tempoTrack || track->transportTrack)
+            continue;
         for (int n = 0; n < track->nNotes; n++)
         {
-            note = &track->notes[n];
-            
-            if (note->startTick != 0)
-                note->startTime = songTime(song, note->startTick);
-            if (note->stopTick != 0)
-                note->stopTime = songTime(song, note->stopTick);
-
-            if (!track->tempoTrack && !note->isPedal)
+            ref->startTime = track->notes[n].startTime;
+            ref->track = tr;
+            ref->index = n;
+            ref++;
+        }
+    }
+    song->nIndexedNotes = nNotes;
+
+    qsort(song->noteIndex, song->nIndexedNotes, sizeof *song->noteIndex, compareNoteRefs);
+
+    return MIDI_OK;
+}
+
+// Final note intervals, so that notes are read-only while rendering:
+// a note is cut off when the same pitch starts again on its channel, and
+// optionally held on by a sustain pedal of its channel for up to PEDAL_MAX_SUSTAIN.
+int normalizeNotes(MidiSong *song, bool pedalSustainsNotes)
+{
+    if (song == NULL || song->tracks == NULL)
+        return MIDI_ARG;
+
+    NoteRef *ref = NULL;
+    MidiNote *note = NULL;
+    MidiNote *pedal = NULL;
+
+    if (pedalSustainsNotes)
+    {
+        // Pedal intervals of each channel in start time order
+        int nPedals[MIDI_CHANNELS] = {0};
+        int first[MIDI_CHANNELS + 1] = {0};
+        for (int i = 0; i < song->nIndexedNotes; i++)
+        {
+            ref = &song->noteIndex[i];
+            note = &song->tracks[ref->track].notes[ref->index];
+            if (note->isPedal)
+                nPedals[note->channel]++;
+        }
+        for (int ch = 0; ch < MIDI_CHANNELS; ch++)
+            first[ch + 1] = first[ch] + nPedals[ch];
+
+        MidiNote **pedals = calloc(first[MIDI_CHANNELS] > 0 ? first[MIDI_CHANNELS] : 1, sizeof *pedals);
+        if (pedals == NULL)
+            return MIDI_MEMORY;
+        memset(nPedals, 0, sizeof nPedals);
+        for (int i = 0; i < song->nIndexedNotes; i++)
+        {
+            ref = &song->noteIndex[i];
+            note = &song->tracks[ref->track].notes[ref->index];
+            if (note->isPedal)
+                pedals[first[note->channel] + nPedals[note->channel]++] = note;
+        }
+
+        int lo = 0;
+        int hi = 0;
+        int mid = 0;
+        double extension = 0.0;
+        for (int i = 0; i < song->nIndexedNotes; i++)
+        {
+            ref = &song->noteIndex[i];
+            note = &song->tracks[ref->track].notes[ref->index];
+            if (note->isPedal || note->isTempo || nPedals[note->channel] == 0)
+                continue;
+            // Last pedal of the channel to start at or before the note is released
+            lo = first[note->channel];
+            hi = first[note->channel + 1] - 1;
+            if (pedals[lo]->startTime > note->stopTime)
+                continue;
+            while (lo < hi)
             {
-                if (note->note > maxNote)
-                    maxNote = note->note;
-                if (note->note < minNote)
-                    minNote = note->note;
-                if (note->startTime > maxTime)
-                    maxTime = note->startTime;
-                if (note->stopTime > maxTime)
-                    maxTime = note->stopTime;
+                mid = lo + (hi - lo + 1) / 2;
+                if (pedals[mid]->startTime <= note->stopTime)
+                    lo = mid;
+                else
+                    hi = mid - 1;
             }
+            pedal = pedals[lo];
+            if (pedal->speed == 0 || note->stopTime >= pedal->stopTime)
+                continue;
+            extension = pedal->stopTime - note->stopTime;
+            if (extension > PEDAL_MAX_SUSTAIN)
+                extension = PEDAL_MAX_SUSTAIN;
+            note->stopTime += extension;
+            if (note->stopTime > song->maxTime)
+                song->maxTime = note->stopTime;
+        }
+        free(pedals);
+    }
+
+    // Last note started at each pitch and channel
+    MidiNote *(*lastNote)[MIDI_CHANNELS] = calloc(MIDI_NOTE_RANGE + 1, sizeof *lastNote);
+    if (lastNote == NULL)
+        return MIDI_MEMORY;
+    MidiNote **last = NULL;
+    for (int i = 0; i < song->nIndexedNotes; i++)
+    {
+        ref = &song->noteIndex[i];
+        note = &song->tracks[ref->track].notes[ref->index];
+        if (note->isPedal || note->isTempo)
+            continue;
+        last = &lastNote[note->note][note->channel];
+        if (*last != NULL && (*last)->stopTime > note->startTime)
+            (*last)->stopTime = note->startTime;
+        *last = note;
+    }
+    free(lastNote);
+
+    return MIDI_OK;
+}
+
+// Copy of the song's notes for a separate render. Names, text and the
+// note index are read-only while rendering and are shared with the original.
+MidiSong *copyMidiSong(MidiSong *song)
+{
+    if (song == NULL)
+        return NULL;
+
+    MidiSong *copy = calloc(1, sizeof *copy);
+    if (copy == NULL)
+        return NULL;
+    *copy = *song;
+
+    copy->tracks = calloc(song->nTracks, sizeof *copy->tracks);
+    if (copy->tracks == NULL)
+    {
+        free(copy);
+        return NULL;
+    }
 
+    MidiTrack *track = NULL;
+    for (int tr = 0; tr < song->nTracks; tr++)
+    {
+        track = &copy->tracks[tr];
+        *track = song->tracks[tr];
+        track->notes = NULL;
+        track->allocatedNotes = 0;
+        if (track->nNotes == 0)
+            continue;
+        track->notes = malloc(track->nNotes * sizeof *track->notes);
+        if (track->notes == NULL)
+        {
+            freeMidiSongCopy(copy);
+            return NULL;
         }
+        memcpy(track->notes, song->tracks[tr].notes, track->nNotes * sizeof *track->notes);
+        track->allocatedNotes = track->nNotes;
     }
-    song->maxTime = maxTime;
-    song->minNote = minNote;
-    song->maxNote = maxNote;
+
+    return copy;
+}
+
+void freeMidiSongCopy(MidiSong *copy)
+{
+    if (copy == NULL)
+        return;
+
+    if (copy->tracks != NULL)
+        for (int tr = 0; tr < copy->nTracks; tr++)
+            free(copy->tracks[tr].notes);
+    free(copy->tracks);
+    free(copy);
 
     return;
 }
@@ -6,9 +6,17 @@
 #include <stdio.h>
 
 #define NOTE_MAX_SPEED 127
-#define MIDI_CHUNK_ALLOCATION_INCREMENT 1024
+#define MIDI_CHUNK_ALLOCATION_INCREMENT 1024 // initial notes per track, doubled as needed
 #define MIDI_CHANNELS 16
 #define MIDI_NOTE_RANGE 127
+#define PEDAL_MAX_SUSTAIN 10.0 // seconds a pedal can extend a note
+
+// Controller timelines: control changes 0 to 119 (120 to 127 are channel mode messages), then pitch bend and channel pressure
+#define MIDI_CONTROLLER_SUSTAIN 0x40
+#define MIDI_CONTROLLER_PITCH_BEND 128
+#define MIDI_CONTROLLER_CHANNEL_PRESSURE 129
+#define MIDI_CONTROLLERS 130
+#define MIDI_PITCH_BEND_CENTRE 8192
 
 #define NOTE_DYNAMICS_POINTS 41
 
@@ -42,48 +50,60 @@ enum MidiChannelMessages
     SYSTEMMSG = 0xF0
 };
 
+// Start of an interval of constant tempo
 typedef struct TempoPoint
 {
-    double time;
+    double time; // seconds
     uint64_t ticks;
     uint64_t tempo;
+    double secondsPerTick;
 } TempoPoint;
 
-typedef struct NoteDynamics
-{
-    double x[NOTE_DYNAMICS_POINTS];
-    double y[NOTE_DYNAMICS_POINTS];
-    double vx[NOTE_DYNAMICS_POINTS];
-    double vy[NOTE_DYNAMICS_POINTS];
-    double mass;
-
-} NoteDynamics;
 
 
+// 56 bytes: large files hold millions of these, so keep it small.
+// Control points live in the physics batch only while a note is on screen.
 typedef struct MidiNote
 {
-    int note;
-    uint64_t startDeltaTick;
-    uint64_t stopDeltaTick;
     uint64_t startTick;
     uint64_t stopTick;
     double startTime;
     double stopTime;
-    double length;
-    int speed;
     double screenTime;
-    bool playing;
-    int channel;
-    int channelMode;
-    bool isTempo;
-    bool isPedal;
-    uint32_t tempo;
-    NoteDynamics dynamics;
-    char *message;
-    void *referenceMidiNote;
-    
+    int32_t dynamicsSlot; // physics batch slot while playing
+    uint32_t tempo; // microseconds per quarter note, tempo events only
+    uint8_t note;
+    uint8_t speed;
+    uint8_t channel : 4;
+    bool playing : 1;
+    bool isTempo : 1;
+    bool isPedal : 1;
 } MidiNote;
 
+// Controller change decoded from a track, kept until the song's timelines are built
+typedef struct ControllerEvent
+{
+    uint64_t tick;
+    uint16_t value;
+    uint8_t channel;
+    uint8_t controller;
+} ControllerEvent;
+
+// Points of one channel's controller in song->controllerTime and song->controllerValue
+typedef struct ControllerTimeline
+{
+    int first;
+    int nPoints;
+} ControllerTimeline;
+
+// Entry of the song's note index, sorted by start time
+typedef struct NoteRef
+{
+    double startTime;
+    int track;
+    int index;
+} NoteRef;
+
 typedef struct MidiTrack
 {
     MidiNote *notes;
@@ -91,6 +111,9 @@ typedef struct MidiTrack
     bool transportTrack;
     int nNotes;
     int allocatedNotes;
+    ControllerEvent *controllerEvents;
+    int nControllerEvents;
+    int allocatedControllerEvents;
     int instrument;
     char *trackName;
     char *copyright;
@@ -107,7 +130,7 @@ typedef struct MidiSong
     MidiTrack *tracks;
     int format;
     int nTracks;
-    int division;
+    int division; // ticks per quarter note, or SMPTE frame rate and ticks per frame if the high bit is set
 
     char *songName;
     char *filename;
@@ -120,36 +143,81 @@ typedef struct MidiSong
     int minNote;
     int maxNote;
     int noteSpan;
+
+    // Tempo changes in tick order, built by setNoteTimes()
+    TempoPoint *tempoMap;
+    int nTempoPoints;
+
+    // Controller values by channel, MIDI_CHANNELS * MIDI_CONTROLLERS timelines
+    // of columnar (time, value) points in time order, built after setNoteTimes()
+    ControllerTimeline *controllers;
+    double *controllerTime;
+    uint16_t *controllerValue;
+    int nControllerPoints;
+
+    // Displayable notes sorted by start time, built after setNoteTimes()
+    NoteRef *noteIndex;
+    int nIndexedNotes;
     
 } MidiSong;
 
 
+// Chunk of a memory-mapped MIDI file, the data are not copied
 typedef struct MidiChunk
 {
     uint8_t hdr[5];
     uint32_t length;
-    uint8_t *data;
+    const uint8_t *data;
 } MidiChunk;
 
+// Track parser state, so that any number of tracks and files can be parsed at once
+typedef struct MidiParser
+{
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+    uint64_t currentTick;
+    int currentStatusByte;
+    int currentChannel;
+    int currentSystemChannel;
+    // TODO handle multiple voices per track?
+    MidiNote storageNotes[MIDI_NOTE_RANGE + 1][MIDI_CHANNELS];
+    MidiNote pedal[MIDI_CHANNELS];
+} MidiParser;
+
 struct State;
 
 int readMidi(State *state);
 
-int readMidiChunk(FILE *f, MidiChunk *chunk);
+int readMidiChunk(const uint8_t *file, size_t fileSize, size_t *offset, MidiChunk *chunk);
+
+uint32_t readMidiU32(const uint8_t *bytes);
+
+uint16_t readMidiU16(const uint8_t *bytes);
 
-int readMidiU32(FILE *f, uint32_t *length);
+void initMidiParser(MidiParser *parser, const uint8_t *data, uint32_t length);
 
-int readMidiU16(FILE *f, uint16_t *length);
+int parseMidiTrack(MidiParser *parser, MidiTrack *track, const uint8_t *data, uint32_t length);
 
-size_t readVariableLengthQuantity(uint8_t *data, int *offset);
+int readVariableLengthQuantity(MidiParser *parser, uint64_t *value);
 
-int getTrackEvent(MidiTrack *track, uint8_t *data, int length, int *trackByte, uint64_t *currentTick);
+int getTrackEvent(MidiParser *parser, MidiTrack *track);
 
 int addNote(MidiTrack *track);
 
 double songTime(MidiSong *song, uint64_t currentTick);
 
-void setNoteTimes(MidiSong *song);
+int buildTempoMap(MidiSong *song);
+
+int setNoteTimes(MidiSong *song, WorkerPool *pool);
+
+int buildNoteIndex(MidiSong *song);
+
+int normalizeNotes(MidiSong *song, bool pedalSustainsNotes);
+
+MidiSong *copyMidiSong(MidiSong *song);
+
+void freeMidiSongCopy(MidiSong *copy);
 
 
 #endif // _MIDI_H
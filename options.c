@@ -1,4 +1,7 @@
 #include "options.h"
+#include "pipeline.h"
+
+#include <math.h>
 
 void usage(const char * name)
 {
@@ -31,14 +34,34 @@ void usage(const char * name)
     printf("%40s - %s\n", "--wiggle-wavelength=<amount>", "Set the note wiggle wavelength");
     printf("%40s - %s\n", "--wiggle-period=<amount>", "Set the note wiggle period");
     printf("%40s - %s\n", "--acceleration=<pixels/s/s>", "Set the note acceleration downward in pixels per second per second");
+    printf("%40s - %s\n", "--note-lod-error=<pixels>", "Set how far notes may stray from their full detail. Pass 0 for full detail");
+    printf("%40s - %s\n", "--closed-form-physics", "Place notes from the time alone instead of integrating their motion frame by frame, so rendering can start at any frame");
+    printf("%40s - %s\n", "--density-threshold=<notes>", "Draw frames with at least this many notes on screen from per-pixel note density (native rasterizer). Pass 0 to never do so");
     printf("%40s - %s\n", "--uhd", "4k UDH (3840x2160)");
     printf("%40s - %s\n", "--frame-width=<width>", "Set video frame width");
     printf("%40s - %s\n", "--frame-height=<height>", "Set video frame height");
-    printf("%40s - %s\n", "--video-filter-graph=<rules>", "Apply a simple FFMPEG video filter");
+    printf("%40s - %s\n", "--video-filter-graph=<rules>", "Filter frames with an FFMPEG filter graph instead of the native blur, e.g. gblur=sigma=2");
+    printf("%40s - %s\n", "--blur=<radius>[:<passes>]", "Native box blur, as FFMPEG's boxblur. Default: 2:2");
+    printf("%40s - %s\n", "--gaussian-blur=<sigma>", "Native blur approximating a gaussian with three box passes");
+    printf("%40s - %s\n", "--bloom=<strength>[:<threshold>]", "Glow around luma above <threshold> (0-255). Default: off, threshold 160");
+    printf("%40s - %s\n", "--colour-lut=<file.cube>", "Grade frames with a 3D colour LUT in .cube format");
+    printf("%40s - %s\n", "--video-threads=<n>", "Split swscale RGB to YUV conversion into <n> slices on separate threads, and slice-thread the --video-filter-graph filters. Output is unchanged. Default: 1 (0: one per processor)");
+    printf("%40s - %s\n", "--fused-blur", "Blur while converting RGBA to YUV, in one cache-resident pass over bands of rows. Native blur only");
+    printf("%40s - %s\n", "--post-threads=<n>", "Split blur, bloom and colour LUT of each frame over <n> threads. Default: 0 (one per processor)");
     printf("%40s - %s\n", "--SDL-window-renderer", "Render video with SDLWindow (i.e. hardware) instead of in software. Default: software rendering");
-    printf("%40s - %s\n", "--faster-rgb2yuv", "Trade quality for a faster RGB to YUV420P converter");
-    printf("%40s - %s\n", "--no-video-filter", "Do not apply the video filter");
+    printf("%40s - %s\n", "--note-rasterizer=<name>", "Draw notes with the anti-aliased \"native\" rasterizer, with \"sdl-gfx\" polygons, or as \"sdl-geometry\" triangles batched per frame. Default: native (sdl-geometry with --SDL-window-renderer)");
+    printf("%40s - %s\n", "--yuv-render-target", "Rasterize natively into the YUV420P planes of the encoded frame, with no RGBA frame or colour conversion. Ignored with --SDL-window-renderer or SDL rasterizers");
+    printf("%40s - %s\n", "--faster-rgb2yuv", "Use the SIMD RGB to YUV420P converter instead of swscale");
+    printf("%40s - %s\n", "--rgb2yuv-threads=<n>", "Split --faster-rgb2yuv conversion of each frame over <n> threads. Default: 0 (one per processor)");
+    printf("%40s - %s\n", "--no-video-filter", "Do not blur or apply the video filter graph");
+    printf("%40s - %s\n", "--no-sparse-tiles", "Convert and blur every pixel, instead of filling tiles with nothing drawn on them with the background");
+    printf("%40s - %s\n", "--no-static-frame-reuse", "Draw, convert and filter frames of bare background, even when the same as the frame before");
+    printf("%40s - %s\n", "--variable-frame-rate", "Drop frames of bare background that are the same as the frame before, instead of encoding them again");
+    printf("%40s - %s\n", "--pipeline-depth=<n>", "Render, convert, filter and encode on separate threads with <n> frames in flight. Default: 0 (single thread)");
+    printf("%40s - %s\n", "--pipeline-threads=<n>", "Use <n> RGB to YUV conversion threads in the frame pipeline. Default: 1");
+    printf("%40s - %s\n", "--segments=<n>", "Render <n> parts of the video in parallel and join them. Default: 1");
     printf("%40s - %s\n", "--track-to-display=<track>", "Display only <track>. Default: -1 (all tracks)");
+    printf("%40s - %s\n", "--no-song-cache", "Always parse the MIDI file, and do not save the parsed song to <midifilename>.flowcache");
     printf("%40s - %s\n", "--background-colour=<r,g,b,a>", "Use colour r,g,b,a (or a named colour) for the background. Default: black");
     printf("%40s - %s\n", "--track-colour=<r,g,b,a>", "Use colour r,g,b,a (or a named colour) for the track colours. Default: uses colour table.");
     printf("%40s - %s\n", "--video-title-font=<fontname>", "Use <fontname> for video title. Default: DejaVuSans.ttf. Font must be in working directory.");
@@ -178,16 +201,135 @@ int parseOptions(State *state, int argc, char **argv)
             state->nOptions++;
             state->videoState.sdlRendering = true;
         }
+        else if (strncmp("--note-rasterizer=", argv[i], 18) == 0)
+        {
+            state->nOptions++;
+            if (strcmp("native", argv[i] + 18) == 0)
+                state->videoState.noteRasterizer = NOTE_RASTERIZER_NATIVE;
+            else if (strcmp("sdl-gfx", argv[i] + 18) == 0)
+                state->videoState.noteRasterizer = NOTE_RASTERIZER_SDL_GFX;
+            else if (strcmp("sdl-geometry", argv[i] + 18) == 0)
+                state->videoState.noteRasterizer = NOTE_RASTERIZER_SDL_GEOMETRY;
+            else
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp("--yuv-render-target", argv[i]) == 0)
+        {
+            state->nOptions++;
+            state->videoState.yuvRenderTarget = true;
+        }
         else if (strcmp("--faster-rgb2yuv", argv[i]) == 0)
         {
             state->nOptions++;
             state->videoState.fastRgb2Yuv = true;
         }
+        else if (strncmp("--rgb2yuv-threads=", argv[i], 18) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 19)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->videoState.rgb2yuvThreads = atoi(argv[i] + 18);
+        }
+        else if (strncmp("--blur=", argv[i], 7) == 0)
+        {
+            state->nOptions++;
+            int passes = POSTPROCESS_DEFAULT_BLUR_PASSES;
+            if (sscanf(argv[i] + 7, "%d:%d", &state->videoState.postOptions.blurRadius, &passes) < 1)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->videoState.postOptions.blurPasses = passes;
+        }
+        else if (strncmp("--gaussian-blur=", argv[i], 16) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 17)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            // Box width whose repeated passes have the same variance
+            double sigma = atof(argv[i] + 16);
+            double boxWidth = sqrt(12.0 * sigma * sigma / POSTPROCESS_GAUSSIAN_PASSES + 1.0);
+            state->videoState.postOptions.blurRadius = (int)floor((boxWidth - 1.0) / 2.0 + 0.5);
+            state->videoState.postOptions.blurPasses = POSTPROCESS_GAUSSIAN_PASSES;
+        }
+        else if (strncmp("--bloom=", argv[i], 8) == 0)
+        {
+            state->nOptions++;
+            if (sscanf(argv[i] + 8, "%lf:%lf", &state->videoState.postOptions.bloomStrength, &state->videoState.postOptions.bloomThreshold) < 1)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp("--colour-lut=", argv[i], 13) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 14)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->videoState.postOptions.lutFilename = argv[i] + 13;
+        }
+        else if (strcmp("--fused-blur", argv[i]) == 0)
+        {
+            state->nOptions++;
+            state->videoState.postOptions.fusedBlur = true;
+        }
+        else if (strncmp("--video-threads=", argv[i], 16) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 17)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->videoState.videoThreads = atoi(argv[i] + 16);
+        }
+        else if (strncmp("--post-threads=", argv[i], 15) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 16)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->videoState.postThreads = atoi(argv[i] + 15);
+        }
+        else if (strcmp("--no-song-cache", argv[i]) == 0)
+        {
+            state->nOptions++;
+            state->useSongCache = false;
+        }
         else if (strcmp("--no-video-filter", argv[i]) == 0)
         {
             state->nOptions++;
             state->videoState.applyVideoFilter = false;
         }
+        else if (strcmp("--no-sparse-tiles", argv[i]) == 0)
+        {
+            state->nOptions++;
+            state->videoState.sparseTiles = false;
+        }
+        else if (strcmp("--no-static-frame-reuse", argv[i]) == 0)
+        {
+            state->nOptions++;
+            state->videoState.reuseStaticFrames = false;
+        }
+        else if (strcmp("--variable-frame-rate", argv[i]) == 0)
+        {
+            state->nOptions++;
+            state->videoState.variableFrameRate = true;
+        }
         else if (strcmp("--verbose", argv[i]) == 0)
         {
             state->nOptions++;
@@ -195,6 +337,36 @@ int parseOptions(State *state, int argc, char **argv)
             state->videoState.verbose = true;
             state->audioState.verbose = true;
         }
+        else if (strncmp("--pipeline-depth=", argv[i], 17) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 18)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->pipelineDepth = atoi(argv[i] + 17);
+        }
+        else if (strncmp("--pipeline-threads=", argv[i], 19) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 20)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->pipelineThreads = atoi(argv[i] + 19);
+        }
+        else if (strncmp("--segments=", argv[i], 11) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 12)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->nSegments = atoi(argv[i] + 11);
+        }
         else if (strncmp("--track-to-display=", argv[i], 19) == 0)
         {
             state->nOptions++;
@@ -367,6 +539,31 @@ int parseOptions(State *state, int argc, char **argv)
             }
             state->noteAcceleration = atof(argv[i] + 15);
         }
+        else if (strncmp("--note-lod-error=", argv[i], 17) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 18)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->noteLodError = atof(argv[i] + 17);
+        }
+        else if (strcmp("--closed-form-physics", argv[i]) == 0)
+        {
+            state->nOptions++;
+            state->closedFormPhysics = true;
+        }
+        else if (strncmp("--density-threshold=", argv[i], 20) == 0)
+        {
+            state->nOptions++;
+            if (strlen(argv[i]) < 21)
+            {
+                fprintf(stderr, "Unable to interpret %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            state->densityThreshold = atoi(argv[i] + 20);
+        }
         else if (strncmp("--random-seed=", argv[i], 14) == 0)
         {
             state->nOptions++;
@@ -442,6 +639,72 @@ int parseOptions(State *state, int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (state->pipelineDepth < 0)
+    {
+        fprintf(stderr, "Pipeline depth must be 0 or more.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (state->pipelineThreads < 1 || state->pipelineThreads > PIPELINE_MAX_THREADS)
+    {
+        fprintf(stderr, "Number of pipeline threads must be from 1 to %d.\n", PIPELINE_MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+
+    if (state->videoState.rgb2yuvThreads < 0 || state->videoState.rgb2yuvThreads > WORKERS_MAX_THREADS)
+    {
+        fprintf(stderr, "Number of RGB to YUV threads must be from 0 to %d.\n", WORKERS_MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+
+    if (state->videoState.postOptions.blurRadius < 0 || state->videoState.postOptions.blurPasses < 0)
+    {
+        fprintf(stderr, "Blur radius and passes must be 0 or more.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (state->videoState.postOptions.bloomStrength < 0.0)
+    {
+        fprintf(stderr, "Bloom strength must be 0 or more.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (state->videoState.videoThreads < 0 || state->videoState.videoThreads > WORKERS_MAX_THREADS)
+    {
+        fprintf(stderr, "Number of video threads must be from 0 to %d.\n", WORKERS_MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+    if (state->videoState.postThreads < 0 || state->videoState.postThreads > WORKERS_MAX_THREADS)
+    {
+        fprintf(stderr, "Number of post-processing threads must be from 0 to %d.\n", WORKERS_MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+
+    if (state->noteLodError < 0.0)
+    {
+        fprintf(stderr, "Note level of detail error must be 0 or more.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (state->closedFormPhysics && state->noteAcceleration < 0.0)
+    {
+        fprintf(stderr, "--closed-form-physics needs an acceleration of 0 or more.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (state->densityThreshold < 0)
+    {
+        fprintf(stderr, "Density threshold must be 0 or more.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (state->videoState.variableFrameRate && !state->videoState.reuseStaticFrames)
+    {
+        fprintf(stderr, "--variable-frame-rate drops reused static frames, and cannot be used with --no-static-frame-reuse.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (state->nSegments < 1)
+    {
+        fprintf(stderr, "Number of segments must be at least 1.\n");
+        exit(EXIT_FAILURE);
+    }
+
     state->audioState.midiFilename = argv[1];
     state->audioState.audioFilename = argv[2];
     state->videoState.outputFilename = argv[3];
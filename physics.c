@@ -1,179 +1,691 @@
-
 #include "physics.h"
 #include "midi.h"
 
-int initializeNoteDynamics(State *state, MidiNote *note, int noteSpan, int minNote)
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// The shear and wiggle sines have always used this value
+#define PHYSICS_PI 3.14159
+
+typedef int PhysicsMask __attribute__((vector_size(NOTE_DYNAMICS_LANES * sizeof(int))));
+
+// Constants for one frame's update
+typedef struct FrameParameters
 {
-    if (state == NULL || state->song == NULL || note == NULL)
-        return PHYSICS_ARG;
+    float dt;
+    float dvy;
+    float inverseHeight;
+    float wiggleScale;
+    float turnsPerPixel; // wiggle, in turns of a true 2 pi
+    const ShearProfile *shear; // at this frame's time
+} FrameParameters;
+
+static int growSlotArray(float **array, int oldCount, int newCount)
+{
+    void *mem = NULL;
+    if (posix_memalign(&mem, sizeof(PhysicsVector), (size_t)newCount * NOTE_DYNAMICS_STRIDE * sizeof(float)) != 0)
+        return PHYSICS_MEMORY;
+    memset(mem, 0, (size_t)newCount * NOTE_DYNAMICS_STRIDE * sizeof(float));
+    if (*array != NULL)
+        memcpy(mem, *array, (size_t)oldCount * NOTE_DYNAMICS_STRIDE * sizeof(float));
+    free(*array);
+    *array = mem;
 
+    return PHYSICS_OK;
+}
 
-    NoteDynamics *d = &note->dynamics;
-    d->mass = (double)note->speed / 127.0;
-    note->length = note->stopTime - note->startTime;
+static int growSlots(PhysicsBatch *batch)
+{
+    int n = batch->allocatedSlots + PHYSICS_ALLOCATION_INCREMENT;
+    void *mem = NULL;
+
+    if (growSlotArray(&batch->x, batch->allocatedSlots, n) != PHYSICS_OK
+        || growSlotArray(&batch->y, batch->allocatedSlots, n) != PHYSICS_OK
+        || growSlotArray(&batch->vx, batch->allocatedSlots, n) != PHYSICS_OK
+        || growSlotArray(&batch->vy, batch->allocatedSlots, n) != PHYSICS_OK)
+        return PHYSICS_MEMORY;
+
+    mem = realloc(batch->inverseMass, n * sizeof *batch->inverseMass);
+    if (mem == NULL)
+        return PHYSICS_MEMORY;
+    batch->inverseMass = mem;
+    mem = realloc(batch->noteShear, n * sizeof *batch->noteShear);
+    if (mem == NULL)
+        return PHYSICS_MEMORY;
+    batch->noteShear = mem;
+    mem = realloc(batch->freeSlots, n * sizeof *batch->freeSlots);
+    if (mem == NULL)
+        return PHYSICS_MEMORY;
+    batch->freeSlots = mem;
+    mem = realloc(batch->nPoints, n * sizeof *batch->nPoints);
+    if (mem == NULL)
+        return PHYSICS_MEMORY;
+    batch->nPoints = mem;
+    mem = realloc(batch->originX, n * sizeof *batch->originX);
+    if (mem == NULL)
+        return PHYSICS_MEMORY;
+    batch->originX = mem;
+    mem = realloc(batch->entrySpacing, n * sizeof *batch->entrySpacing);
+    if (mem == NULL)
+        return PHYSICS_MEMORY;
+    batch->entrySpacing = mem;
+    mem = realloc(batch->entryY, n * sizeof *batch->entryY);
+    if (mem == NULL)
+        return PHYSICS_MEMORY;
+    batch->entryY = mem;
+
+    batch->allocatedSlots = n;
 
-    double yStart =  (int)((note->screenTime / state->windowTimeSpan ) * state->videoState.frameHeight);
-    double yStop = yStart - (int) ((note->length / state->windowTimeSpan) * state->videoState.frameHeight);
-    double length = yStart - yStop;
+    return PHYSICS_OK;
+}
 
-    for (int i = 0; i < NOTE_DYNAMICS_POINTS; i++)
+// Weights of the shear field's y points at y, as sampleShearProfile() interpolates them
+static void shearWeights(double y, double height, int nY, double *weights)
+{
+    double s = y > 0.0 ? y * (double)(nY - 1) / height : 0.0;
+    int i = (int)s;
+
+    for (int k = 0; k < nY; k++)
+        weights[k] = 0.0;
+    if (i >= nY - 1)
     {
-        d->x[i] = ((double)(note->note - minNote) / (double)noteSpan * state->videoState.frameWidth);
-        d->y[i] = yStart - length * ((double) i / (double)(NOTE_DYNAMICS_POINTS - 1));
+        weights[nY - 1] = 1.0;
+        return;
+    }
+    // The slope carries the extra factor of nY - 1
+    weights[i] = 1.0 - (s - (double)i) * (double)(nY - 1);
+    weights[i + 1] = (s - (double)i) * (double)(nY - 1);
 
-        d->vx[i] = 0;
-        d->vy[i] = state->videoState.frameHeight / state->windowTimeSpan;
+    return;
+}
+
+static int initKinematics(State *state, NoteKinematics *k)
+{
+    double height = state->videoState.frameHeight;
+    double span = state->windowTimeSpan;
+    // Angles were 2 * PHYSICS_PI * turns
+    double turnScale = PHYSICS_PI / M_PI;
+    double turnsPerPixel = turnScale / (state->wiggleWavelength * height);
+    double turnsPerSecond = turnScale / state->wigglePeriod;
+
+    k->vy = height / span;
+    k->acceleration = 10.0 * state->noteAcceleration * height / span / span;
+    k->wiggleScale = 0.1 * state->videoState.frameWidth * state->wiggleAmplitude;
+    k->nY = state->shearField.nY;
+
+    // Out to twice the frame height, with 64 entries per turn of the wave at the fastest
+    double tMax = k->acceleration > 0.0 ? (sqrt(k->vy * k->vy + 4.0 * k->acceleration * height) - k->vy) / k->acceleration : 2.0 * height / k->vy;
+    double rate = fmax(fabs(k->vy * turnsPerPixel - turnsPerSecond), fabs((k->vy + k->acceleration * tMax) * turnsPerPixel - turnsPerSecond));
+    double step = rate > 0.0 ? fmin(1.0 / 240.0, 1.0 / (64.0 * rate)) : 1.0 / 240.0;
+    k->nSteps = (int)ceil(tMax / step) + 1;
+    if (k->nSteps > KINEMATICS_MAX_STEPS)
+        k->nSteps = KINEMATICS_MAX_STEPS;
+    k->step = tMax / (double)(k->nSteps - 1);
+    k->tableTime = tMax;
+
+    int nShear = 4 * k->nY;
+    k->wiggle = calloc((size_t)k->nSteps * 4, sizeof *k->wiggle);
+    k->shear = calloc((size_t)k->nSteps * nShear, sizeof *k->shear);
+    k->scratch = malloc((size_t)2 * nShear * sizeof *k->scratch);
+    double *f = malloc((size_t)2 * (2 + 2 * k->nY) * sizeof *f);
+    if (k->wiggle == NULL || k->shear == NULL || k->scratch == NULL || f == NULL)
+    {
+        free(f);
+        return PHYSICS_MEMORY;
+    }
+
+    // Integrands at this entry and the last: wiggle sin, cos, then per y point its weight and time times it
+    double *now = f;
+    double *last = f + 2 + 2 * k->nY;
+    double *weights = now + 2;
+    double *w = NULL;
+    double *s = NULL;
+    double u = 0.0;
+    double y = 0.0;
+    double angle = 0.0;
+    double yFraction2 = 0.0;
+
+    for (int j = 0; j < k->nSteps; j++)
+    {
+        u = (double)j * k->step;
+        y = k->vy * u + 0.5 * k->acceleration * u * u;
+        yFraction2 = (y / height) * (y / height);
+        angle = 2.0 * M_PI * (turnsPerPixel * y - turnsPerSecond * u);
+        now[0] = yFraction2 * sin(angle);
+        now[1] = yFraction2 * cos(angle);
+        shearWeights(y, height, k->nY, weights);
+        for (int i = 0; i < k->nY; i++)
+            now[2 + k->nY + i] = u * weights[i];
+
+        // Trapezoidal first and second integrals
+        w = k->wiggle + (size_t)j * 4;
+        s = k->shear + (size_t)j * nShear;
+        if (j > 0)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                w[2 * i] = w[2 * i - 4] + 0.5 * k->step * (last[i] + now[i]);
+                w[2 * i + 1] = w[2 * i - 3] + 0.5 * k->step * (w[2 * i - 4] + w[2 * i]);
+            }
+            for (int i = 0; i < 2 * k->nY; i++)
+            {
+                s[2 * i] = s[2 * i - nShear] + 0.5 * k->step * (last[2 + i] + now[2 + i]);
+                s[2 * i + 1] = s[2 * i + 1 - nShear] + 0.5 * k->step * (s[2 * i - nShear] + s[2 * i]);
+            }
+        }
+        memcpy(last, now, (2 + 2 * k->nY) * sizeof *now);
     }
+    free(f);
 
     return PHYSICS_OK;
 }
 
-void updateNoteDynamics(State *state, MidiNote *note, int trackNumber, double framePeriod, double videoTime, MidiNote *pedal)
+static void freeKinematics(NoteKinematics *k)
 {
-    if (state == NULL || state->song == NULL || note == NULL)
-        return;
+    free(k->wiggle);
+    free(k->shear);
+    free(k->scratch);
+    k->wiggle = NULL;
+    k->shear = NULL;
+    k->scratch = NULL;
+
+    return;
+}
 
-    NoteDynamics *d = &note->dynamics;
+// Tabulated integrals at time u after entering the frame, interpolated
+static void kinematicsAt(const NoteKinematics *k, const double *table, int count, double u, double *out)
+{
+    double p = u < k->tableTime ? u / k->step : (double)(k->nSteps - 1);
+    int j = (int)p;
+    if (j > k->nSteps - 2)
+        j = k->nSteps - 2;
+    double f = p - (double)j;
+    const double *a = table + (size_t)j * count;
+    const double *b = a + count;
 
-    double ax = 0.0;
-    double yfraction = 0.0;
+    for (int i = 0; i < count; i++)
+        out[i] = a[i] + f * (b[i] - a[i]);
 
-    double rMax = (double)RAND_MAX;
-    double a = 0;
-    double acceleration = 10.0 * state->noteAcceleration * state->videoState.frameHeight / state->windowTimeSpan / state->windowTimeSpan;
+    return;
+}
 
-    double wiggleWavelenthPixels = state->wiggleWavelength * (double) state->videoState.frameHeight;
+// Wiggle integrals at u. Past the table the sideways velocity holds.
+static void wiggleAt(const NoteKinematics *k, double u, double *out)
+{
+    kinematicsAt(k, k->wiggle, 4, u, out);
+    if (u > k->tableTime)
+    {
+        out[1] += out[0] * (u - k->tableTime);
+        out[3] += out[2] * (u - k->tableTime);
+    }
+
+    return;
+}
+
+// Shear integrals at u. Past the table points are below the frame, where only the last y point counts.
+static void shearAt(const NoteKinematics *k, double u, double *out)
+{
+    int nY = k->nY;
+    double tm = k->tableTime;
+    double d = u - tm;
+
+    kinematicsAt(k, k->shear, 4 * nY, u, out);
+    if (d <= 0.0)
+        return;
+    for (int i = 0; i < 2 * nY; i++)
+        out[2 * i + 1] += out[2 * i] * d;
+    out[2 * (nY - 1)] += d;
+    out[2 * (nY - 1) + 1] += 0.5 * d * d;
+    out[2 * (2 * nY - 1)] += 0.5 * (u * u - tm * tm);
+    out[2 * (2 * nY - 1) + 1] += (u * u * u - tm * tm * tm) / 6.0 - 0.5 * tm * tm * d;
 
-    double extraSustain = 0.0;
-    double noteExtension = 0.0;
-    if (pedal != NULL)
+    return;
+}
+
+// Double integral to tau of a function that is zero outside [a, b], from its integrals at a and b
+static inline double windowIntegral(const double *lower, const double *upper, double a, double b, double tau)
+{
+    return upper[1] - lower[1] - lower[0] * (b - a) + (upper[0] - lower[0]) * (tau - b);
+}
+
+// Sideways displacement per unit of note shear, tau after entering the frame at entryTime.
+// The field is linear in time between its knots (with the slope of shearProfileAt()), so over
+// each stretch it is a value plus a slope times u, each weighting the y points' functions.
+static double shearDisplacement(const NoteKinematics *k, const ShearField *field, double entryTime, double tau)
+{
+    int nY = k->nY;
+    int nT = field->nTimes;
+    double cell = nT > 1 ? field->maxTime / (double)(nT - 1) : field->maxTime;
+    double *lower = k->scratch;
+    double *upper = k->scratch + 4 * nY;
+    const double *a1 = NULL;
+    const double *a2 = NULL;
+    double start = 0.0;
+    double end = 0.0;
+    double a = 0.0;
+    double b = 0.0;
+    double value = 0.0;
+    double slope = 0.0;
+    double sum = 0.0;
+
+    // Stretch -1 is before the first knot and nT - 1 after the last, where the field holds
+    int c = entryTime < 0.0 ? -1 : (int)fmin(floor(entryTime / cell), (double)(nT - 1));
+    for (; c < nT; c++)
     {
-        extraSustain = pedal->stopTime - videoTime;
-        noteExtension = pedal->stopTime - note->stopTime;
+        start = c < 0 ? -INFINITY : (double)c * cell;
+        if (start >= entryTime + tau)
+            break;
+        end = c < 0 ? 0.0 : (c >= nT - 1 ? INFINITY : (double)(c + 1) * cell);
+        a = fmax(0.0, start - entryTime);
+        b = fmin(tau, end - entryTime);
+        if (b <= a)
+            continue;
+        if (a > 0.0)
+            shearAt(k, a, lower);
+        else
+            memset(lower, 0, 4 * nY * sizeof *lower);
+        shearAt(k, b, upper);
+
+        a1 = field->table + (size_t)(c < 0 ? 0 : c) * nY;
+        a2 = c < 0 || c >= nT - 1 ? a1 : a1 + nY;
+        for (int i = 0; i < nY; i++)
+        {
+            slope = (double)(nT - 1) * (a2[i] - a1[i]) / cell;
+            value = a1[i] + (c < 0 ? 0.0 : (entryTime - (double)c * cell) * slope);
+            sum += value * windowIntegral(lower + 2 * i, upper + 2 * i, a, b, tau)
+                + slope * windowIntegral(lower + 2 * (nY + i), upper + 2 * (nY + i), a, b, tau);
+        }
     }
-    if (extraSustain < 0.0)
-        extraSustain = 0.0;
-    if (noteExtension > 10.0)
-        noteExtension = 10.0;
 
-    int extInd = 0;
+    return sum;
+}
 
-    for (int u=0; u < NOTE_DYNAMICS_POINTS; u++)
+// Every point of one note where it is at time
+static void placeNote(State *state, PhysicsBatch *batch, MidiNote *note, int track, double time)
+{
+    const NoteKinematics *k = &batch->kinematics;
+    int slot = note->dynamicsSlot;
+    float *x = batch->x + (size_t)slot * NOTE_DYNAMICS_STRIDE;
+    float *y = batch->y + (size_t)slot * NOTE_DYNAMICS_STRIDE;
+    double turnScale = PHYSICS_PI / M_PI;
+    double noteShear = batch->noteShear[slot];
+    double wiggleScale = k->wiggleScale * batch->inverseMass[slot];
+    double wiggle[4] = {0.0};
+    double entry = 0.0;
+    double tau = 0.0;
+    double y0 = 0.0;
+    double c = 0.0;
+
+    // The wave's phase when each point entered, turning by the same angle from one point to the next
+    double turns = turnScale * (track / state->song->nTracks);
+    double phase = 2.0 * M_PI * (turns - floor(turns));
+    double cosPhase = cos(phase);
+    double sinPhase = sin(phase);
+    double turn = -2.0 * M_PI * turnScale * batch->entrySpacing[slot] / state->wigglePeriod;
+    double cosTurn = cos(turn);
+    double sinTurn = sin(turn);
+
+    for (int i = 0; i < batch->nPoints[slot]; i++)
     {
-        // Update vy and vx
-        if (d->y[u] >= 0)
+        if (i > 0)
         {
-            extInd++;
-            d->vy[u] += acceleration * framePeriod;
-            yfraction = d->y[u]/state->videoState.frameHeight;
-            ax = 0;
-            xAcceleration(state, d->y[u], videoTime, &ax);
-            ax *= 1.0 * state->flowShearScale * sin(2.0 * 3.14159 * (double) note->note / (double) state->song->noteSpan);
-            // ax *= 1.0 * state->flowShearScale * sin(2.0 * 3.14159 * (double) trackNumber / (double) state->song->nTracks);
-            ax += 0.1 * state->videoState.frameWidth * state->wiggleAmplitude * yfraction * yfraction * sin(2. * 3.14159 * (d->y[u] / wiggleWavelenthPixels - (videoTime - note->startTime) / state->wigglePeriod + trackNumber / state->song->nTracks)) / (d->mass > 0 ? d->mass : 1.0);
-            d->vx[u] += ax * framePeriod;
+            c = cosPhase * cosTurn - sinPhase * sinTurn;
+            sinPhase = sinPhase * cosTurn + cosPhase * sinTurn;
+            cosPhase = c;
         }
-        else if (state->pedalModifiesNotelength && pedal != NULL && pedal->startTime <= videoTime && pedal->stopTime > videoTime && note->stopTime >= pedal->startTime && note->stopTime < pedal->stopTime && pedal->speed > 0 && extraSustain > 0)
+        entry = note->startTime + (double)i * batch->entrySpacing[slot];
+        tau = time - entry;
+        y0 = i == 0 ? batch->entryY[slot] : 0.0;
+        // Still coasting down to the top of the frame
+        if (tau <= 0.0)
         {
-            // Extend note stop time if pedal is down
-            note->stopTime += noteExtension;
-            note->length = note->stopTime - note->startTime;
-            // printf(" (extra sustain = %lf)", extraSustain);
-            for (int v = u; v < NOTE_DYNAMICS_POINTS; v++)
-            {
-                double before = d->y[v];
-                d->y[v] = -d->vy[v] * (double)(v - extInd) * extraSustain / (double) (NOTE_DYNAMICS_POINTS - extInd);
-            }
-            u = NOTE_DYNAMICS_POINTS - 1;
+            x[i] = batch->originX[slot];
+            y[i] = (float)(y0 + k->vy * tau);
+            continue;
         }
-        // Update y and x
-        d->y[u] += d->vy[u] * framePeriod;
-        d->x[u] += d->vx[u] * framePeriod;
+
+        wiggleAt(k, tau, wiggle);
+        x[i] = (float)(batch->originX[slot] + noteShear * shearDisplacement(k, batch->field, entry, tau) + wiggleScale * (cosPhase * wiggle[1] + sinPhase * wiggle[3]));
+        y[i] = (float)(y0 + k->vy * tau + 0.5 * k->acceleration * tau * tau);
     }
 
     return;
-
 }
 
-int xAcceleration(State *state, double y, double videoTime, double *acceleration)
+int initPhysicsBatch(State *state, PhysicsBatch *batch)
 {
-    if (state == NULL || acceleration == NULL)
+    if (state == NULL || batch == NULL || state->shearField.table == NULL)
         return PHYSICS_ARG;
 
-    static bool initialized = false;
+    memset(batch, 0, sizeof *batch);
+    if (initShearProfile(&batch->shear, &state->shearField) != SHEAR_OK)
+        return PHYSICS_MEMORY;
+
+    batch->closedForm = state->closedFormPhysics;
+    batch->field = &state->shearField;
+    if (batch->closedForm && initKinematics(state, &batch->kinematics) != PHYSICS_OK)
+        return PHYSICS_MEMORY;
 
-    static double *xAccel = NULL;
+    return growSlots(batch);
+}
 
-    double rMax = (double)RAND_MAX;
-    double r = 0;
-    double yFrac = 0;
-    int nY = state->nShearYPoints;
-    int nT = state->nShearTimes;
+void freePhysicsBatch(PhysicsBatch *batch)
+{
+    if (batch == NULL)
+        return;
 
-    if (!initialized)
-    {
-        xAccel = calloc(nT * nY, sizeof *xAccel);
+    free(batch->x);
+    free(batch->y);
+    free(batch->vx);
+    free(batch->vy);
+    free(batch->inverseMass);
+    free(batch->noteShear);
+    free(batch->freeSlots);
+    free(batch->nPoints);
+    free(batch->originX);
+    free(batch->entrySpacing);
+    free(batch->entryY);
+    free(batch->work);
+    freeKinematics(&batch->kinematics);
+    freeShearProfile(&batch->shear);
+    memset(batch, 0, sizeof *batch);
 
-        if (xAccel == NULL)
-            return PHYSICS_MEMORY;
+    return;
+}
 
-        for (int ti = 0; ti < nT; ti++)
-        {
-            for (int yi = 0; yi < nY; yi++)
-            {
+// Fewest control points keeping a note within noteLodError pixels of a polyline through its
+// particles. Points spaced h apart cut a curve of curvature k by at most k h^2 / 8. The wiggle
+// forces each point at angular frequency w as it falls through the wave, so the ribbon's sideways
+// amplitude is about a / w^2 at the wave's spatial frequency; the shear's curvature is bounded by
+// twice its acceleration over vy^2 per knot. The length allows for the stretch from acceleration.
+static int notePointCount(State *state, double length, double duration, double inverseMass)
+{
+    if (state->noteLodError <= 0.0)
+        return NOTE_DYNAMICS_POINTS;
+
+    double height = state->videoState.frameHeight;
+    double span = state->windowTimeSpan;
+    double vy = height / span;
+    double acceleration = 10.0 * state->noteAcceleration * height / span / span;
+    // Time to fall through the frame; the head gains acceleration * duration on the tail meanwhile
+    double fall = acceleration > 0.0 ? (sqrt(vy * vy + 2.0 * acceleration * height) - vy) / acceleration : span;
+    double maxLength = length + acceleration * duration * fall;
+
+    double k = 2.0 * PHYSICS_PI / (state->wiggleWavelength * height);
+    double w = fabs(k * vy - 2.0 * PHYSICS_PI / state->wigglePeriod);
+    double a = 0.1 * state->videoState.frameWidth * fabs(state->wiggleAmplitude) * inverseMass;
+    double amplitude = w * w * span * span > 2.0 ? a / (w * w) : a * span * span / 2.0;
+    double curvature = amplitude * k * k + 2.0 * fabs(state->flowShearScale) * state->nShearYPoints / (vy * vy);
+
+    double spacing = sqrt(8.0 * state->noteLodError / (curvature > 0.0 ? curvature : 1e-12));
+    double n = 1.0 + ceil(maxLength / spacing);
+
+    return n > NOTE_DYNAMICS_POINTS ? NOTE_DYNAMICS_POINTS : (n < NOTE_DYNAMICS_MIN_POINTS ? NOTE_DYNAMICS_MIN_POINTS : (int)n);
+}
 
-                // Pseudo random number between -1 and 1
-                r = 2.0 * rand() / rMax - 1.0;
-                yFrac = (double) yi / (double) (nY - 1);
-                xAccel[ti * nY + yi] = r * yFrac * yFrac;
-            }
-        }
+int initializeNoteDynamics(State *state, PhysicsBatch *batch, MidiNote *note, int noteSpan, int minNote)
+{
+    if (state == NULL || state->song == NULL || batch == NULL || note == NULL)
+        return PHYSICS_ARG;
 
-        initialized = true;
+    int slot = 0;
+    if (batch->nFreeSlots > 0)
+        slot = batch->freeSlots[--batch->nFreeSlots];
+    else
+    {
+        if (batch->nSlots == batch->allocatedSlots && growSlots(batch) != PHYSICS_OK)
+            return PHYSICS_MEMORY;
+        slot = batch->nSlots++;
     }
-    // Linear interpolation of force
-    double deltaY = 1.0 / (double) (nY - 1);
-    double yVal = (double)y / (double) state->videoState.frameHeight / deltaY;
-    int yi1 = floor(yVal);
-    int yi2 = yi1 + 1;
-    if (yi1 < 0)
+    note->dynamicsSlot = slot;
+
+    double mass = (double)note->speed / 127.0;
+    batch->inverseMass[slot] = (float)(1.0 / (mass > 0 ? mass : 1.0));
+    batch->noteShear[slot] = (float)(state->flowShearScale * sin(2.0 * PHYSICS_PI * (double) note->note / (double) state->song->noteSpan));
+
+    double yStart =  (int)((note->screenTime / state->windowTimeSpan ) * state->videoState.frameHeight);
+    double yStop = yStart - (int) (((note->stopTime - note->startTime) / state->windowTimeSpan) * state->videoState.frameHeight);
+    double length = yStart - yStop;
+    int nPoints = notePointCount(state, length, note->stopTime - note->startTime, 1.0 / (mass > 0 ? mass : 1.0));
+    batch->nPoints[slot] = nPoints;
+    // Closed form: the head reaches the top of the frame at the start time, the tail at the stop time
+    batch->originX[slot] = (float)((double)(note->note - minNote) / (double)noteSpan * state->videoState.frameWidth);
+    batch->entrySpacing[slot] = (float)((note->stopTime - note->startTime) / (double)(nPoints - 1));
+    batch->entryY[slot] = 0.0f;
+
+    float *x = batch->x + (size_t)slot * NOTE_DYNAMICS_STRIDE;
+    float *y = batch->y + (size_t)slot * NOTE_DYNAMICS_STRIDE;
+    float *vx = batch->vx + (size_t)slot * NOTE_DYNAMICS_STRIDE;
+    float *vy = batch->vy + (size_t)slot * NOTE_DYNAMICS_STRIDE;
+
+    for (int i = 0; i < NOTE_DYNAMICS_STRIDE; i++)
     {
-        yi1 = 0;
-        yi2 = 0;
+        // Padding points stay at rest
+        if (i >= nPoints)
+        {
+            x[i] = y[i] = vx[i] = vy[i] = 0.0f;
+            continue;
+        }
+        x[i] = (float)((double)(note->note - minNote) / (double)noteSpan * state->videoState.frameWidth);
+        y[i] = (float)(yStart - length * ((double) i / (double)(nPoints - 1)));
+
+        vx[i] = 0.0f;
+        vy[i] = (float)(state->videoState.frameHeight / state->windowTimeSpan);
     }
-    if (yi2 >= nY)
+
+    return PHYSICS_OK;
+}
+
+void releaseNoteDynamics(PhysicsBatch *batch, MidiNote *note)
+{
+    if (batch == NULL || note == NULL || !note->playing || note->dynamicsSlot < 0)
+        return;
+
+    batch->freeSlots[batch->nFreeSlots++] = note->dynamicsSlot;
+    note->dynamicsSlot = -1;
+    note->playing = false;
+
+    return;
+}
+
+int queueNoteDynamics(PhysicsBatch *batch, MidiNote *note, int trackNumber)
+{
+    if (batch == NULL || note == NULL)
+        return PHYSICS_ARG;
+
+    void *mem = NULL;
+    if (batch->nWork == batch->allocatedWork)
     {
-        yi2 = nY - 1;
-        yi1 = nY - 1;
+        mem = realloc(batch->work, (batch->allocatedWork + PHYSICS_ALLOCATION_INCREMENT) * sizeof *batch->work);
+        if (mem == NULL)
+            return PHYSICS_MEMORY;
+        batch->work = mem;
+        batch->allocatedWork += PHYSICS_ALLOCATION_INCREMENT;
     }
+    batch->work[batch->nWork].note = note;
+    batch->work[batch->nWork].track = trackNumber;
+    batch->nWork++;
+
+    return PHYSICS_OK;
+}
 
-    double deltaT = 1.0 / (double) (nT - 1);
-    double tVal = (double)videoTime / (double) state->song->maxTime / deltaT;
-    int ti1 = floor(tVal);
-    int ti2 = ti1 + 1;
-    if (ti1 < 0)
+// Odd polynomial for sin(2 pi t), reduced to a quarter turn
+#define SINE_C3 (-1.0f / 6.0f)
+#define SINE_C5 (1.0f / 120.0f)
+#define SINE_C7 (-1.0f / 5040.0f)
+#define SINE_C9 (1.0f / 362880.0f)
+#define TWO_PI_F 6.283185307f
+
+// Lanes of a where the mask is set, b elsewhere
+#define SELECT(m, a, b) ((PhysicsVector)(((PhysicsMask)(a) & (m)) | ((PhysicsMask)(b) & ~(m))))
+#define SPLAT(v) ((PhysicsVector){(v), (v), (v), (v), (v), (v), (v), (v)})
+
+// All points of one note, NOTE_DYNAMICS_LANES at a time. Points above the
+// top of the frame coast.
+__attribute__((target_clones("avx2", "default")))
+static void updateNoteVector(const FrameParameters *f, PhysicsBatch *batch, int slot, int nPoints, float phase, float noteShear, float inverseMass)
+{
+    PhysicsVector *x = (PhysicsVector *)(batch->x + (size_t)slot * NOTE_DYNAMICS_STRIDE);
+    PhysicsVector *y = (PhysicsVector *)(batch->y + (size_t)slot * NOTE_DYNAMICS_STRIDE);
+    PhysicsVector *vx = (PhysicsVector *)(batch->vx + (size_t)slot * NOTE_DYNAMICS_STRIDE);
+    PhysicsVector *vy = (PhysicsVector *)(batch->vy + (size_t)slot * NOTE_DYNAMICS_STRIDE);
+
+    PhysicsMask index = {0, 1, 2, 3, 4, 5, 6, 7};
+    PhysicsMask points = {nPoints, nPoints, nPoints, nPoints, nPoints, nPoints, nPoints, nPoints};
+    PhysicsVector zero = SPLAT(0.0f);
+    PhysicsVector one = SPLAT(1.0f);
+    PhysicsVector dt = SPLAT(f->dt);
+    PhysicsVector yv, yFraction, shear, fraction, ax;
+    PhysicsVector t, r, a, a2, wiggle;
+    PhysicsMask live, onScreen, q, i;
+    const ShearProfile *profile = f->shear;
+    PhysicsMask maxIndex = {profile->maxIndex, profile->maxIndex, profile->maxIndex, profile->maxIndex, profile->maxIndex, profile->maxIndex, profile->maxIndex, profile->maxIndex};
+    PhysicsVector maxScaled = SPLAT((float)profile->maxIndex);
+    PhysicsVector scaled;
+
+    for (int v = 0; v < (nPoints + NOTE_DYNAMICS_LANES - 1) / NOTE_DYNAMICS_LANES; v++, index += NOTE_DYNAMICS_LANES)
     {
-        ti1 = 0;
-        ti2 = 0;
+        live = index < points;
+        yv = y[v];
+        onScreen = (yv >= zero) & live;
+
+        // sampleShearProfile(): fixed-point index, clamped before conversion, then a lookup one lane at a time
+        scaled = SELECT(yv > zero, yv, zero) * profile->indexScale;
+        scaled = SELECT(scaled > maxScaled, maxScaled, scaled);
+        q = __builtin_convertvector(scaled, PhysicsMask);
+        q = (q & ~(q > maxIndex)) | (maxIndex & (q > maxIndex));
+        i = q >> SHEAR_FRACTION_BITS;
+        fraction = __builtin_convertvector(q & ((1 << SHEAR_FRACTION_BITS) - 1), PhysicsVector) * (1.0f / (1 << SHEAR_FRACTION_BITS));
+        for (int k = 0; k < NOTE_DYNAMICS_LANES; k++)
+            shear[k] = profile->value[i[k]] + fraction[k] * profile->slope[i[k]];
+
+        // sin(2 pi t) on a quarter turn
+        t = yv * f->turnsPerPixel + phase;
+        r = __builtin_convertvector(__builtin_convertvector(t, PhysicsMask), PhysicsVector);
+        r = t - (r - SELECT(r > t, one, zero));
+        r -= SELECT(r > SPLAT(0.5f), one, zero);
+        r = SELECT(r > SPLAT(0.25f), SPLAT(0.5f) - r, r);
+        r = SELECT(r < SPLAT(-0.25f), SPLAT(-0.5f) - r, r);
+        a = TWO_PI_F * r;
+        a2 = a * a;
+        wiggle = a * (1.0f + a2 * (SINE_C3 + a2 * (SINE_C5 + a2 * (SINE_C7 + a2 * SINE_C9))));
+
+        yFraction = yv * f->inverseHeight;
+        ax = shear * noteShear + f->wiggleScale * yFraction * yFraction * wiggle * inverseMass;
+
+        vy[v] += SELECT(onScreen, SPLAT(f->dvy), zero);
+        vx[v] += SELECT(onScreen, ax * dt, zero);
+        y[v] += SELECT(live, vy[v] * dt, zero);
+        x[v] += SELECT(live, vx[v] * dt, zero);
     }
-    if (ti2 >= nT)
+
+    return;
+}
+
+void updateNoteDynamics(State *state, PhysicsBatch *batch, double framePeriod, double videoTime)
+{
+    if (state == NULL || state->song == NULL || batch == NULL)
+        return;
+
+    if (batch->closedForm)
     {
-        ti2 = nT - 1;
-        ti1 = nT - 1;
+        for (int n = 0; n < batch->nWork; n++)
+            placeNote(state, batch, batch->work[n].note, batch->work[n].track, videoTime + framePeriod);
+        batch->nWork = 0;
+        return;
     }
 
-    double a11 = xAccel[ti1 * nY + yi1];
-    double a12 = xAccel[ti1 * nY + yi2];
-    double a21 = xAccel[ti2 * nY + yi1];
-    double a22 = xAccel[ti2 * nY + yi2];
-    
-    double a1 = a11 + (tVal - (double) ti1)*(a21 - a11) / deltaT; 
-    double a2 = a12 + (tVal - (double) ti1)*(a22 - a12) / deltaT; 
+    double acceleration = 10.0 * state->noteAcceleration * state->videoState.frameHeight / state->windowTimeSpan / state->windowTimeSpan;
+    double wiggleWavelenthPixels = state->wiggleWavelength * (double) state->videoState.frameHeight;
+    // Angles were 2 * PHYSICS_PI * turns
+    double turnScale = PHYSICS_PI / M_PI;
+
+    shearProfileAt(&state->shearField, videoTime, &batch->shear);
+
+    FrameParameters f = {0};
+    f.dt = (float)framePeriod;
+    f.dvy = (float)(acceleration * framePeriod);
+    f.inverseHeight = 1.0f / (float)state->videoState.frameHeight;
+    f.wiggleScale = (float)(0.1 * state->videoState.frameWidth * state->wiggleAmplitude);
+    f.turnsPerPixel = (float)(turnScale / wiggleWavelenthPixels);
+    f.shear = &batch->shear;
+
+    PhysicsWork *w = NULL;
+    MidiNote *note = NULL;
+    int slot = 0;
+    double turns = 0.0;
+    float phase = 0.0f;
+
+    for (int n = 0; n < batch->nWork; n++)
+    {
+        w = &batch->work[n];
+        note = w->note;
+        slot = note->dynamicsSlot;
 
-    double a = a1 + (yVal - (double) yi1)*(a2 - a1) / deltaY;
+        // Wiggle phase in double, the time term grows without bound
+        turns = turnScale * (-(videoTime - note->startTime) / state->wigglePeriod + w->track / state->song->nTracks);
+        phase = (float)(turns - floor(turns));
 
-    *acceleration = a;
+        updateNoteVector(&f, batch, slot, batch->nPoints[slot], phase, batch->noteShear[slot], batch->inverseMass[slot]);
+    }
+    batch->nWork = 0;
 
-    return PHYSICS_OK;
+    return;
 }
 
+int tessellateNote(const float *x, const float *y, int nPoints, float tolerance, float *xOut, float *yOut, int maxOut)
+{
+    if (nPoints < 1 || maxOut < 1)
+        return 0;
+
+    int n = 0;
+    int i0 = 0;
+    int i3 = 0;
+    int steps = 0;
+    float dx = 0.0f;
+    float dy = 0.0f;
+    float deviation = 0.0f;
+    float t = 0.0f;
+    float t2 = 0.0f;
+    float t3 = 0.0f;
+
+    xOut[n] = x[0];
+    yOut[n] = y[0];
+    n++;
+    for (int i = 0; i + 1 < nPoints; i++)
+    {
+        // Ends repeat their point for the tangent
+        i0 = i > 0 ? i - 1 : 0;
+        i3 = i + 2 < nPoints ? i + 2 : nPoints - 1;
+
+        // Midpoint of the span off its chord, (P1 + P2 - P0 - P3) / 16; it falls as 1 / steps^2
+        dx = (x[i] + x[i + 1] - x[i0] - x[i3]) / 16.0f;
+        dy = (y[i] + y[i + 1] - y[i0] - y[i3]) / 16.0f;
+        deviation = sqrtf(dx * dx + dy * dy);
+        steps = tolerance > 0.0f && deviation > tolerance ? (int)ceilf(sqrtf(deviation / tolerance)) : 1;
+        // Leave room for one point per remaining span
+        if (steps > maxOut - n - (nPoints - 2 - i))
+            steps = maxOut - n - (nPoints - 2 - i);
+        if (steps < 1)
+            steps = 1;
+
+        for (int s = 1; s < steps && n < maxOut; s++)
+        {
+            t = (float)s / (float)steps;
+            t2 = t * t;
+            t3 = t2 * t;
+            xOut[n] = 0.5f * (2.0f * x[i] + (x[i + 1] - x[i0]) * t + (2.0f * x[i0] - 5.0f * x[i] + 4.0f * x[i + 1] - x[i3]) * t2 + (3.0f * x[i] - x[i0] - 3.0f * x[i + 1] + x[i3]) * t3);
+            yOut[n] = 0.5f * (2.0f * y[i] + (y[i + 1] - y[i0]) * t + (2.0f * y[i0] - 5.0f * y[i] + 4.0f * y[i + 1] - y[i3]) * t2 + (3.0f * y[i] - y[i0] - 3.0f * y[i + 1] + y[i3]) * t3);
+            n++;
+        }
+        if (n < maxOut)
+        {
+            xOut[n] = x[i + 1];
+            yOut[n] = y[i + 1];
+            n++;
+        }
+    }
+
+    return n;
+}
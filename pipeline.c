@@ -0,0 +1,519 @@
+/*
+
+    flow: pipeline.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Render -> convert -> filter -> encode, one stage per thread.
+// The render thread (the caller) reads back each frame into a pooled
+// slot. Frames are dealt round-robin to the convert workers and collected
+// in the same order by the filter thread, so every queue has a single
+// producer and a single consumer. The encode thread also muxes the audio,
+// since it is the only thread writing to the output context.
+
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+static double pipelineClock(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int initFrameQueue(FrameQueue *queue, int capacity)
+{
+    queue->slots = calloc(capacity, sizeof *queue->slots);
+    if (queue->slots == NULL)
+        return VIDEO_MEMORY;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->tail = 0;
+
+    return VIDEO_OK;
+}
+
+static bool tryPushFrame(FrameQueue *queue, PipelineFrame *frame)
+{
+    uint64_t tail = queue->tail;
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head == queue->capacity)
+        return false;
+
+    queue->slots[tail % queue->capacity] = frame;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static PipelineFrame *tryPopFrame(FrameQueue *queue)
+{
+    uint64_t head = queue->head;
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return NULL;
+
+    PipelineFrame *frame = queue->slots[head % queue->capacity];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+    return frame;
+}
+
+static void backOff(int *spins)
+{
+    // Spin briefly, then sleep so an idle stage does not hog a core
+    if ((*spins)++ < 64)
+        sched_yield();
+    else
+        usleep(100);
+
+    return;
+}
+
+static void pushFrame(FrameQueue *queue, PipelineFrame *frame)
+{
+    int spins = 0;
+    while (!tryPushFrame(queue, frame))
+        backOff(&spins);
+
+    return;
+}
+
+static PipelineFrame *popFrame(FrameQueue *queue)
+{
+    int spins = 0;
+    PipelineFrame *frame = NULL;
+    while ((frame = tryPopFrame(queue)) == NULL)
+        backOff(&spins);
+
+    return frame;
+}
+
+static void setPipelineStatus(Pipeline *pipeline, int status)
+{
+    int expected = VIDEO_OK;
+    __atomic_compare_exchange_n(&pipeline->status, &expected, status, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+    return;
+}
+
+static int pipelineStatus(Pipeline *pipeline)
+{
+    return __atomic_load_n(&pipeline->status, __ATOMIC_ACQUIRE);
+}
+
+static void *convertWorker(void *arg)
+{
+    PipelineWorker *worker = (PipelineWorker *)arg;
+    Pipeline *pipeline = worker->pipeline;
+    VideoState *video = pipeline->video;
+    FrameQueue *in = &pipeline->convertQueues[worker->index];
+    FrameQueue *out = &pipeline->filterQueues[worker->index];
+    PipelineFrame *f = NULL;
+    double t0 = 0.0;
+
+    for (;;)
+    {
+        f = popFrame(in);
+        if (f->last)
+        {
+            pushFrame(out, f);
+            break;
+        }
+        if (f->repeat)
+        {
+            pushFrame(out, f);
+            continue;
+        }
+        t0 = pipelineClock();
+        if (av_frame_make_writable(f->frame) < 0)
+        {
+            setPipelineStatus(pipeline, VIDEO_MEMORY);
+            pushFrame(out, f);
+            continue;
+        }
+        convertFrame(video, pipeline->conversionContexts[worker->index], f->rgba, f->frame, video->sparseTiles ? &f->tiles : NULL);
+        f->frame->pts = f->frameNumber;
+        pipeline->convertTime[worker->index] += pipelineClock() - t0;
+        pushFrame(out, f);
+    }
+
+    return NULL;
+}
+
+static void *filterWorker(void *arg)
+{
+    Pipeline *pipeline = (Pipeline *)arg;
+    VideoState *video = pipeline->video;
+    PipelineFrame *f = NULL;
+    double t0 = 0.0;
+    int status = VIDEO_OK;
+
+    for (int64_t n = 0;; n++)
+    {
+        f = popFrame(&pipeline->filterQueues[n % pipeline->nConvertThreads]);
+        if (f->last)
+        {
+            pushFrame(&pipeline->encodeQueue, f);
+            break;
+        }
+        f->haveFiltered = false;
+        if (f->repeat)
+        {
+            pushFrame(&pipeline->encodeQueue, f);
+            continue;
+        }
+        if (video->post.active && pipelineStatus(pipeline) == VIDEO_OK)
+        {
+            t0 = pipelineClock();
+            if (av_frame_make_writable(f->frame) < 0)
+                setPipelineStatus(pipeline, VIDEO_MEMORY);
+            else
+                postProcessFrame(&video->post, f->frame->data, f->frame->linesize, video->sparseTiles ? &f->tiles : NULL);
+            pipeline->stageTime[PIPELINE_FILTER] += pipelineClock() - t0;
+        }
+        if (video->applyVideoFilter && pipelineStatus(pipeline) == VIDEO_OK)
+        {
+            t0 = pipelineClock();
+            status = filterVideoFrame(video, f->frame, f->filtered);
+            if (status == VIDEO_OK)
+                f->haveFiltered = true;
+            else if (status == VIDEO_FILTER)
+                setPipelineStatus(pipeline, status);
+            pipeline->stageTime[PIPELINE_FILTER] += pipelineClock() - t0;
+        }
+        pushFrame(&pipeline->encodeQueue, f);
+    }
+
+    return NULL;
+}
+
+static void *encodeWorker(void *arg)
+{
+    Pipeline *pipeline = (Pipeline *)arg;
+    VideoState *video = pipeline->video;
+    AudioState *audio = pipeline->audio;
+    PipelineFrame *f = NULL;
+    AVFrame *frame = NULL;
+    double t0 = 0.0;
+    int status = VIDEO_OK;
+
+    for (;;)
+    {
+        f = popFrame(&pipeline->encodeQueue);
+        if (f->last)
+            break;
+
+        if (pipelineStatus(pipeline) == VIDEO_OK)
+        {
+            t0 = pipelineClock();
+            if (f->repeat)
+            {
+                frame = pipeline->haveStaticFrame && !f->drop ? pipeline->staticFrame : NULL;
+                if (frame != NULL)
+                    frame->pts = f->frameNumber;
+            }
+            else if (video->applyVideoFilter)
+                frame = f->haveFiltered ? f->filtered : NULL;
+            else
+                frame = f->frame;
+            if (frame != NULL)
+            {
+                status = encodeVideoFrame(video, frame);
+                if (status == VIDEO_FRAME_SEND || status == VIDEO_FRAME_ENCODE || status == VIDEO_FRAME_WRITE)
+                    setPipelineStatus(pipeline, status);
+            }
+            // Only frames that may be repeated hold a reference, so other slots stay writable
+            if (!f->repeat)
+            {
+                av_frame_unref(pipeline->staticFrame);
+                pipeline->haveStaticFrame = f->keep && frame != NULL && av_frame_ref(pipeline->staticFrame, frame) == 0;
+            }
+            while (audio->haveAudio && pipeline->elapsedAudioTime < f->videoTime && pipeline->moreAudio)
+            {
+                status = transcodeAudioFrames(audio, (int)f->frameNumber, &pipeline->elapsedAudioTime, video->videoContext, video->videoCodecContext);
+                if (status == VIDEO_AUDIO_EOF)
+                    pipeline->moreAudio = false;
+            }
+            pipeline->stageTime[PIPELINE_ENCODE] += pipelineClock() - t0;
+        }
+        if (f->haveFiltered)
+            av_frame_unref(f->filtered);
+        f->haveFiltered = false;
+
+        // Back to the render thread
+        pushFrame(&pipeline->freeQueue, f);
+    }
+
+    return NULL;
+}
+
+// Ends the workers that started before another failed to, so their queues can be freed.
+// Each convert worker passes its end marker on, and the filter worker stops at the first.
+static void stopStartedWorkers(Pipeline *pipeline, int nConvertStarted, bool filterStarted)
+{
+    for (int i = 0; i < nConvertStarted; i++)
+        pushFrame(&pipeline->convertQueues[i], &pipeline->sentinels[i]);
+    for (int i = 0; i < nConvertStarted; i++)
+        pthread_join(pipeline->convertThreads[i], NULL);
+    if (filterStarted)
+        pthread_join(pipeline->filterThread, NULL);
+
+    return;
+}
+
+int initPipeline(Pipeline *pipeline, VideoState *video, AudioState *audio, int depth, int nConvertThreads)
+{
+    if (pipeline == NULL || video == NULL || audio == NULL || depth < 1 || nConvertThreads < 1)
+        return VIDEO_ARG;
+
+    int status = VIDEO_OK;
+
+    memset(pipeline, 0, sizeof *pipeline);
+    pipeline->video = video;
+    pipeline->audio = audio;
+    pipeline->depth = depth;
+    pipeline->nConvertThreads = nConvertThreads;
+    if (pipeline->nConvertThreads > PIPELINE_MAX_THREADS)
+        pipeline->nConvertThreads = PIPELINE_MAX_THREADS;
+    pipeline->moreAudio = true;
+
+    pipeline->frames = calloc(depth, sizeof *pipeline->frames);
+    if (pipeline->frames == NULL)
+        return VIDEO_MEMORY;
+
+    pipeline->staticFrame = av_frame_alloc();
+    if (pipeline->staticFrame == NULL)
+        return VIDEO_MEMORY;
+
+    status = initFrameQueue(&pipeline->freeQueue, depth);
+    if (status != VIDEO_OK)
+        return status;
+    status = initFrameQueue(&pipeline->encodeQueue, depth + 1);
+    if (status != VIDEO_OK)
+        return status;
+    for (int i = 0; i < pipeline->nConvertThreads; i++)
+    {
+        status = initFrameQueue(&pipeline->convertQueues[i], depth + 1);
+        if (status != VIDEO_OK)
+            return status;
+        status = initFrameQueue(&pipeline->filterQueues[i], depth + 1);
+        if (status != VIDEO_OK)
+            return status;
+        // swscale contexts are not thread safe, give each worker its own
+        pipeline->conversionContexts[i] = sws_getContext(video->frameWidth, video->frameHeight, AV_PIX_FMT_RGBA, video->frameWidth, video->frameHeight, AV_PIX_FMT_YUV420P, 0, NULL, NULL, NULL);
+        if (pipeline->conversionContexts[i] == NULL)
+            return VIDEO_MEMORY;
+        pipeline->sentinels[i].last = true;
+        pipeline->workers[i].pipeline = pipeline;
+        pipeline->workers[i].index = i;
+    }
+
+    PipelineFrame *f = NULL;
+    for (int i = 0; i < depth; i++)
+    {
+        f = &pipeline->frames[i];
+        f->rgba = malloc(video->frameWidth * video->frameHeight * sizeof *f->rgba);
+        f->frame = av_frame_alloc();
+        f->filtered = av_frame_alloc();
+        if (f->rgba == NULL || f->frame == NULL || f->filtered == NULL)
+            return VIDEO_MEMORY;
+        if (video->sparseTiles && initTileMask(&f->tiles, video->frameWidth, video->frameHeight) != TILES_OK)
+            return VIDEO_MEMORY;
+        f->frame->format = video->videoCodecContext->pix_fmt;
+        f->frame->width = video->videoCodecContext->width;
+        f->frame->height = video->videoCodecContext->height;
+        status = av_frame_get_buffer(f->frame, 0);
+        if (status < 0)
+        {
+            fprintf(stderr, "Problem getting pipeline frame buffer.\n");
+            return status;
+        }
+        tryPushFrame(&pipeline->freeQueue, f);
+    }
+
+    int nConvertStarted = 0;
+    for (; nConvertStarted < pipeline->nConvertThreads; nConvertStarted++)
+    {
+        if (pthread_create(&pipeline->convertThreads[nConvertStarted], NULL, convertWorker, &pipeline->workers[nConvertStarted]) != 0)
+        {
+            stopStartedWorkers(pipeline, nConvertStarted, false);
+            return VIDEO_MEMORY;
+        }
+    }
+    if (pthread_create(&pipeline->filterThread, NULL, filterWorker, pipeline) != 0)
+    {
+        stopStartedWorkers(pipeline, nConvertStarted, false);
+        return VIDEO_MEMORY;
+    }
+    if (pthread_create(&pipeline->encodeThread, NULL, encodeWorker, pipeline) != 0)
+    {
+        stopStartedWorkers(pipeline, nConvertStarted, true);
+        return VIDEO_MEMORY;
+    }
+    pipeline->threadsStarted = true;
+
+    return VIDEO_OK;
+}
+
+// keep: the frame is bare background, and may be repeated by pipelineRepeatFrame()
+int pipelineSubmitFrame(Pipeline *pipeline, int64_t frameNumber, double videoTime, bool keep)
+{
+    if (pipeline == NULL)
+        return VIDEO_ARG;
+
+    double t0 = pipelineClock();
+    if (pipeline->lastSubmitTime > 0.0)
+        pipeline->stageTime[PIPELINE_RENDER] += t0 - pipeline->lastSubmitTime;
+
+    int status = pipelineStatus(pipeline);
+    if (status != VIDEO_OK)
+        return status;
+
+    // Blocks while every slot is downstream
+    PipelineFrame *f = popFrame(&pipeline->freeQueue);
+
+    double t1 = pipelineClock();
+    readFrame(pipeline->video, f->rgba);
+    if (pipeline->video->sparseTiles)
+        copyTileMask(&f->tiles, &pipeline->video->tiles);
+    // Frames rendered in YUV have no RGBA to read back, their planes travel instead
+    if (pipeline->video->yuvRenderTarget)
+    {
+        if (av_frame_make_writable(f->frame) < 0)
+        {
+            setPipelineStatus(pipeline, VIDEO_MEMORY);
+            pushFrame(&pipeline->freeQueue, f);
+            return VIDEO_MEMORY;
+        }
+        av_frame_copy(f->frame, pipeline->video->videoFrame);
+    }
+    f->frameNumber = frameNumber;
+    f->videoTime = videoTime;
+    f->last = false;
+    f->repeat = false;
+    f->keep = keep;
+    f->drop = false;
+    pushFrame(&pipeline->convertQueues[pipeline->submittedFrames % pipeline->nConvertThreads], f);
+    pipeline->submittedFrames++;
+
+    pipeline->lastSubmitTime = pipelineClock();
+    pipeline->stageTime[PIPELINE_READBACK] += pipeline->lastSubmitTime - t1;
+
+    return VIDEO_OK;
+}
+
+// The last kept frame again. The slot only carries the frame number, in order, to the encoder.
+// A dropped repeat is not encoded, but still moves the audio along.
+int pipelineRepeatFrame(Pipeline *pipeline, int64_t frameNumber, double videoTime, bool drop)
+{
+    if (pipeline == NULL)
+        return VIDEO_ARG;
+
+    double t0 = pipelineClock();
+    if (pipeline->lastSubmitTime > 0.0)
+        pipeline->stageTime[PIPELINE_RENDER] += t0 - pipeline->lastSubmitTime;
+
+    int status = pipelineStatus(pipeline);
+    if (status != VIDEO_OK)
+        return status;
+
+    PipelineFrame *f = popFrame(&pipeline->freeQueue);
+    f->frameNumber = frameNumber;
+    f->videoTime = videoTime;
+    f->last = false;
+    f->repeat = true;
+    f->keep = false;
+    f->drop = drop;
+    pushFrame(&pipeline->convertQueues[pipeline->submittedFrames % pipeline->nConvertThreads], f);
+    pipeline->submittedFrames++;
+
+    pipeline->lastSubmitTime = pipelineClock();
+
+    return VIDEO_OK;
+}
+
+int finishPipeline(Pipeline *pipeline)
+{
+    if (pipeline == NULL)
+        return VIDEO_ARG;
+
+    if (!pipeline->threadsStarted)
+        return pipeline->status;
+
+    // One end marker per worker, continuing the round-robin order
+    for (int i = 0; i < pipeline->nConvertThreads; i++)
+        pushFrame(&pipeline->convertQueues[(pipeline->submittedFrames + i) % pipeline->nConvertThreads], &pipeline->sentinels[i]);
+
+    for (int i = 0; i < pipeline->nConvertThreads; i++)
+        pthread_join(pipeline->convertThreads[i], NULL);
+    pthread_join(pipeline->filterThread, NULL);
+    pthread_join(pipeline->encodeThread, NULL);
+    pipeline->threadsStarted = false;
+
+    for (int i = 0; i < pipeline->nConvertThreads; i++)
+        pipeline->stageTime[PIPELINE_CONVERT] += pipeline->convertTime[i];
+
+    if (pipeline->video->verbose && pipeline->submittedFrames > 0)
+    {
+        const char *names[PIPELINE_STAGES] = {"render", "readback", "convert", "filter", "encode"};
+        fprintf(stdout, "\nPipeline busy time per frame (depth %d, %d convert thread%s):\n", pipeline->depth, pipeline->nConvertThreads, pipeline->nConvertThreads == 1 ? "" : "s");
+        for (int s = 0; s < PIPELINE_STAGES; s++)
+            fprintf(stdout, "%12s: %7.2lf ms%s\n", names[s], 1000.0 * pipeline->stageTime[s] / (double)pipeline->submittedFrames, s == PIPELINE_CONVERT && pipeline->nConvertThreads > 1 ? " (summed over threads)" : "");
+    }
+
+    return pipeline->status;
+}
+
+void cleanupPipeline(Pipeline *pipeline)
+{
+    if (pipeline == NULL)
+        return;
+
+    if (pipeline->frames != NULL)
+    {
+        for (int i = 0; i < pipeline->depth; i++)
+        {
+            free(pipeline->frames[i].rgba);
+            freeTileMask(&pipeline->frames[i].tiles);
+            av_frame_free(&pipeline->frames[i].frame);
+            av_frame_free(&pipeline->frames[i].filtered);
+        }
+        free(pipeline->frames);
+        pipeline->frames = NULL;
+    }
+    av_frame_free(&pipeline->staticFrame);
+
+    for (int i = 0; i < pipeline->nConvertThreads; i++)
+    {
+        sws_freeContext(pipeline->conversionContexts[i]);
+        pipeline->conversionContexts[i] = NULL;
+        free(pipeline->convertQueues[i].slots);
+        free(pipeline->filterQueues[i].slots);
+    }
+    free(pipeline->freeQueue.slots);
+    free(pipeline->encodeQueue.slots);
+
+    return;
+}
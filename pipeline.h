@@ -0,0 +1,127 @@
+/*
+
+    flow: pipeline.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include "video.h"
+#include "audio.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define DEFAULT_PIPELINE_DEPTH 0 // 0: render, convert, filter and encode on one thread
+#define DEFAULT_PIPELINE_THREADS 1
+#define PIPELINE_MAX_THREADS 64
+
+enum PipelineStage
+{
+    PIPELINE_RENDER = 0,
+    PIPELINE_READBACK,
+    PIPELINE_CONVERT,
+    PIPELINE_FILTER,
+    PIPELINE_ENCODE,
+    PIPELINE_STAGES
+};
+
+// A pooled frame travelling through the pipeline
+typedef struct PipelineFrame
+{
+    uint32_t *rgba;
+    TileMask tiles; // copied from the renderer with the frame
+    AVFrame *frame;
+    AVFrame *filtered;
+    bool haveFiltered;
+    int64_t frameNumber;
+    double videoTime;
+    bool last;
+    bool repeat; // Encode the kept static frame again, nothing to convert or filter
+    bool keep; // Bare background, keep for repeats
+    bool drop; // Repeat that is not encoded, for variable frame rate output
+} PipelineFrame;
+
+// Bounded single-producer single-consumer ring, lock-free
+typedef struct FrameQueue
+{
+    PipelineFrame **slots;
+    uint64_t capacity;
+    uint64_t head; // Next slot to read, owned by the consumer
+    uint64_t tail; // Next slot to write, owned by the producer
+} FrameQueue;
+
+struct Pipeline;
+
+typedef struct PipelineWorker
+{
+    struct Pipeline *pipeline;
+    int index;
+} PipelineWorker;
+
+typedef struct Pipeline
+{
+    VideoState *video;
+    AudioState *audio;
+
+    int depth;
+    int nConvertThreads;
+
+    PipelineFrame *frames;
+    PipelineFrame sentinels[PIPELINE_MAX_THREADS];
+
+    FrameQueue freeQueue;
+    FrameQueue convertQueues[PIPELINE_MAX_THREADS];
+    FrameQueue filterQueues[PIPELINE_MAX_THREADS];
+    FrameQueue encodeQueue;
+
+    struct SwsContext *conversionContexts[PIPELINE_MAX_THREADS];
+
+    // Last static frame encoded, owned by the encode thread
+    AVFrame *staticFrame;
+    bool haveStaticFrame;
+
+    PipelineWorker workers[PIPELINE_MAX_THREADS];
+    pthread_t convertThreads[PIPELINE_MAX_THREADS];
+    pthread_t filterThread;
+    pthread_t encodeThread;
+    bool threadsStarted;
+
+    int64_t submittedFrames;
+    double elapsedAudioTime;
+    bool moreAudio;
+    int status;
+
+    // Busy time per stage (s). Each thread accumulates its own.
+    double stageTime[PIPELINE_STAGES];
+    double convertTime[PIPELINE_MAX_THREADS];
+    double lastSubmitTime;
+
+} Pipeline;
+
+int initPipeline(Pipeline *pipeline, VideoState *video, AudioState *audio, int depth, int nConvertThreads);
+
+int pipelineSubmitFrame(Pipeline *pipeline, int64_t frameNumber, double videoTime, bool keep);
+int pipelineRepeatFrame(Pipeline *pipeline, int64_t frameNumber, double videoTime, bool drop);
+
+int finishPipeline(Pipeline *pipeline);
+
+void cleanupPipeline(Pipeline *pipeline);
+
+#endif // _PIPELINE_H
@@ -0,0 +1,1206 @@
+/*
+
+    flow: postprocess.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "postprocess.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+
+typedef struct PostProcessTask
+{
+    PostProcess *post;
+    uint8_t *plane;
+    int linesize;
+    int width;
+    int height;
+    int radius;
+    int passes;
+    uint8_t *const *planes;
+    const int *linesizes;
+    int level;
+    const TileMask *tiles; // NULL: the whole plane
+    int tileSize; // in plane pixels
+} PostProcessTask;
+
+static int rowJobs(int height)
+{
+    return (height + POSTPROCESS_ROWS_PER_JOB - 1) / POSTPROCESS_ROWS_PER_JOB;
+}
+
+static int columnJobs(int width)
+{
+    return (width + POSTPROCESS_COLUMNS_PER_JOB - 1) / POSTPROCESS_COLUMNS_PER_JOB;
+}
+
+// Running-sum box blur of one line with the mirrored edges and 16-bit
+// fixed point of libavfilter's boxblur, so the output matches it
+static void blurLine(uint8_t *dst, const uint8_t *src, int len, int radius)
+{
+    const int length = 2 * radius + 1;
+    const int inv = ((1 << 16) + length / 2) / length;
+    int sum = src[radius];
+    int x = 0;
+
+    for (x = 0; x < radius; x++)
+        sum += src[x] << 1;
+    sum = sum * inv + (1 << 15);
+
+    for (x = 0; x <= radius; x++)
+    {
+        sum += (src[radius + x] - src[radius - x]) * inv;
+        dst[x] = sum >> 16;
+    }
+    for (; x < len - radius; x++)
+    {
+        sum += (src[radius + x] - src[x - radius - 1]) * inv;
+        dst[x] = sum >> 16;
+    }
+    for (; x < len; x++)
+    {
+        sum += (src[2 * len - radius - x - 1] - src[x - radius - 1]) * inv;
+        dst[x] = sum >> 16;
+    }
+
+    return;
+}
+
+// blurLine() down columns x0 to x1 - 1, a row at a time so the inner loops vectorize
+static void blurColumns(uint8_t *dst, int dstLinesize, const uint8_t *src, int srcLinesize, int x0, int x1, int len, int radius, int32_t *sum)
+{
+    const int length = 2 * radius + 1;
+    const int32_t inv = ((1 << 16) + length / 2) / length;
+    const uint8_t *a = NULL;
+    const uint8_t *b = NULL;
+    uint8_t *d = NULL;
+    int y = 0;
+
+#define SRC_ROW(row) (src + (ptrdiff_t)(row) * srcLinesize)
+#define DST_ROW(row) (dst + (ptrdiff_t)(row) * dstLinesize)
+#define UPDATE_ROW(ra, rb, rd) \
+    a = SRC_ROW(ra); \
+    b = SRC_ROW(rb); \
+    d = DST_ROW(rd); \
+    for (int x = x0; x < x1; x++) \
+    { \
+        sum[x] += (a[x] - b[x]) * inv; \
+        d[x] = sum[x] >> 16; \
+    }
+
+    a = SRC_ROW(radius);
+    for (int x = x0; x < x1; x++)
+        sum[x] = a[x];
+    for (y = 0; y < radius; y++)
+    {
+        a = SRC_ROW(y);
+        for (int x = x0; x < x1; x++)
+            sum[x] += a[x] << 1;
+    }
+    for (int x = x0; x < x1; x++)
+        sum[x] = sum[x] * inv + (1 << 15);
+
+    for (y = 0; y <= radius; y++)
+    {
+        UPDATE_ROW(radius + y, radius - y, y)
+    }
+    for (; y < len - radius; y++)
+    {
+        UPDATE_ROW(radius + y, y - radius - 1, y)
+    }
+    for (; y < len; y++)
+    {
+        UPDATE_ROW(2 * len - radius - y - 1, y - radius - 1, y)
+    }
+
+#undef UPDATE_ROW
+#undef DST_ROW
+#undef SRC_ROW
+
+    return;
+}
+
+static void blurRowsJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+
+    int rowStart = index * POSTPROCESS_ROWS_PER_JOB;
+    int rowEnd = rowStart + POSTPROCESS_ROWS_PER_JOB;
+    if (rowEnd > task->height)
+        rowEnd = task->height;
+    uint8_t *lines[2] = {post->lines + (size_t)index * 2 * post->width, post->lines + ((size_t)index * 2 + 1) * post->width};
+    uint8_t *row = NULL;
+    const uint8_t *src = NULL;
+
+    for (int y = rowStart; y < rowEnd; y++)
+    {
+        row = task->plane + (ptrdiff_t)y * task->linesize;
+        src = row;
+        for (int p = 0; p < task->passes; p++)
+        {
+            blurLine(lines[p & 1], src, task->width, task->radius);
+            src = lines[p & 1];
+        }
+        memcpy(row, src, task->width);
+    }
+
+    return;
+}
+
+static void blurColumnsJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+
+    int x0 = index * POSTPROCESS_COLUMNS_PER_JOB;
+    int x1 = x0 + POSTPROCESS_COLUMNS_PER_JOB;
+    if (x1 > task->width)
+        x1 = task->width;
+
+    // Passes alternate between the plane and the scratch plane
+    uint8_t *buffers[2] = {task->plane, post->scratch};
+    int linesizes[2] = {task->linesize, post->width};
+    for (int p = 0; p < task->passes; p++)
+        blurColumns(buffers[(p + 1) & 1], linesizes[(p + 1) & 1], buffers[p & 1], linesizes[p & 1], x0, x1, task->height, task->radius, post->sums);
+
+    if (task->passes & 1)
+        for (int y = 0; y < task->height; y++)
+            memcpy(task->plane + (ptrdiff_t)y * task->linesize + x0, post->scratch + (ptrdiff_t)y * post->width + x0, x1 - x0);
+
+    return;
+}
+
+// Mirrored edges need the whole window inside the plane
+static int planeRadius(const PostProcess *post, int width, int height)
+{
+    int radius = post->options.blurRadius;
+    if (2 * radius >= width)
+        radius = (width - 1) / 2;
+    if (2 * radius >= height)
+        radius = (height - 1) / 2;
+
+    return radius;
+}
+
+// Row i of a blurred line, reflected about the half sample beyond each end as in blurLine()
+static inline int reflectRow(int i, int len)
+{
+    return i < 0 ? -i - 1 : (i >= len ? 2 * len - i - 1 : i);
+}
+
+// Rows y0 to y1 - 1 of a vertical blurLine() pass over a band. Row y of the
+// plane (len rows) is row y - first of src, and row y - dstFirst of dst.
+static void blurBandColumns(uint8_t *dst, int dstStride, int dstFirst, const uint8_t *src, int stride, int first, int width, int len, int y0, int y1, int radius, int32_t *sum)
+{
+    const int length = 2 * radius + 1;
+    const int32_t inv = ((1 << 16) + length / 2) / length;
+    const uint8_t *a = NULL;
+    const uint8_t *b = NULL;
+    uint8_t *d = NULL;
+
+#define BAND_ROW(buffer, row) ((buffer) + (ptrdiff_t)((row) - first) * stride)
+
+    // The running sum of blurLine() is the rounding term plus inv times the window
+    for (int x = 0; x < width; x++)
+        sum[x] = 1 << 15;
+    for (int k = -radius; k <= radius; k++)
+    {
+        a = BAND_ROW(src, reflectRow(y0 + k, len));
+        for (int x = 0; x < width; x++)
+            sum[x] += a[x] * inv;
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        d = dst + (ptrdiff_t)(y - dstFirst) * dstStride;
+        for (int x = 0; x < width; x++)
+            d[x] = sum[x] >> 16;
+        if (y + 1 == y1)
+            break;
+        a = BAND_ROW(src, reflectRow(y + radius + 1, len));
+        b = BAND_ROW(src, reflectRow(y - radius, len));
+        for (int x = 0; x < width; x++)
+            sum[x] += (a[x] - b[x]) * inv;
+    }
+
+#undef BAND_ROW
+
+    return;
+}
+
+// blurLine() output for x0 <= x < x1 only
+static void blurSpan(uint8_t *dst, const uint8_t *src, int len, int radius, int x0, int x1)
+{
+    const int length = 2 * radius + 1;
+    const int inv = ((1 << 16) + length / 2) / length;
+    int sum = 1 << 15;
+
+    for (int k = -radius; k <= radius; k++)
+        sum += src[reflectRow(x0 + k, len)] * inv;
+    for (int x = x0; x < x1; x++)
+    {
+        dst[x] = sum >> 16;
+        sum += (src[reflectRow(x + radius + 1, len)] - src[reflectRow(x - radius, len)]) * inv;
+    }
+
+    return;
+}
+
+// Next run of dirty tiles from tile *i on, along tile row line (down tile column line when
+// vertical), in plane pixels. Runs less than gap pixels apart are joined, so no run reads
+// pixels another has already blurred.
+static bool dirtySpan(const TileMask *tiles, int line, bool vertical, int *i, int tileSize, int gap, int length, int *start, int *end)
+{
+    int n = vertical ? tiles->rows : tiles->columns;
+    int k = *i;
+    int runEnd = 0;
+
+#define DIRTY(t) (vertical ? tileDirty(tiles, line, t) : tileDirty(tiles, t, line))
+    while (k < n && !DIRTY(k))
+        k++;
+    if (k >= n)
+        return false;
+    *start = k * tileSize;
+    for (;;)
+    {
+        while (k < n && DIRTY(k))
+            k++;
+        runEnd = k;
+        while (k < n && !DIRTY(k))
+            k++;
+        if (k >= n || (k - runEnd) * tileSize > gap)
+            break;
+    }
+#undef DIRTY
+
+    *i = runEnd;
+    *end = runEnd * tileSize < length ? runEnd * tileSize : length;
+
+    return true;
+}
+
+// Clean tiles are uniform out to the blur's reach, so only dirty spans change.
+// Each pass covers the span and what later passes read of it.
+static void blurRowsTilesJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+
+    int rowStart = index * POSTPROCESS_ROWS_PER_JOB;
+    int rowEnd = rowStart + POSTPROCESS_ROWS_PER_JOB;
+    if (rowEnd > task->height)
+        rowEnd = task->height;
+    uint8_t *lines[2] = {post->lines + (size_t)index * 2 * post->width, post->lines + ((size_t)index * 2 + 1) * post->width};
+    int halo = task->passes * task->radius;
+    uint8_t *row = NULL;
+    const uint8_t *src = NULL;
+    int x0 = 0;
+    int x1 = 0;
+    int ext = 0;
+
+    for (int y = rowStart; y < rowEnd; y++)
+    {
+        row = task->plane + (ptrdiff_t)y * task->linesize;
+        for (int i = 0; dirtySpan(task->tiles, y / task->tileSize, false, &i, task->tileSize, halo, task->width, &x0, &x1);)
+        {
+            src = row;
+            for (int p = 0; p < task->passes; p++)
+            {
+                ext = (task->passes - 1 - p) * task->radius;
+                blurSpan(lines[p & 1], src, task->width, task->radius, x0 - ext > 0 ? x0 - ext : 0, x1 + ext < task->width ? x1 + ext : task->width);
+                src = lines[p & 1];
+            }
+            memcpy(row + x0, src + x0, x1 - x0);
+        }
+    }
+
+    return;
+}
+
+// One column of tiles. Passes go through the two scratch planes, the last back to the plane.
+static void blurColumnsTilesJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+
+    int x0 = index * task->tileSize;
+    int x1 = x0 + task->tileSize < task->width ? x0 + task->tileSize : task->width;
+    uint8_t *scratch[2] = {post->scratch, post->tileScratch};
+    int halo = task->passes * task->radius;
+    uint8_t *src = NULL;
+    uint8_t *dst = NULL;
+    int srcLinesize = 0;
+    int dstLinesize = 0;
+    int y0 = 0;
+    int y1 = 0;
+    int ext = 0;
+    int lo = 0;
+    int hi = 0;
+
+    if (x0 >= x1)
+        return;
+
+    for (int i = 0; dirtySpan(task->tiles, index, true, &i, task->tileSize, halo, task->height, &y0, &y1);)
+    {
+        for (int p = 0; p < task->passes; p++)
+        {
+            src = p == 0 ? task->plane : scratch[(p - 1) & 1];
+            srcLinesize = p == 0 ? task->linesize : post->width;
+            dst = p == task->passes - 1 && p > 0 ? task->plane : scratch[p & 1];
+            dstLinesize = dst == task->plane ? task->linesize : post->width;
+            ext = (task->passes - 1 - p) * task->radius;
+            lo = y0 - ext > 0 ? y0 - ext : 0;
+            hi = y1 + ext < task->height ? y1 + ext : task->height;
+            blurBandColumns(dst + x0, dstLinesize, 0, src + x0, srcLinesize, 0, x1 - x0, task->height, lo, hi, task->radius, post->sums + x0);
+        }
+        if (task->passes == 1)
+            for (int y = y0; y < y1; y++)
+                memcpy(task->plane + (ptrdiff_t)y * task->linesize + x0, post->scratch + (ptrdiff_t)y * post->width + x0, x1 - x0);
+    }
+
+    return;
+}
+
+// tileSize: TILE_SIZE in the pixels of this plane
+static void blurPlane(PostProcess *post, uint8_t *plane, int linesize, int width, int height, const TileMask *tiles, int tileSize)
+{
+    PostProcessTask task = {0};
+    task.post = post;
+    task.plane = plane;
+    task.linesize = linesize;
+    task.width = width;
+    task.height = height;
+    task.passes = post->options.blurPasses;
+    task.radius = planeRadius(post, width, height);
+    task.tiles = tiles;
+    task.tileSize = tileSize;
+    if (task.radius < 1)
+        return;
+
+    if (tiles != NULL && post->tileScratch != NULL)
+    {
+        runWorkers(post->pool, blurRowsTilesJob, &task, rowJobs(height));
+        runWorkers(post->pool, blurColumnsTilesJob, &task, tiles->columns);
+        return;
+    }
+
+    runWorkers(post->pool, blurRowsJob, &task, rowJobs(height));
+    runWorkers(post->pool, blurColumnsJob, &task, columnJobs(width));
+
+    return;
+}
+
+typedef struct FusedTask
+{
+    PostProcess *post;
+    uint8_t *const *planes;
+    const int *linesize;
+    const uint8_t *rgba;
+    Rgb2YuvRows kernel;
+    const TileMask *tiles;
+} FusedTask;
+
+// Band buffers are shared by the jobs running at the same time
+static int takeBand(PostProcess *post)
+{
+    pthread_mutex_lock(&post->bandLock);
+    while (post->nFreeBands == 0)
+        pthread_cond_wait(&post->bandFreed, &post->bandLock);
+    int band = post->freeBands[--post->nFreeBands];
+    pthread_mutex_unlock(&post->bandLock);
+
+    return band;
+}
+
+static void releaseBand(PostProcess *post, int band)
+{
+    pthread_mutex_lock(&post->bandLock);
+    post->freeBands[post->nFreeBands++] = band;
+    pthread_cond_signal(&post->bandFreed);
+    pthread_mutex_unlock(&post->bandLock);
+
+    return;
+}
+
+// Horizontal then vertical passes over rows lo to hi - 1 of one plane of a band,
+// result in rows out0 to out1 - 1 of the plane
+static void blurBandPlane(PostProcess *post, uint8_t *buffers[2], int stride, int first, int width, int len, int lo, int hi, int out0, int out1, uint8_t *plane, int linesize, uint8_t *lines[2], int32_t *sums)
+{
+    int passes = post->options.blurPasses;
+    int radius = planeRadius(post, width, len);
+    uint8_t *row = NULL;
+    const uint8_t *src = NULL;
+    int current = 0;
+
+    if (radius >= 1)
+    {
+        for (int y = lo; y < hi; y++)
+        {
+            row = buffers[0] + (ptrdiff_t)(y - first) * stride;
+            src = row;
+            for (int p = 0; p < passes; p++)
+            {
+                blurLine(lines[p & 1], src, width, radius);
+                src = lines[p & 1];
+            }
+            memcpy(row, src, width);
+        }
+
+        // Each pass is needed on fewer rows, down to the band itself, which the last pass writes out
+        for (int p = 1; p < passes; p++)
+        {
+            int y0 = out0 - (passes - p) * radius;
+            int y1 = out1 + (passes - p) * radius;
+            blurBandColumns(buffers[current ^ 1], stride, first, buffers[current], stride, first, width, len, y0 > 0 ? y0 : 0, y1 < len ? y1 : len, radius, sums);
+            current ^= 1;
+        }
+        blurBandColumns(plane, linesize, 0, buffers[current], stride, first, width, len, out0, out1, radius, sums);
+        return;
+    }
+
+    for (int y = out0; y < out1; y++)
+        memcpy(plane + (ptrdiff_t)y * linesize, buffers[current] + (ptrdiff_t)(y - first) * stride, width);
+
+    return;
+}
+
+static void fusedJob(void *arg, int index)
+{
+    FusedTask *task = (FusedTask *)arg;
+    PostProcess *post = task->post;
+    int w = post->width;
+    int h = post->height;
+    int cw = (w + 1) / 2;
+    int ch = (h + 1) / 2;
+    int passes = post->options.blurPasses;
+    int haloY = passes * planeRadius(post, w, h);
+    int haloC = passes * planeRadius(post, cw, ch);
+
+    int r0 = index * POSTPROCESS_BAND_ROWS;
+    int r1 = r0 + POSTPROCESS_BAND_ROWS < h ? r0 + POSTPROCESS_BAND_ROWS : h;
+    int c0 = r0 / 2;
+    int c1 = (r1 + 1) / 2;
+    int loY = r0 - haloY > 0 ? r0 - haloY : 0;
+    int hiY = r1 + haloY < h ? r1 + haloY : h;
+    int loC = c0 - haloC > 0 ? c0 - haloC : 0;
+    int hiC = c1 + haloC < ch ? c1 + haloC : ch;
+    int convLo = (loY < 2 * loC ? loY : 2 * loC) & ~1;
+    int convHi = hiY > 2 * hiC ? hiY : (2 * hiC < h ? 2 * hiC : h);
+
+    // A band of clean tiles, halo included, blurs to the background
+    if (task->tiles != NULL)
+    {
+        bool dirty = false;
+        for (int row = r0 / TILE_SIZE; row <= (r1 - 1) / TILE_SIZE && !dirty; row++)
+            for (int column = 0; column < task->tiles->columns && !dirty; column++)
+                dirty = tileDirty(task->tiles, column, row);
+        if (!dirty)
+        {
+            fillYuvBackground(task->planes, task->linesize, task->tiles->background, w, h, 0, w, r0, r1);
+            return;
+        }
+    }
+
+    int band = takeBand(post);
+    uint8_t *p = post->bands + (size_t)band * post->bandSize;
+    int rows = post->bandRows;
+    int chromaRows = rows / 2 + 1;
+    uint8_t *luma[2] = {p, p + (size_t)rows * w};
+    p += (size_t)2 * rows * w;
+    uint8_t *u[2] = {p, p + (size_t)chromaRows * cw};
+    p += (size_t)2 * chromaRows * cw;
+    uint8_t *v[2] = {p, p + (size_t)chromaRows * cw};
+    p += (size_t)2 * chromaRows * cw;
+    uint8_t *lines[2] = {p, p + w};
+    p += (size_t)2 * w;
+    int32_t *sums = (int32_t *)(void *)(((uintptr_t)p + 63) & ~(uintptr_t)63);
+
+    uint8_t *const destination[3] = {luma[0], u[0], v[0]};
+    const int destinationLinesize[3] = {w, cw, cw};
+    task->kernel(destination, destinationLinesize, task->rgba + (size_t)convLo * 4 * w, 4 * w, w, h - convLo, 0, convHi - convLo);
+
+    blurBandPlane(post, luma, w, convLo, w, h, loY, hiY, r0, r1, task->planes[0], task->linesize[0], lines, sums);
+    blurBandPlane(post, u, cw, convLo / 2, cw, ch, loC, hiC, c0, c1, task->planes[1], task->linesize[1], lines, sums);
+    blurBandPlane(post, v, cw, convLo / 2, cw, ch, loC, hiC, c0, c1, task->planes[2], task->linesize[2], lines, sums);
+
+    releaseBand(post, band);
+
+    return;
+}
+
+void postProcessRgba(PostProcess *post, uint8_t *const planes[], const int linesize[], const uint8_t *rgba, const TileMask *tiles)
+{
+    if (post == NULL || planes == NULL || linesize == NULL || rgba == NULL)
+        return;
+
+    FusedTask task = {0};
+    task.post = post;
+    task.planes = planes;
+    task.linesize = linesize;
+    task.rgba = rgba;
+    task.kernel = rgb2YuvRowsKernel();
+    task.tiles = tiles;
+
+    if (post->bands == NULL)
+    {
+        // No blur, conversion only
+        rgba2Yuv420pTiles(planes, linesize, rgba, post->width, post->height, tiles, post->pool);
+        return;
+    }
+
+    runWorkers(post->pool, fusedJob, &task, (post->height + POSTPROCESS_BAND_ROWS - 1) / POSTPROCESS_BAND_ROWS);
+
+    return;
+}
+
+// Box blur of a float image with edges repeated, along rows (step 1) or columns (step width)
+static void blurLineFloat(float *dst, const float *src, ptrdiff_t step, int len, int radius)
+{
+    const float scale = 1.0f / (float)(2 * radius + 1);
+    float sum = 0.0f;
+    int i = 0;
+
+    for (int k = -radius; k <= radius; k++)
+    {
+        i = k < 0 ? 0 : (k < len ? k : len - 1);
+        sum += src[i * step];
+    }
+    for (int x = 0; x < len; x++)
+    {
+        dst[x * step] = sum * scale;
+        i = x + radius + 1 < len ? x + radius + 1 : len - 1;
+        sum += src[i * step];
+        i = x - radius > 0 ? x - radius : 0;
+        sum -= src[i * step];
+    }
+
+    return;
+}
+
+static void bloomBlurRowsJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+    int w = post->bloomWidth[task->level];
+    int h = post->bloomHeight[task->level];
+    float *level = post->bloom[task->level];
+
+    int rowStart = index * POSTPROCESS_ROWS_PER_JOB;
+    int rowEnd = rowStart + POSTPROCESS_ROWS_PER_JOB;
+    if (rowEnd > h)
+        rowEnd = h;
+    for (int y = rowStart; y < rowEnd; y++)
+        blurLineFloat(post->bloomScratch + (size_t)y * w, level + (size_t)y * w, 1, w, POSTPROCESS_BLOOM_RADIUS);
+
+    return;
+}
+
+static void bloomBlurColumnsJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+    int w = post->bloomWidth[task->level];
+    int h = post->bloomHeight[task->level];
+    float *level = post->bloom[task->level];
+
+    int x0 = index * POSTPROCESS_COLUMNS_PER_JOB;
+    int x1 = x0 + POSTPROCESS_COLUMNS_PER_JOB;
+    if (x1 > w)
+        x1 = w;
+    for (int x = x0; x < x1; x++)
+        blurLineFloat(level + x, post->bloomScratch + x, w, h, POSTPROCESS_BLOOM_RADIUS);
+
+    return;
+}
+
+// Level 0: how far each 2x2 luma block is above the threshold
+static void bloomBrightJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+    int w = post->bloomWidth[0];
+    int h = post->bloomHeight[0];
+    float threshold = (float)post->options.bloomThreshold;
+    const uint8_t *row0 = NULL;
+    const uint8_t *row1 = NULL;
+    float *out = NULL;
+    int x1 = 0;
+    float mean = 0.0f;
+
+    int rowStart = index * POSTPROCESS_ROWS_PER_JOB;
+    int rowEnd = rowStart + POSTPROCESS_ROWS_PER_JOB;
+    if (rowEnd > h)
+        rowEnd = h;
+    for (int y = rowStart; y < rowEnd; y++)
+    {
+        row0 = task->plane + (ptrdiff_t)(2 * y) * task->linesize;
+        row1 = 2 * y + 1 < post->height ? row0 + task->linesize : row0;
+        out = post->bloom[0] + (size_t)y * w;
+        for (int x = 0; x < w; x++)
+        {
+            x1 = 2 * x + 1 < post->width ? 2 * x + 1 : 2 * x;
+            mean = 0.25f * (float)(row0[2 * x] + row0[x1] + row1[2 * x] + row1[x1]);
+            out[x] = mean > threshold ? mean - threshold : 0.0f;
+        }
+    }
+
+    return;
+}
+
+static void bloomDownsampleJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+    int l = task->level;
+    int w = post->bloomWidth[l];
+    int h = post->bloomHeight[l];
+    int wIn = post->bloomWidth[l - 1];
+    int hIn = post->bloomHeight[l - 1];
+    const float *row0 = NULL;
+    const float *row1 = NULL;
+    float *out = NULL;
+    int x1 = 0;
+
+    int rowStart = index * POSTPROCESS_ROWS_PER_JOB;
+    int rowEnd = rowStart + POSTPROCESS_ROWS_PER_JOB;
+    if (rowEnd > h)
+        rowEnd = h;
+    for (int y = rowStart; y < rowEnd; y++)
+    {
+        row0 = post->bloom[l - 1] + (size_t)(2 * y) * wIn;
+        row1 = 2 * y + 1 < hIn ? row0 + wIn : row0;
+        out = post->bloom[l] + (size_t)y * w;
+        for (int x = 0; x < w; x++)
+        {
+            x1 = 2 * x + 1 < wIn ? 2 * x + 1 : 2 * x;
+            out[x] = 0.25f * (row0[2 * x] + row0[x1] + row1[2 * x] + row1[x1]);
+        }
+    }
+
+    return;
+}
+
+// Adds level l, at half the resolution, to level l - 1
+static void bloomUpsampleJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+    int l = task->level;
+    int w = post->bloomWidth[l];
+    int wOut = post->bloomWidth[l - 1];
+    int hOut = post->bloomHeight[l - 1];
+    const float *in = NULL;
+    float *out = NULL;
+
+    int rowStart = index * POSTPROCESS_ROWS_PER_JOB;
+    int rowEnd = rowStart + POSTPROCESS_ROWS_PER_JOB;
+    if (rowEnd > hOut)
+        rowEnd = hOut;
+    for (int y = rowStart; y < rowEnd; y++)
+    {
+        in = post->bloom[l] + (size_t)(y / 2) * w;
+        out = post->bloom[l - 1] + (size_t)y * wOut;
+        for (int x = 0; x < wOut; x++)
+            out[x] += in[x / 2];
+    }
+
+    return;
+}
+
+static void bloomCompositeJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+    float strength = (float)post->options.bloomStrength;
+    const float *glow = NULL;
+    uint8_t *row = NULL;
+    float v = 0.0f;
+
+    int rowStart = index * POSTPROCESS_ROWS_PER_JOB;
+    int rowEnd = rowStart + POSTPROCESS_ROWS_PER_JOB;
+    if (rowEnd > post->height)
+        rowEnd = post->height;
+    for (int y = rowStart; y < rowEnd; y++)
+    {
+        glow = post->bloom[0] + (size_t)(y / 2) * post->bloomWidth[0];
+        row = task->plane + (ptrdiff_t)y * task->linesize;
+        for (int x = 0; x < post->width; x++)
+        {
+            v = (float)row[x] + strength * glow[x / 2];
+            row[x] = v < 255.0f ? (uint8_t)(v + 0.5f) : 255;
+        }
+    }
+
+    return;
+}
+
+static void bloomLevel(PostProcess *post, PostProcessTask *task, WorkerJob job, int level)
+{
+    task->level = level;
+    runWorkers(post->pool, job, task, rowJobs(level < 0 ? post->height : post->bloomHeight[level]));
+
+    return;
+}
+
+// Glow from a pyramid of the bright parts of the luma plane, each level
+// blurred and added to the one above
+static void bloom(PostProcess *post, uint8_t *plane, int linesize)
+{
+    PostProcessTask task = {0};
+    task.post = post;
+    task.plane = plane;
+    task.linesize = linesize;
+
+    bloomLevel(post, &task, bloomBrightJob, 0);
+    for (int l = 1; l < post->nBloomLevels; l++)
+        bloomLevel(post, &task, bloomDownsampleJob, l);
+
+    for (int l = post->nBloomLevels - 1; l >= 0; l--)
+    {
+        // Two box passes, a tent
+        for (int p = 0; p < 2; p++)
+        {
+            bloomLevel(post, &task, bloomBlurRowsJob, l);
+            runWorkers(post->pool, bloomBlurColumnsJob, &task, columnJobs(post->bloomWidth[l]));
+        }
+        if (l > 0)
+            bloomLevel(post, &task, bloomUpsampleJob, l);
+    }
+
+    bloomLevel(post, &task, bloomCompositeJob, -1);
+
+    return;
+}
+
+// BT.601 limited range, inverse of rgb2yuv
+static void yuvToRgb(float y, float u, float v, float rgb[3])
+{
+    float c = 1.164f * (y - 16.0f);
+    float d = u - 128.0f;
+    float e = v - 128.0f;
+    rgb[0] = (c + 1.596f * e) / 255.0f;
+    rgb[1] = (c - 0.392f * d - 0.813f * e) / 255.0f;
+    rgb[2] = (c + 2.017f * d) / 255.0f;
+    for (int i = 0; i < 3; i++)
+        rgb[i] = rgb[i] < 0.0f ? 0.0f : (rgb[i] > 1.0f ? 1.0f : rgb[i]);
+
+    return;
+}
+
+static void rgbToYuv(const float rgb[3], float yuv[3])
+{
+    float r = 255.0f * rgb[0];
+    float g = 255.0f * rgb[1];
+    float b = 255.0f * rgb[2];
+    yuv[0] = 16.0f + (66.0f * r + 129.0f * g + 25.0f * b) / 256.0f;
+    yuv[1] = 128.0f + (-38.0f * r - 74.0f * g + 112.0f * b) / 256.0f;
+    yuv[2] = 128.0f + (112.0f * r - 94.0f * g - 18.0f * b) / 256.0f;
+
+    return;
+}
+
+// Trilinear interpolation in an n x n x n table of 3-vectors, first index slowest
+static void trilinear(const float *table, int n, float i, float j, float k, float out[3])
+{
+    int i0 = (int)i;
+    int j0 = (int)j;
+    int k0 = (int)k;
+    if (i0 > n - 2)
+        i0 = n - 2;
+    if (j0 > n - 2)
+        j0 = n - 2;
+    if (k0 > n - 2)
+        k0 = n - 2;
+    float fi = i - (float)i0;
+    float fj = j - (float)j0;
+    float fk = k - (float)k0;
+    const float *p = NULL;
+    float w = 0.0f;
+
+    out[0] = out[1] = out[2] = 0.0f;
+    for (int di = 0; di < 2; di++)
+        for (int dj = 0; dj < 2; dj++)
+            for (int dk = 0; dk < 2; dk++)
+            {
+                w = (di ? fi : 1.0f - fi) * (dj ? fj : 1.0f - fj) * (dk ? fk : 1.0f - fk);
+                p = table + 3 * (((size_t)(i0 + di) * n + (j0 + dj)) * n + (k0 + dk));
+                out[0] += w * p[0];
+                out[1] += w * p[1];
+                out[2] += w * p[2];
+            }
+
+    return;
+}
+
+// Adobe .cube 3D LUT, red varying fastest. Table returned blue slowest.
+static int readCubeFile(const char *filename, float **table, int *size, float domainMin[3], float domainMax[3])
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+        return POSTPROCESS_LUT_FILE;
+
+    char line[512] = {0};
+    int n = 0;
+    size_t nValues = 0;
+    size_t nRead = 0;
+    float *values = NULL;
+    float rgb[3] = {0};
+    int status = POSTPROCESS_OK;
+
+    for (int i = 0; i < 3; i++)
+    {
+        domainMin[i] = 0.0f;
+        domainMax[i] = 1.0f;
+    }
+
+    while (fgets(line, sizeof line, f) != NULL)
+    {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || strncmp("TITLE", line, 5) == 0)
+            continue;
+        else if (sscanf(line, "LUT_3D_SIZE %d", &n) == 1)
+        {
+            if (n < 2 || n > 256 || values != NULL)
+            {
+                status = POSTPROCESS_LUT_FILE;
+                break;
+            }
+            nValues = (size_t)n * n * n;
+            values = malloc(3 * nValues * sizeof *values);
+            if (values == NULL)
+            {
+                status = POSTPROCESS_MEMORY;
+                break;
+            }
+        }
+        else if (sscanf(line, "DOMAIN_MIN %f %f %f", &domainMin[0], &domainMin[1], &domainMin[2]) == 3)
+            continue;
+        else if (sscanf(line, "DOMAIN_MAX %f %f %f", &domainMax[0], &domainMax[1], &domainMax[2]) == 3)
+            continue;
+        else if (sscanf(line, "%f %f %f", &rgb[0], &rgb[1], &rgb[2]) == 3)
+        {
+            if (values == NULL || nRead == nValues)
+            {
+                status = POSTPROCESS_LUT_FILE;
+                break;
+            }
+            memcpy(values + 3 * nRead, rgb, sizeof rgb);
+            nRead++;
+        }
+        else
+        {
+            // 1D LUTs and other keywords are not supported
+            status = POSTPROCESS_LUT_FILE;
+            break;
+        }
+    }
+    fclose(f);
+
+    for (int i = 0; i < 3 && status == POSTPROCESS_OK; i++)
+        if (domainMax[i] <= domainMin[i])
+            status = POSTPROCESS_LUT_FILE;
+    if (status == POSTPROCESS_OK && (values == NULL || nRead != nValues))
+        status = POSTPROCESS_LUT_FILE;
+    if (status != POSTPROCESS_OK)
+    {
+        free(values);
+        return status;
+    }
+
+    *table = values;
+    *size = n;
+
+    return POSTPROCESS_OK;
+}
+
+// Resamples the RGB LUT onto a YUV grid, so frames are graded without leaving YUV
+static int buildYuvLut(PostProcess *post)
+{
+    float *cube = NULL;
+    int n = 0;
+    float domainMin[3] = {0};
+    float domainMax[3] = {0};
+    int status = readCubeFile(post->options.lutFilename, &cube, &n, domainMin, domainMax);
+    if (status != POSTPROCESS_OK)
+        return status;
+
+    const int g = POSTPROCESS_LUT_GRID;
+    post->lut = malloc((size_t)3 * g * g * g * sizeof *post->lut);
+    if (post->lut == NULL)
+    {
+        free(cube);
+        return POSTPROCESS_MEMORY;
+    }
+
+    float step = 255.0f / (float)(g - 1);
+    float rgb[3] = {0};
+    float graded[3] = {0};
+    float index[3] = {0};
+    for (int iy = 0; iy < g; iy++)
+        for (int iu = 0; iu < g; iu++)
+            for (int iv = 0; iv < g; iv++)
+            {
+                yuvToRgb(step * iy, step * iu, step * iv, rgb);
+                for (int c = 0; c < 3; c++)
+                {
+                    index[c] = (rgb[c] - domainMin[c]) / (domainMax[c] - domainMin[c]) * (float)(n - 1);
+                    index[c] = index[c] < 0.0f ? 0.0f : (index[c] > (float)(n - 1) ? (float)(n - 1) : index[c]);
+                }
+                trilinear(cube, n, index[2], index[1], index[0], graded);
+                for (int c = 0; c < 3; c++)
+                    graded[c] = graded[c] < 0.0f ? 0.0f : (graded[c] > 1.0f ? 1.0f : graded[c]);
+                rgbToYuv(graded, post->lut + 3 * (((size_t)iy * g + iu) * g + iv));
+            }
+    free(cube);
+
+    return POSTPROCESS_OK;
+}
+
+static inline uint8_t toByte(float v)
+{
+    return v < 0.0f ? 0 : (v > 255.0f ? 255 : (uint8_t)(v + 0.5f));
+}
+
+// Luma graded with the chroma of its block, chroma with the block's mean luma
+static void lutJob(void *arg, int index)
+{
+    PostProcessTask *task = (PostProcessTask *)arg;
+    PostProcess *post = task->post;
+    const int g = POSTPROCESS_LUT_GRID;
+    const float scale = (float)(g - 1) / 255.0f;
+    uint8_t *const *planes = task->planes;
+    const int *linesize = task->linesizes;
+    int w = post->width;
+    int h = post->height;
+    uint8_t *y0 = NULL;
+    uint8_t *y1 = NULL;
+    uint8_t *u = NULL;
+    uint8_t *v = NULL;
+    uint8_t *luma[4] = {NULL};
+    int nLuma = 0;
+    float cu = 0.0f;
+    float cv = 0.0f;
+    float mean = 0.0f;
+    float out[3] = {0};
+
+    int rowStart = index * POSTPROCESS_ROWS_PER_JOB;
+    int rowEnd = rowStart + POSTPROCESS_ROWS_PER_JOB;
+    if (rowEnd > h)
+        rowEnd = h;
+    for (int row = rowStart; row < rowEnd; row += 2)
+    {
+        y0 = planes[0] + (ptrdiff_t)row * linesize[0];
+        y1 = row + 1 < h ? y0 + linesize[0] : NULL;
+        u = planes[1] + (ptrdiff_t)(row / 2) * linesize[1];
+        v = planes[2] + (ptrdiff_t)(row / 2) * linesize[2];
+        for (int x = 0; x < w; x += 2)
+        {
+            nLuma = 0;
+            luma[nLuma++] = y0 + x;
+            if (x + 1 < w)
+                luma[nLuma++] = y0 + x + 1;
+            if (y1 != NULL)
+            {
+                luma[nLuma++] = y1 + x;
+                if (x + 1 < w)
+                    luma[nLuma++] = y1 + x + 1;
+            }
+            cu = scale * u[x / 2];
+            cv = scale * v[x / 2];
+            mean = 0.0f;
+            for (int i = 0; i < nLuma; i++)
+            {
+                mean += *luma[i];
+                trilinear(post->lut, g, scale * *luma[i], cu, cv, out);
+                *luma[i] = toByte(out[0]);
+            }
+            mean /= (float)nLuma;
+            trilinear(post->lut, g, scale * mean, cu, cv, out);
+            u[x / 2] = toByte(out[1]);
+            v[x / 2] = toByte(out[2]);
+        }
+    }
+
+    return;
+}
+
+int initPostProcess(PostProcess *post, const PostProcessOptions *options, int width, int height, WorkerPool *pool)
+{
+    if (post == NULL || options == NULL || width < 1 || height < 1)
+        return POSTPROCESS_ARG;
+
+    memset(post, 0, sizeof *post);
+    post->options = *options;
+    post->width = width;
+    post->height = height;
+    post->pool = pool;
+
+    int status = POSTPROCESS_OK;
+
+    if (options->blurPasses > 0 && options->blurRadius > 0)
+    {
+        post->scratch = malloc((size_t)width * height);
+        post->lines = malloc((size_t)rowJobs(height) * 2 * width);
+        post->sums = malloc((size_t)width * sizeof *post->sums);
+        if (post->scratch == NULL || post->lines == NULL || post->sums == NULL)
+            goto nomemory;
+        if (options->sparseTiles && !options->fusedBlur)
+        {
+            post->tileScratch = malloc((size_t)width * height);
+            if (post->tileScratch == NULL)
+                goto nomemory;
+        }
+        post->active = true;
+    }
+    else
+        post->options.blurPasses = 0;
+
+    if (post->options.fusedBlur && post->options.blurPasses > 0)
+    {
+        // Rows of a band with the halo of every pass, for luma and for chroma
+        int haloY = post->options.blurPasses * planeRadius(post, width, height);
+        int haloC = post->options.blurPasses * planeRadius(post, (width + 1) / 2, (height + 1) / 2);
+        int halo = haloY > 2 * haloC ? haloY : 2 * haloC;
+        int cw = (width + 1) / 2;
+        int nBands = pool != NULL && pool->initialized ? pool->nThreads + 1 : 1;
+        post->bandRows = POSTPROCESS_BAND_ROWS + 2 * halo + 2;
+        post->bandSize = (size_t)2 * post->bandRows * width + (size_t)4 * (post->bandRows / 2 + 1) * cw + (size_t)2 * width + 64 + (size_t)width * sizeof *post->sums;
+        post->bandSize = (post->bandSize + 63) & ~(size_t)63;
+        post->bands = malloc((size_t)nBands * post->bandSize);
+        post->freeBands = malloc(nBands * sizeof *post->freeBands);
+        if (post->bands == NULL || post->freeBands == NULL)
+            goto nomemory;
+        for (int i = 0; i < nBands; i++)
+            post->freeBands[i] = i;
+        post->nFreeBands = nBands;
+        pthread_mutex_init(&post->bandLock, NULL);
+        pthread_cond_init(&post->bandFreed, NULL);
+        post->haveBandLock = true;
+    }
+    else
+        post->options.fusedBlur = false;
+
+    if (options->bloomStrength > 0.0)
+    {
+        int w = (width + 1) / 2;
+        int h = (height + 1) / 2;
+        int minimum = 2 * POSTPROCESS_BLOOM_RADIUS + 1;
+        for (int l = 0; l < POSTPROCESS_BLOOM_LEVELS && (l == 0 || (w >= minimum && h >= minimum)); l++)
+        {
+            post->bloomWidth[l] = w;
+            post->bloomHeight[l] = h;
+            post->bloom[l] = malloc((size_t)w * h * sizeof *post->bloom[l]);
+            if (post->bloom[l] == NULL)
+                goto nomemory;
+            post->nBloomLevels++;
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+        }
+        post->bloomScratch = malloc((size_t)post->bloomWidth[0] * post->bloomHeight[0] * sizeof *post->bloomScratch);
+        if (post->bloomScratch == NULL)
+            goto nomemory;
+        post->active = true;
+    }
+
+    if (options->lutFilename != NULL)
+    {
+        status = buildYuvLut(post);
+        if (status != POSTPROCESS_OK)
+        {
+            freePostProcess(post);
+            return status;
+        }
+        post->active = true;
+    }
+
+    return POSTPROCESS_OK;
+
+nomemory:
+    freePostProcess(post);
+    return POSTPROCESS_MEMORY;
+}
+
+void freePostProcess(PostProcess *post)
+{
+    if (post == NULL)
+        return;
+
+    free(post->scratch);
+    free(post->tileScratch);
+    free(post->lines);
+    free(post->sums);
+    for (int l = 0; l < POSTPROCESS_BLOOM_LEVELS; l++)
+        free(post->bloom[l]);
+    free(post->bloomScratch);
+    free(post->lut);
+    free(post->bands);
+    free(post->freeBands);
+    if (post->haveBandLock)
+    {
+        pthread_mutex_destroy(&post->bandLock);
+        pthread_cond_destroy(&post->bandFreed);
+    }
+    memset(post, 0, sizeof *post);
+
+    return;
+}
+
+int postProcessHalo(const PostProcess *post)
+{
+    if (post == NULL || post->options.blurPasses < 1)
+        return 0;
+
+    int haloY = post->options.blurPasses * planeRadius(post, post->width, post->height);
+    int haloC = post->options.blurPasses * planeRadius(post, (post->width + 1) / 2, (post->height + 1) / 2);
+
+    return haloY > 2 * haloC ? haloY : 2 * haloC;
+}
+
+void postProcessFrame(PostProcess *post, uint8_t *const planes[], const int linesize[], const TileMask *tiles)
+{
+    if (post == NULL || !post->active)
+        return;
+
+    int cw = (post->width + 1) / 2;
+    int ch = (post->height + 1) / 2;
+
+    // Fused blurs were done in postProcessRgba()
+    if (post->options.blurPasses > 0 && post->bands == NULL)
+    {
+        blurPlane(post, planes[0], linesize[0], post->width, post->height, tiles, TILE_SIZE);
+        blurPlane(post, planes[1], linesize[1], cw, ch, tiles, TILE_SIZE / 2);
+        blurPlane(post, planes[2], linesize[2], cw, ch, tiles, TILE_SIZE / 2);
+    }
+
+    if (post->nBloomLevels > 0)
+        bloom(post, planes[0], linesize[0]);
+
+    if (post->lut != NULL)
+    {
+        PostProcessTask task = {0};
+        task.post = post;
+        task.planes = planes;
+        task.linesizes = linesize;
+        runWorkers(post->pool, lutJob, &task, rowJobs(post->height));
+    }
+
+    return;
+}
@@ -0,0 +1,115 @@
+/*
+
+    flow: postprocess.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POSTPROCESS_H
+#define _POSTPROCESS_H
+
+#include "workers.h"
+#include "rgb2yuv.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define POSTPROCESS_DEFAULT_BLUR_RADIUS 2 // as libavfilter's boxblur
+#define POSTPROCESS_DEFAULT_BLUR_PASSES 2
+#define POSTPROCESS_GAUSSIAN_PASSES 3 // three box passes approximate a gaussian
+#define POSTPROCESS_DEFAULT_BLOOM_THRESHOLD 160.0
+#define POSTPROCESS_BLOOM_LEVELS 4
+#define POSTPROCESS_BLOOM_RADIUS 2
+#define POSTPROCESS_LUT_GRID 33 // nodes per axis of the YUV resampled colour LUT
+#define POSTPROCESS_ROWS_PER_JOB 16 // even, so chroma rows are not shared between jobs
+#define POSTPROCESS_COLUMNS_PER_JOB 256
+#define POSTPROCESS_BAND_ROWS 128 // even; rows of a fused conversion and blur band
+
+enum POSTPROCESS_ERR
+{
+    POSTPROCESS_OK = 0,
+    POSTPROCESS_ARG = -1,
+    POSTPROCESS_MEMORY = -2,
+    POSTPROCESS_LUT_FILE = -3
+};
+
+typedef struct PostProcessOptions
+{
+    int blurRadius;
+    int blurPasses; // 0: no blur
+    double bloomThreshold; // luma above which pixels glow
+    double bloomStrength; // 0: no bloom
+    char *lutFilename; // Adobe .cube 3D LUT, NULL for none
+    bool fusedBlur; // blur while converting RGBA frames, see postProcessRgba()
+    bool sparseTiles; // frames come with a TileMask, blur only dirty tiles
+} PostProcessOptions;
+
+// Blur, bloom and colour grading applied in place to YUV420P frames,
+// split over the pool by rows (horizontal passes) or columns (vertical passes)
+typedef struct PostProcess
+{
+    PostProcessOptions options;
+    int width;
+    int height;
+    WorkerPool *pool;
+
+    // Blur
+    uint8_t *scratch; // one luma-sized plane
+    uint8_t *tileScratch; // another, for blurs over dirty tiles
+    uint8_t *lines; // two line buffers per row job
+    int32_t *sums; // running sums, one per column
+
+    // Fused conversion and blur: band buffers for each concurrent job
+    uint8_t *bands;
+    size_t bandSize;
+    int bandRows;
+    int *freeBands;
+    int nFreeBands;
+    pthread_mutex_t bandLock;
+    pthread_cond_t bandFreed;
+    bool haveBandLock;
+
+    // Bloom pyramid over the luma plane, level 0 at half resolution
+    float *bloom[POSTPROCESS_BLOOM_LEVELS];
+    float *bloomScratch;
+    int bloomWidth[POSTPROCESS_BLOOM_LEVELS];
+    int bloomHeight[POSTPROCESS_BLOOM_LEVELS];
+    int nBloomLevels;
+
+    // Colour LUT resampled to YUV in, YUV out
+    float *lut;
+
+    bool active;
+} PostProcess;
+
+int initPostProcess(PostProcess *post, const PostProcessOptions *options, int width, int height, WorkerPool *pool);
+void freePostProcess(PostProcess *post);
+
+// Luma pixels beyond which the blur does not reach, to dilate a TileMask by
+int postProcessHalo(const PostProcess *post);
+
+// Blur (unless fused), bloom and colour LUT. With a TileMask (else NULL),
+// dilated by postProcessHalo(), clean tiles must be uniform and are not blurred.
+void postProcessFrame(PostProcess *post, uint8_t *const planes[], const int linesize[], const TileMask *tiles);
+
+// RGBA32 frame to YUV420P and blurred in one pass. Bands of rows and
+// their halo are converted, blurred in cache and written out once; the
+// result is the same as rgba2Yuv420p() followed by the blur.
+// Bands whose tiles are all clean are filled with the background.
+void postProcessRgba(PostProcess *post, uint8_t *const planes[], const int linesize[], const uint8_t *rgba, const TileMask *tiles);
+
+#endif // _POSTPROCESS_H
@@ -0,0 +1,621 @@
+/*
+
+    flow: raster.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "raster.h"
+#include "rgb2yuv.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static int allocateRaster(Raster *raster, uint32_t *pixels, int width, int height)
+{
+    raster->pixels = pixels;
+    raster->width = width;
+    raster->height = height;
+    raster->area = calloc((size_t)(width + 2) * height, sizeof *raster->area);
+    raster->rowStart = malloc(height * sizeof *raster->rowStart);
+    raster->rowEnd = malloc(height * sizeof *raster->rowEnd);
+    raster->coverage = malloc(width + 2);
+    if (raster->area == NULL || raster->rowStart == NULL || raster->rowEnd == NULL || raster->coverage == NULL)
+    {
+        freeRaster(raster);
+        return RASTER_MEMORY;
+    }
+    for (int y = 0; y < height; y++)
+    {
+        raster->rowStart[y] = width + 2;
+        raster->rowEnd[y] = 0;
+    }
+
+    return RASTER_OK;
+}
+
+int initRaster(Raster *raster, uint32_t *pixels, int width, int height)
+{
+    if (raster == NULL || pixels == NULL || width < 1 || height < 1)
+        return RASTER_ARG;
+
+    return allocateRaster(raster, pixels, width, height);
+}
+
+int initRasterYuv(Raster *raster, int width, int height)
+{
+    if (raster == NULL || width < 1 || height < 1)
+        return RASTER_ARG;
+
+    int status = allocateRaster(raster, NULL, width, height);
+    if (status != RASTER_OK)
+        return status;
+    raster->chroma = calloc(width / 2 + 2, sizeof *raster->chroma);
+    if (raster->chroma == NULL)
+    {
+        freeRaster(raster);
+        return RASTER_MEMORY;
+    }
+    raster->chromaStart = width;
+    raster->chromaEnd = 0;
+
+    return RASTER_OK;
+}
+
+void rasterTargetPlanes(Raster *raster, uint8_t *const planes[], const int linesize[])
+{
+    for (int p = 0; p < 3; p++)
+    {
+        raster->planes[p] = planes[p];
+        raster->linesize[p] = linesize[p];
+    }
+
+    return;
+}
+
+void freeRaster(Raster *raster)
+{
+    if (raster == NULL)
+        return;
+
+    free(raster->area);
+    free(raster->rowStart);
+    free(raster->rowEnd);
+    free(raster->coverage);
+    free(raster->chroma);
+    raster->chroma = NULL;
+    raster->area = NULL;
+    raster->rowStart = NULL;
+    raster->rowEnd = NULL;
+    raster->coverage = NULL;
+
+    return;
+}
+
+// RGBA32 is R, G, B, A in memory
+static inline uint32_t packPixel(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    uint32_t p = 0;
+    uint8_t bytes[4] = {r, g, b, a};
+    memcpy(&p, bytes, sizeof p);
+
+    return p;
+}
+
+void rasterClear(Raster *raster, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    if (raster->pixels == NULL)
+    {
+        uint8_t yuv[3] = {0};
+        rgb2YuvColour(r, g, b, yuv);
+        for (int y = 0; y < raster->height; y++)
+            memset(raster->planes[0] + (size_t)y * raster->linesize[0], yuv[0], raster->width);
+        for (int y = 0; y < (raster->height + 1) / 2; y++)
+        {
+            memset(raster->planes[1] + (size_t)y * raster->linesize[1], yuv[1], (raster->width + 1) / 2);
+            memset(raster->planes[2] + (size_t)y * raster->linesize[2], yuv[2], (raster->width + 1) / 2);
+        }
+        return;
+    }
+
+    uint32_t p = packPixel(r, g, b, a);
+    size_t n = (size_t)raster->width * raster->height;
+    uint32_t *pixels = raster->pixels;
+
+    for (size_t i = 0; i < n; i++)
+        pixels[i] = p;
+
+    return;
+}
+
+void rasterClearTiles(Raster *raster, const TileMask *tiles, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    uint8_t yuv[3] = {0};
+    uint32_t p = packPixel(r, g, b, a);
+    uint32_t *row = NULL;
+    int c1 = 0;
+    int x0 = 0;
+    int x1 = 0;
+    int y0 = 0;
+    int y1 = 0;
+
+    if (raster->pixels == NULL)
+        rgb2YuvColour(r, g, b, yuv);
+
+    for (int tileRow = 0; tileRow < tiles->rows; tileRow++)
+    {
+        y0 = tileRow * TILE_SIZE;
+        y1 = y0 + TILE_SIZE < raster->height ? y0 + TILE_SIZE : raster->height;
+        for (int c0 = 0; c0 < tiles->columns; c0 = c1 + 1)
+        {
+            for (c1 = c0; c1 < tiles->columns && tileDirty(tiles, c1, tileRow); c1++)
+                ;
+            if (c1 == c0)
+                continue;
+            x0 = c0 * TILE_SIZE;
+            x1 = c1 * TILE_SIZE < raster->width ? c1 * TILE_SIZE : raster->width;
+            if (raster->pixels == NULL)
+                fillYuvBackground(raster->planes, raster->linesize, yuv, raster->width, raster->height, x0, x1, y0, y1);
+            else
+                for (int y = y0; y < y1; y++)
+                {
+                    row = raster->pixels + (size_t)y * raster->width;
+                    for (int x = x0; x < x1; x++)
+                        row[x] = p;
+                }
+        }
+    }
+
+    return;
+}
+
+static inline void touchCells(Raster *raster, int y, int start, int end)
+{
+    if (start < raster->rowStart[y])
+        raster->rowStart[y] = start;
+    if (end > raster->rowEnd[y])
+        raster->rowEnd[y] = end;
+
+    return;
+}
+
+// Signed area of the edge (x0, y0) to (x1, y1) left in each cell, after font-rs
+static void accumulateEdge(Raster *raster, float x0, float y0, float x1, float y1)
+{
+    if (y0 == y1)
+        return;
+
+    float direction = 1.0f;
+    float t = 0.0f;
+    if (y0 > y1)
+    {
+        direction = -1.0f;
+        t = x0; x0 = x1; x1 = t;
+        t = y0; y0 = y1; y1 = t;
+    }
+    if (y1 <= 0.0f || y0 >= (float)raster->height)
+        return;
+
+    int w = raster->width;
+    float dxdy = (x1 - x0) / (y1 - y0);
+    float x = x0;
+    if (y0 < 0.0f)
+        x -= y0 * dxdy;
+    int yStart = y0 > 0.0f ? (int)y0 : 0;
+    int yEnd = (int)ceilf(y1);
+    if (yEnd > raster->height)
+        yEnd = raster->height;
+
+    float *row = NULL;
+    float dy = 0.0f;
+    float d = 0.0f;
+    float xNext = 0.0f;
+    float xa = 0.0f;
+    float xb = 0.0f;
+    float xMid = 0.0f;
+    float s = 0.0f;
+    float xaf = 0.0f;
+    float xbf = 0.0f;
+    float a0 = 0.0f;
+    float a1 = 0.0f;
+    float a2 = 0.0f;
+    float am = 0.0f;
+    int xai = 0;
+    int xbi = 0;
+
+    for (int y = yStart; y < yEnd; y++)
+    {
+        row = raster->area + (size_t)y * (w + 2);
+        dy = fminf((float)(y + 1), y1) - fmaxf((float)y, y0);
+        xNext = x + dxdy * dy;
+        d = dy * direction;
+        // Anything left of the frame counts from the first column, anything right is not drawn
+        xa = fminf(fmaxf(fminf(x, xNext), 0.0f), (float)w);
+        xb = fminf(fmaxf(fmaxf(x, xNext), 0.0f), (float)w);
+        xai = (int)xa;
+        xbi = (int)ceilf(xb);
+        if (xbi <= xai + 1)
+        {
+            xMid = 0.5f * (xa + xb) - (float)xai;
+            row[xai] += d - d * xMid;
+            row[xai + 1] += d * xMid;
+            touchCells(raster, y, xai, xai + 2);
+        }
+        else
+        {
+            s = 1.0f / (xb - xa);
+            xaf = xa - (float)xai;
+            a0 = 0.5f * s * (1.0f - xaf) * (1.0f - xaf);
+            xbf = xb - (float)xbi + 1.0f;
+            am = 0.5f * s * xbf * xbf;
+            row[xai] += d * a0;
+            if (xbi == xai + 2)
+                row[xai + 1] += d * (1.0f - a0 - am);
+            else
+            {
+                a1 = s * (1.5f - xaf);
+                row[xai + 1] += d * (a1 - a0);
+                for (int xi = xai + 2; xi < xbi - 1; xi++)
+                    row[xi] += d * s;
+                a2 = a1 + (float)(xbi - xai - 3) * s;
+                row[xbi - 1] += d * (1.0f - a2 - am);
+            }
+            row[xbi] += d * am;
+            touchCells(raster, y, xai, xbi + 1);
+        }
+        x = xNext;
+    }
+
+    return;
+}
+
+// dst + (src - dst) * alpha, with the rounded division by 255 SDL's blend uses
+static inline uint32_t blendPixel(uint32_t dst, const uint8_t src[4], unsigned int alpha)
+{
+    uint8_t d[4] = {0};
+    unsigned int v = 0;
+    memcpy(d, &dst, sizeof dst);
+    for (int c = 0; c < 4; c++)
+    {
+        v = src[c] * alpha + d[c] * (255 - alpha) + 128;
+        d[c] = (uint8_t)((v + (v >> 8)) >> 8);
+    }
+    memcpy(&dst, d, sizeof dst);
+
+    return dst;
+}
+
+// Blends the colour into pixels[0 to n - 1] with per-pixel alpha
+static void blendSpan(uint32_t *pixels, const uint8_t *alpha, int n, const uint8_t src[4])
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i colour = _mm_set_epi16(src[3], src[2], src[1], src[0], src[3], src[2], src[1], src[0]);
+    __m128i dst, a, aLow, aHigh, low, high;
+    int32_t a4 = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        memcpy(&a4, alpha + i, sizeof a4);
+        if (a4 == 0)
+            continue;
+        // Each alpha spread over the four channels of its pixel
+        a = _mm_cvtsi32_si128(a4);
+        a = _mm_unpacklo_epi8(a, a);
+        a = _mm_unpacklo_epi8(a, a);
+        aLow = _mm_unpacklo_epi8(a, zero);
+        aHigh = _mm_unpackhi_epi8(a, zero);
+
+        dst = _mm_loadu_si128((const __m128i *)(pixels + i));
+        low = _mm_unpacklo_epi8(dst, zero);
+        high = _mm_unpackhi_epi8(dst, zero);
+
+        low = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(colour, aLow), _mm_mullo_epi16(low, _mm_sub_epi16(full, aLow))), round);
+        low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+        high = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(colour, aHigh), _mm_mullo_epi16(high, _mm_sub_epi16(full, aHigh))), round);
+        high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+
+        _mm_storeu_si128((__m128i *)(pixels + i), _mm_packus_epi16(low, high));
+    }
+#endif
+
+    for (; i < n; i++)
+        if (alpha[i] != 0)
+            pixels[i] = blendPixel(pixels[i], src, alpha[i]);
+
+    return;
+}
+
+static inline uint8_t blendByte(uint8_t dst, uint8_t src, unsigned int alpha)
+{
+    unsigned int v = src * alpha + dst * (255 - alpha) + 128;
+
+    return (uint8_t)((v + (v >> 8)) >> 8);
+}
+
+// One plane of a YUV frame, otherwise as blendSpan()
+static void blendPlaneSpan(uint8_t *plane, const uint8_t *alpha, int n, uint8_t src)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i colour = _mm_set1_epi16(src);
+    __m128i dst, a, aLow, aHigh, low, high;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        a = _mm_loadu_si128((const __m128i *)(alpha + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) == 0xFFFF)
+            continue;
+        aLow = _mm_unpacklo_epi8(a, zero);
+        aHigh = _mm_unpackhi_epi8(a, zero);
+
+        dst = _mm_loadu_si128((const __m128i *)(plane + i));
+        low = _mm_unpacklo_epi8(dst, zero);
+        high = _mm_unpackhi_epi8(dst, zero);
+
+        low = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(colour, aLow), _mm_mullo_epi16(low, _mm_sub_epi16(full, aLow))), round);
+        low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+        high = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(colour, aHigh), _mm_mullo_epi16(high, _mm_sub_epi16(full, aHigh))), round);
+        high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+
+        _mm_storeu_si128((__m128i *)(plane + i), _mm_packus_epi16(low, high));
+    }
+#endif
+
+    for (; i < n; i++)
+        if (alpha[i] != 0)
+            plane[i] = blendByte(plane[i], src, alpha[i]);
+
+    return;
+}
+
+// Blends coverage[start to end - 1] into a row. For planes, luma now and chroma once the row pair is done.
+static void blendRow(Raster *raster, int row, int start, int end, const uint8_t src[4], const uint8_t yuv[3])
+{
+    const uint8_t *coverage = raster->coverage;
+
+    if (raster->pixels != NULL)
+    {
+        blendSpan(raster->pixels + (size_t)row * raster->width + start, coverage + start, end - start, src);
+        return;
+    }
+
+    blendPlaneSpan(raster->planes[0] + (size_t)row * raster->linesize[0] + start, coverage + start, end - start, yuv[0]);
+
+    uint16_t *chroma = raster->chroma;
+    for (int i = start; i < end; i++)
+        chroma[i >> 1] += coverage[i];
+    // Odd widths repeat the last column, as in rgb2yuv
+    if (end == raster->width && (raster->width & 1))
+        chroma[end >> 1] += coverage[end - 1];
+    if ((start >> 1) < raster->chromaStart)
+        raster->chromaStart = start >> 1;
+    if (((end + 1) >> 1) > raster->chromaEnd)
+        raster->chromaEnd = (end + 1) >> 1;
+
+    return;
+}
+
+// Chroma of the row pair holding row, from the mean coverage of each 2x2 block
+static void flushChroma(Raster *raster, int row, const uint8_t yuv[3])
+{
+    if (raster->pixels != NULL || raster->chromaStart >= raster->chromaEnd)
+        return;
+
+    // Odd heights repeat the last row
+    int shift = (row & 1) == 0 && row == raster->height - 1 ? 1 : 2;
+    uint8_t *u = raster->planes[1] + (size_t)(row >> 1) * raster->linesize[1];
+    uint8_t *v = raster->planes[2] + (size_t)(row >> 1) * raster->linesize[2];
+    uint16_t *chroma = raster->chroma;
+    unsigned int alpha = 0;
+
+    for (int c = raster->chromaStart; c < raster->chromaEnd; c++)
+    {
+        alpha = (chroma[c] + (1u << (shift - 1))) >> shift;
+        chroma[c] = 0;
+        if (alpha == 0)
+            continue;
+        u[c] = blendByte(u[c], yuv[1], alpha);
+        v[c] = blendByte(v[c], yuv[2], alpha);
+    }
+    raster->chromaStart = raster->width;
+    raster->chromaEnd = 0;
+
+    return;
+}
+
+void rasterFillPolygon(Raster *raster, const float *x, const float *y, int nPoints, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    if (raster == NULL || x == NULL || y == NULL || nPoints < 3 || a == 0)
+        return;
+
+    float yMin = y[0];
+    float yMax = y[0];
+    for (int i = 0; i < nPoints; i++)
+    {
+        accumulateEdge(raster, x[i], y[i], x[(i + 1) % nPoints], y[(i + 1) % nPoints]);
+        if (y[i] < yMin)
+            yMin = y[i];
+        if (y[i] > yMax)
+            yMax = y[i];
+    }
+
+    int rowFirst = yMin > 0.0f ? (int)yMin : 0;
+    int rowLast = yMax < (float)raster->height ? (int)ceilf(yMax) : raster->height;
+    const uint8_t src[4] = {r, g, b, 255};
+    uint8_t yuv[3] = {0};
+    if (raster->pixels == NULL)
+        rgb2YuvColour(r, g, b, yuv);
+    int w = raster->width;
+    float *area = NULL;
+    uint8_t *coverage = raster->coverage;
+    float sum = 0.0f;
+    float alpha = (float)a;
+    int start = 0;
+    int end = 0;
+
+    for (int row = rowFirst; row < rowLast; row++)
+    {
+        start = raster->rowStart[row];
+        end = raster->rowEnd[row];
+        if (start >= end)
+        {
+            if ((row & 1) || row == rowLast - 1)
+                flushChroma(raster, row, yuv);
+            continue;
+        }
+        raster->rowStart[row] = w + 2;
+        raster->rowEnd[row] = 0;
+
+        // Coverage from the running sum of areas, clearing the cells for the next polygon
+        area = raster->area + (size_t)row * (w + 2);
+        sum = 0.0f;
+        for (int i = end > w ? w : end; i < end; i++)
+            area[i] = 0.0f;
+        if (end > w)
+            end = w;
+        for (int i = start; i < end; i++)
+        {
+            sum += area[i];
+            area[i] = 0.0f;
+            coverage[i] = (uint8_t)(fminf(fabsf(sum), 1.0f) * alpha + 0.5f);
+        }
+
+        blendRow(raster, row, start, end, src, yuv);
+        if ((row & 1) || row == rowLast - 1)
+            flushChroma(raster, row, yuv);
+    }
+
+    return;
+}
+
+void rasterBlendMask(Raster *raster, const uint8_t *mask, int pitch, int width, int height, int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    if (raster == NULL || mask == NULL || a == 0)
+        return;
+
+    int start = x > 0 ? x : 0;
+    int end = x + width < raster->width ? x + width : raster->width;
+    int rowFirst = y > 0 ? y : 0;
+    int rowLast = y + height < raster->height ? y + height : raster->height;
+    if (start >= end)
+        return;
+
+    const uint8_t src[4] = {r, g, b, 255};
+    uint8_t yuv[3] = {0};
+    if (raster->pixels == NULL)
+        rgb2YuvColour(r, g, b, yuv);
+    uint8_t *coverage = raster->coverage;
+    const uint8_t *m = NULL;
+
+    for (int row = rowFirst; row < rowLast; row++)
+    {
+        m = mask + (size_t)(row - y) * pitch - x;
+        for (int i = start; i < end; i++)
+            coverage[i] = (uint8_t)((m[i] * a + 127) / 255);
+        blendRow(raster, row, start, end, src, yuv);
+        if ((row & 1) || row == rowLast - 1)
+            flushChroma(raster, row, yuv);
+    }
+
+    return;
+}
+
+void rasterBlendRows(Raster *raster, int row, int start, int end, const uint8_t *rgba0, const uint8_t *rgba1)
+{
+    if (raster == NULL || rgba0 == NULL || start >= end)
+        return;
+
+    const uint8_t *rows[2] = {rgba0, rgba1};
+    const uint8_t *p = NULL;
+    uint32_t *pixels = NULL;
+    uint8_t *luma = NULL;
+    uint8_t yuv[3] = {0};
+
+    if (raster->pixels != NULL)
+    {
+        for (int r = 0; r < 2 && rows[r] != NULL; r++)
+        {
+            pixels = raster->pixels + (size_t)(row + r) * raster->width;
+            for (int i = start; i < end; i++)
+            {
+                p = rows[r] + 4 * i;
+                if (p[3] != 0)
+                    pixels[i] = blendPixel(pixels[i], (const uint8_t[4]){p[0], p[1], p[2], 255}, p[3]);
+            }
+        }
+        return;
+    }
+
+    // Luma per pixel
+    for (int r = 0; r < 2 && rows[r] != NULL; r++)
+    {
+        luma = raster->planes[0] + (size_t)(row + r) * raster->linesize[0];
+        for (int i = start; i < end; i++)
+        {
+            p = rows[r] + 4 * i;
+            if (p[3] == 0)
+                continue;
+            rgb2YuvColour(p[0], p[1], p[2], yuv);
+            luma[i] = blendByte(luma[i], yuv[0], p[3]);
+        }
+    }
+
+    // Chroma from the alpha-weighted mean of each 2x2 block; odd sizes repeat the last column / row
+    uint8_t *u = raster->planes[1] + (size_t)(row >> 1) * raster->linesize[1];
+    uint8_t *v = raster->planes[2] + (size_t)(row >> 1) * raster->linesize[2];
+    unsigned int alpha = 0;
+    unsigned int su = 0;
+    unsigned int sv = 0;
+    unsigned int total = 0;
+    int x = 0;
+
+    for (int c = start >> 1; c < (end + 1) >> 1; c++)
+    {
+        alpha = su = sv = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            x = 2 * c + (k & 1) < raster->width ? 2 * c + (k & 1) : raster->width - 1;
+            p = (rows[k >> 1] != NULL ? rows[k >> 1] : rows[0]) + 4 * x;
+            if (p[3] == 0)
+                continue;
+            rgb2YuvColour(p[0], p[1], p[2], yuv);
+            alpha += p[3];
+            su += p[3] * yuv[1];
+            sv += p[3] * yuv[2];
+        }
+        if (alpha == 0)
+            continue;
+        total = 4 * 255;
+        u[c] = (uint8_t)((u[c] * (total - alpha) + su + total / 2) / total);
+        v[c] = (uint8_t)((v[c] * (total - alpha) + sv + total / 2) / total);
+    }
+
+    return;
+}
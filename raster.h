@@ -0,0 +1,88 @@
+/*
+
+    flow: raster.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RASTER_H
+#define _RASTER_H
+
+#include "tiles.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum RASTER_ERR
+{
+    RASTER_OK = 0,
+    RASTER_ARG = -1,
+    RASTER_MEMORY = -2
+};
+
+enum NoteRasterizer
+{
+    NOTE_RASTERIZER_NATIVE = 0,
+    NOTE_RASTERIZER_SDL_GFX,
+    NOTE_RASTERIZER_SDL_GEOMETRY
+};
+
+// Anti-aliased polygon filling straight into an RGBA32 frame buffer.
+// Edges accumulate signed area into a per-pixel buffer; a running sum
+// along each row then gives the coverage of every pixel.
+// The target is either RGBA32 pixels or the planes of a YUV420P frame.
+typedef struct Raster
+{
+    uint32_t *pixels; // NULL when drawing into planes
+    int width;
+    int height;
+
+    // YUV420P target: luma blended per pixel, chroma by the mean coverage of each 2x2 block
+    uint8_t *planes[3];
+    int linesize[3];
+    uint16_t *chroma; // coverage summed over the row pair
+    int chromaStart;
+    int chromaEnd;
+
+    float *area; // (width + 2) per row
+    int *rowStart; // touched cells of each row
+    int *rowEnd;
+    uint8_t *coverage; // one row
+} Raster;
+
+int initRaster(Raster *raster, uint32_t *pixels, int width, int height);
+int initRasterYuv(Raster *raster, int width, int height);
+void freeRaster(Raster *raster);
+
+// Planes can move between frames, e.g. after av_frame_make_writable()
+void rasterTargetPlanes(Raster *raster, uint8_t *const planes[], const int linesize[]);
+
+void rasterClear(Raster *raster, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+// Only the dirty tiles, e.g. those drawn on the last frame when the rest is this colour already
+void rasterClearTiles(Raster *raster, const TileMask *tiles, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+// Vertices in pixel units, in order around the polygon. Overlapping parts are covered once.
+void rasterFillPolygon(Raster *raster, const float *x, const float *y, int nPoints, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+// Coverage mask (e.g. rendered text) placed with its top left corner at (x, y)
+void rasterBlendMask(Raster *raster, const uint8_t *mask, int pitch, int width, int height, int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+// Per-pixel colours (RGBA, straight alpha) of columns start to end - 1 of an even row and the
+// row below, blended in. rgba1 is NULL past the bottom of odd heights.
+void rasterBlendRows(Raster *raster, int row, int start, int end, const uint8_t *rgba0, const uint8_t *rgba1);
+
+#endif // _RASTER_H
@@ -0,0 +1,436 @@
+/*
+
+    flow: rgb2yuv.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rgb2yuv.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+typedef struct Rgb2YuvTask
+{
+    Rgb2YuvRows kernel;
+    uint8_t *const *destination;
+    const int *linesize;
+    const uint8_t *rgba;
+    int width;
+    int height;
+    const TileMask *tiles;
+} Rgb2YuvTask;
+
+// Same integer arithmetic in every kernel, so they agree to the bit
+static inline uint8_t luma(int r, int g, int b)
+{
+    return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+static inline uint8_t chromaU(int r, int g, int b)
+{
+    return (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+static inline uint8_t chromaV(int r, int g, int b)
+{
+    return (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+void rgb2YuvColour(uint8_t r, uint8_t g, uint8_t b, uint8_t yuv[3])
+{
+    yuv[0] = luma(r, g, b);
+    yuv[1] = chromaU(r, g, b);
+    yuv[2] = chromaV(r, g, b);
+
+    return;
+}
+
+// Columns x0 to width - 1 of a row pair. Odd widths and heights repeat the last column / row.
+static void rowPairScalar(uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, const uint8_t *row0, const uint8_t *row1, int x0, int width)
+{
+    const uint8_t *p00 = NULL;
+    const uint8_t *p01 = NULL;
+    const uint8_t *p10 = NULL;
+    const uint8_t *p11 = NULL;
+    int x1 = 0;
+    int r = 0;
+    int g = 0;
+    int b = 0;
+
+    for (int x = x0; x < width; x += 2)
+    {
+        x1 = x + 1 < width ? x + 1 : x;
+        p00 = row0 + 4 * x;
+        p01 = row0 + 4 * x1;
+        p10 = row1 + 4 * x;
+        p11 = row1 + 4 * x1;
+
+        y0[x] = luma(p00[0], p00[1], p00[2]);
+        if (x1 != x)
+            y0[x1] = luma(p01[0], p01[1], p01[2]);
+        if (y1 != NULL)
+        {
+            y1[x] = luma(p10[0], p10[1], p10[2]);
+            if (x1 != x)
+                y1[x1] = luma(p11[0], p11[1], p11[2]);
+        }
+
+        r = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+        g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+        b = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+        u[x / 2] = chromaU(r, g, b);
+        v[x / 2] = chromaV(r, g, b);
+    }
+
+    return;
+}
+
+// Sets up the row pair pointers shared by all kernels
+#define ROW_PAIR(row) \
+    const uint8_t *row0 = rgba + (ptrdiff_t)(row) * rgbaLinesize; \
+    const uint8_t *row1 = (row) + 1 < height ? row0 + rgbaLinesize : row0; \
+    uint8_t *y0 = destination[0] + (ptrdiff_t)(row) * linesize[0]; \
+    uint8_t *y1 = (row) + 1 < height ? y0 + linesize[0] : NULL; \
+    uint8_t *u = destination[1] + (ptrdiff_t)((row) / 2) * linesize[1]; \
+    uint8_t *v = destination[2] + (ptrdiff_t)((row) / 2) * linesize[2];
+
+void rgba2Yuv420pRowsScalar(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int rgbaLinesize, int width, int height, int rowStart, int rowEnd)
+{
+    for (int row = rowStart; row < rowEnd; row += 2)
+    {
+        ROW_PAIR(row)
+        rowPairScalar(y0, y1, u, v, row0, row1, 0, width);
+    }
+
+    return;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 8 pixels from two 4-pixel loads to 16-bit R, G and B
+static inline void unpackSse2(__m128i a, __m128i b, __m128i *r, __m128i *g, __m128i *bl)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    *r = _mm_packs_epi32(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    *g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8), mask), _mm_and_si128(_mm_srli_epi32(b, 8), mask));
+    *bl = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 16), mask), _mm_and_si128(_mm_srli_epi32(b, 16), mask));
+
+    return;
+}
+
+// Unsigned 16-bit: 66 * 255 + 129 * 255 + 25 * 255 + 128 fits
+static inline __m128i lumaSse2(__m128i r, __m128i g, __m128i b)
+{
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+    y = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+
+    return _mm_add_epi16(y, _mm_set1_epi16(16));
+}
+
+// Signed 16-bit, |sum| <= 112 * 255 + 128
+static inline __m128i chromaSse2(__m128i r, __m128i g, __m128i b, short cr, short cg, short cb)
+{
+    __m128i c = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(cr)), _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+    c = _mm_add_epi16(c, _mm_mullo_epi16(b, _mm_set1_epi16(cb)));
+    c = _mm_srai_epi16(_mm_add_epi16(c, _mm_set1_epi16(128)), 8);
+
+    return _mm_add_epi16(c, _mm_set1_epi16(128));
+}
+
+// Rounded mean of 2x2 blocks: vertical pairs summed, then horizontal pairs
+static inline __m128i blockMeanSse2(__m128i top, __m128i bottom)
+{
+    __m128i sum = _mm_madd_epi16(_mm_add_epi16(top, bottom), _mm_set1_epi16(1));
+    sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(2)), 2);
+
+    return _mm_packs_epi32(sum, sum);
+}
+
+void rgba2Yuv420pRowsSse2(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int rgbaLinesize, int width, int height, int rowStart, int rowEnd)
+{
+    __m128i r0, g0, b0, r1, g1, b1;
+    __m128i r, g, b, y;
+    int32_t chroma = 0;
+    int x = 0;
+
+    for (int row = rowStart; row < rowEnd; row += 2)
+    {
+        ROW_PAIR(row)
+        for (x = 0; x + 8 <= width; x += 8)
+        {
+            unpackSse2(_mm_loadu_si128((const __m128i *)(row0 + 4 * x)), _mm_loadu_si128((const __m128i *)(row0 + 4 * x + 16)), &r0, &g0, &b0);
+            unpackSse2(_mm_loadu_si128((const __m128i *)(row1 + 4 * x)), _mm_loadu_si128((const __m128i *)(row1 + 4 * x + 16)), &r1, &g1, &b1);
+
+            y = lumaSse2(r0, g0, b0);
+            _mm_storel_epi64((__m128i *)(y0 + x), _mm_packus_epi16(y, y));
+            if (y1 != NULL)
+            {
+                y = lumaSse2(r1, g1, b1);
+                _mm_storel_epi64((__m128i *)(y1 + x), _mm_packus_epi16(y, y));
+            }
+
+            r = blockMeanSse2(r0, r1);
+            g = blockMeanSse2(g0, g1);
+            b = blockMeanSse2(b0, b1);
+            y = chromaSse2(r, g, b, -38, -74, 112);
+            chroma = _mm_cvtsi128_si32(_mm_packus_epi16(y, y));
+            memcpy(u + x / 2, &chroma, sizeof chroma);
+            y = chromaSse2(r, g, b, 112, -94, -18);
+            chroma = _mm_cvtsi128_si32(_mm_packus_epi16(y, y));
+            memcpy(v + x / 2, &chroma, sizeof chroma);
+        }
+        rowPairScalar(y0, y1, u, v, row0, row1, x, width);
+    }
+
+    return;
+}
+
+// As for SSE2, 16 pixels at a time. Packs work within 128-bit lanes,
+// so 64-bit quarters are put back in pixel order after each pack.
+__attribute__((target("avx2")))
+static inline void unpackAvx2(__m256i a, __m256i b, __m256i *r, __m256i *g, __m256i *bl)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    *r = _mm256_packs_epi32(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+    *g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(a, 8), mask), _mm256_and_si256(_mm256_srli_epi32(b, 8), mask));
+    *bl = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(a, 16), mask), _mm256_and_si256(_mm256_srli_epi32(b, 16), mask));
+    *r = _mm256_permute4x64_epi64(*r, 0xd8);
+    *g = _mm256_permute4x64_epi64(*g, 0xd8);
+    *bl = _mm256_permute4x64_epi64(*bl, 0xd8);
+
+    return;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lumaAvx2(__m256i r, __m256i g, __m256i b)
+{
+    __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)), _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(25)));
+    y = _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(128)), 8);
+
+    return _mm256_add_epi16(y, _mm256_set1_epi16(16));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i chromaAvx2(__m256i r, __m256i g, __m256i b, short cr, short cg, short cb)
+{
+    __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(cr)), _mm256_mullo_epi16(g, _mm256_set1_epi16(cg)));
+    c = _mm256_add_epi16(c, _mm256_mullo_epi16(b, _mm256_set1_epi16(cb)));
+    c = _mm256_srai_epi16(_mm256_add_epi16(c, _mm256_set1_epi16(128)), 8);
+
+    return _mm256_add_epi16(c, _mm256_set1_epi16(128));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blockMeanAvx2(__m256i top, __m256i bottom)
+{
+    __m256i sum = _mm256_madd_epi16(_mm256_add_epi16(top, bottom), _mm256_set1_epi16(1));
+    sum = _mm256_srli_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(2)), 2);
+
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, sum), 0xd8);
+}
+
+// 16 bytes from the 16-bit lanes of y
+__attribute__((target("avx2")))
+static inline __m128i packBytesAvx2(__m256i y)
+{
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(y, y), 0xd8));
+}
+
+__attribute__((target("avx2")))
+void rgba2Yuv420pRowsAvx2(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int rgbaLinesize, int width, int height, int rowStart, int rowEnd)
+{
+    __m256i r0, g0, b0, r1, g1, b1;
+    __m256i r, g, b, y;
+    int x = 0;
+
+    for (int row = rowStart; row < rowEnd; row += 2)
+    {
+        ROW_PAIR(row)
+        for (x = 0; x + 16 <= width; x += 16)
+        {
+            unpackAvx2(_mm256_loadu_si256((const __m256i *)(row0 + 4 * x)), _mm256_loadu_si256((const __m256i *)(row0 + 4 * x + 32)), &r0, &g0, &b0);
+            unpackAvx2(_mm256_loadu_si256((const __m256i *)(row1 + 4 * x)), _mm256_loadu_si256((const __m256i *)(row1 + 4 * x + 32)), &r1, &g1, &b1);
+
+            _mm_storeu_si128((__m128i *)(y0 + x), packBytesAvx2(lumaAvx2(r0, g0, b0)));
+            if (y1 != NULL)
+                _mm_storeu_si128((__m128i *)(y1 + x), packBytesAvx2(lumaAvx2(r1, g1, b1)));
+
+            r = blockMeanAvx2(r0, r1);
+            g = blockMeanAvx2(g0, g1);
+            b = blockMeanAvx2(b0, b1);
+            y = chromaAvx2(r, g, b, -38, -74, 112);
+            _mm_storel_epi64((__m128i *)(u + x / 2), packBytesAvx2(y));
+            y = chromaAvx2(r, g, b, 112, -94, -18);
+            _mm_storel_epi64((__m128i *)(v + x / 2), packBytesAvx2(y));
+        }
+        rowPairScalar(y0, y1, u, v, row0, row1, x, width);
+    }
+
+    return;
+}
+
+#endif
+
+int rgb2YuvKernel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return RGB2YUV_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return RGB2YUV_SSE2;
+#endif
+
+    return RGB2YUV_SCALAR;
+}
+
+Rgb2YuvRows rgb2YuvRowsKernel(void)
+{
+    static Rgb2YuvRows kernel = NULL;
+
+    Rgb2YuvRows k = __atomic_load_n(&kernel, __ATOMIC_ACQUIRE);
+    if (k != NULL)
+        return k;
+
+    switch (rgb2YuvKernel())
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        case RGB2YUV_AVX2:
+            k = rgba2Yuv420pRowsAvx2;
+            break;
+        case RGB2YUV_SSE2:
+            k = rgba2Yuv420pRowsSse2;
+            break;
+#endif
+        default:
+            k = rgba2Yuv420pRowsScalar;
+            break;
+    }
+    __atomic_store_n(&kernel, k, __ATOMIC_RELEASE);
+
+    return k;
+}
+
+static void rgb2YuvJob(void *arg, int index)
+{
+    Rgb2YuvTask *task = (Rgb2YuvTask *)arg;
+
+    int rowStart = index * RGB2YUV_ROWS_PER_JOB;
+    int rowEnd = rowStart + RGB2YUV_ROWS_PER_JOB;
+    if (rowEnd > task->height)
+        rowEnd = task->height;
+
+    task->kernel(task->destination, task->linesize, task->rgba, 4 * task->width, task->width, task->height, rowStart, rowEnd);
+
+    return;
+}
+
+void rgba2Yuv420p(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int width, int height, WorkerPool *pool)
+{
+    Rgb2YuvTask task = {0};
+    task.kernel = rgb2YuvRowsKernel();
+    task.destination = destination;
+    task.linesize = linesize;
+    task.rgba = rgba;
+    task.width = width;
+    task.height = height;
+
+    int nJobs = (height + RGB2YUV_ROWS_PER_JOB - 1) / RGB2YUV_ROWS_PER_JOB;
+    runWorkers(pool, rgb2YuvJob, &task, nJobs);
+
+    return;
+}
+
+void fillYuvBackground(uint8_t *const destination[], const int linesize[], const uint8_t background[3], int width, int height, int x0, int x1, int rowStart, int rowEnd)
+{
+    int c1 = (x1 + 1) / 2 < (width + 1) / 2 ? (x1 + 1) / 2 : (width + 1) / 2;
+
+    for (int row = rowStart; row < rowEnd && row < height; row++)
+        memset(destination[0] + (ptrdiff_t)row * linesize[0] + x0, background[0], x1 - x0);
+    for (int row = rowStart / 2; row < (rowEnd + 1) / 2 && row < (height + 1) / 2; row++)
+    {
+        memset(destination[1] + (ptrdiff_t)row * linesize[1] + x0 / 2, background[1], c1 - x0 / 2);
+        memset(destination[2] + (ptrdiff_t)row * linesize[2] + x0 / 2, background[2], c1 - x0 / 2);
+    }
+
+    return;
+}
+
+// Runs of dirty and of clean tiles along the tile row of this job
+static void rgb2YuvTilesJob(void *arg, int index)
+{
+    Rgb2YuvTask *task = (Rgb2YuvTask *)arg;
+    const TileMask *tiles = task->tiles;
+
+    int rowStart = index * RGB2YUV_ROWS_PER_JOB;
+    int rowEnd = rowStart + RGB2YUV_ROWS_PER_JOB;
+    if (rowEnd > task->height)
+        rowEnd = task->height;
+    int tileRow = rowStart / TILE_SIZE;
+    int c0 = 0;
+    int c1 = 0;
+    int x0 = 0;
+    int x1 = 0;
+    bool dirty = false;
+
+    for (c0 = 0; c0 < tiles->columns; c0 = c1)
+    {
+        dirty = tileDirty(tiles, c0, tileRow);
+        for (c1 = c0 + 1; c1 < tiles->columns && tileDirty(tiles, c1, tileRow) == dirty; c1++)
+            ;
+        x0 = c0 * TILE_SIZE;
+        x1 = c1 * TILE_SIZE < task->width ? c1 * TILE_SIZE : task->width;
+        if (dirty)
+        {
+            uint8_t *const destination[3] = {task->destination[0] + x0, task->destination[1] + x0 / 2, task->destination[2] + x0 / 2};
+            task->kernel(destination, task->linesize, task->rgba + (size_t)4 * x0, 4 * task->width, x1 - x0, task->height, rowStart, rowEnd);
+        }
+        else
+            fillYuvBackground(task->destination, task->linesize, tiles->background, task->width, task->height, x0, x1, rowStart, rowEnd);
+    }
+
+    return;
+}
+
+void rgba2Yuv420pTiles(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int width, int height, const TileMask *tiles, WorkerPool *pool)
+{
+    if (tiles == NULL)
+    {
+        rgba2Yuv420p(destination, linesize, rgba, width, height, pool);
+        return;
+    }
+
+    Rgb2YuvTask task = {0};
+    task.kernel = rgb2YuvRowsKernel();
+    task.destination = destination;
+    task.linesize = linesize;
+    task.rgba = rgba;
+    task.width = width;
+    task.height = height;
+    task.tiles = tiles;
+
+    int nJobs = (height + RGB2YUV_ROWS_PER_JOB - 1) / RGB2YUV_ROWS_PER_JOB;
+    runWorkers(pool, rgb2YuvTilesJob, &task, nJobs);
+
+    return;
+}
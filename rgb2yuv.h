@@ -0,0 +1,66 @@
+/*
+
+    flow: rgb2yuv.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RGB2YUV_H
+#define _RGB2YUV_H
+
+#include "workers.h"
+#include "tiles.h"
+
+#include <stdint.h>
+
+#define RGB2YUV_ROWS_PER_JOB 16 // even, so chroma rows are not shared between jobs
+
+enum RGB2YUV_KERNEL
+{
+    RGB2YUV_SCALAR = 0,
+    RGB2YUV_SSE2,
+    RGB2YUV_AVX2
+};
+
+// BT.601 limited range, chroma from the average of each 2x2 block
+// rowStart is even; rows rowStart to rowEnd - 1 of the RGBA32 image are converted.
+typedef void (*Rgb2YuvRows)(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int rgbaLinesize, int width, int height, int rowStart, int rowEnd);
+
+void rgba2Yuv420pRowsScalar(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int rgbaLinesize, int width, int height, int rowStart, int rowEnd);
+#if defined(__x86_64__) || defined(__i386__)
+void rgba2Yuv420pRowsSse2(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int rgbaLinesize, int width, int height, int rowStart, int rowEnd);
+void rgba2Yuv420pRowsAvx2(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int rgbaLinesize, int width, int height, int rowStart, int rowEnd);
+#endif
+
+// One colour, with the arithmetic of the kernels
+void rgb2YuvColour(uint8_t r, uint8_t g, uint8_t b, uint8_t yuv[3]);
+
+// Best kernel this CPU supports
+int rgb2YuvKernel(void);
+
+// The rows function of that kernel
+Rgb2YuvRows rgb2YuvRowsKernel(void);
+
+// Whole frame, rows split across the pool (NULL: this thread only)
+void rgba2Yuv420p(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int width, int height, WorkerPool *pool);
+
+// Dirty tiles converted, clean tiles filled with the mask's background
+void rgba2Yuv420pTiles(uint8_t *const destination[], const int linesize[], const uint8_t *rgba, int width, int height, const TileMask *tiles, WorkerPool *pool);
+
+// Rows rowStart to rowEnd - 1 of clean tiles, columns x0 to x1 - 1, set to the background (both even)
+void fillYuvBackground(uint8_t *const destination[], const int linesize[], const uint8_t background[3], int width, int height, int x0, int x1, int rowStart, int rowEnd);
+
+#endif // _RGB2YUV_H
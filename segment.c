@@ -0,0 +1,361 @@
+/*
+
+    flow: segment.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "segment.h"
+#include "midi.h"
+#include "physics.h"
+#include "video.h"
+#include "audio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void *segmentWorker(void *arg)
+{
+    SegmentWorker *worker = (SegmentWorker *)arg;
+
+    worker->status = flow(&worker->state);
+    __atomic_store_n(&worker->done, true, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static int openSegment(const char *filename, AVFormatContext **input, int *streamIndex)
+{
+    int status = avformat_open_input(input, filename, NULL, NULL);
+    if (status != 0)
+    {
+        fprintf(stderr, "Problem opening video segment %s\n", filename);
+        return VIDEO_OUTPUT_CONTEXT;
+    }
+    status = avformat_find_stream_info(*input, NULL);
+    if (status < 0)
+    {
+        fprintf(stderr, "Problem getting stream info for video segment %s\n", filename);
+        return VIDEO_OUTPUT_STREAM;
+    }
+    *streamIndex = -1;
+    for (unsigned int i = 0; i < (*input)->nb_streams; i++)
+    {
+        if ((*input)->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            *streamIndex = i;
+            break;
+        }
+    }
+    if (*streamIndex < 0)
+    {
+        fprintf(stderr, "No video stream in segment %s\n", filename);
+        return VIDEO_OUTPUT_STREAM;
+    }
+
+    return VIDEO_OK;
+}
+
+// Copy the segments' packets into the output, muxing the audio once
+static int stitchSegments(State *state, SegmentWorker *workers, int nSegments)
+{
+    VideoState *video = &state->videoState;
+    AudioState *audio = &state->audioState;
+    AVFormatContext *input = NULL;
+    AVStream *inStream = NULL;
+    AVPacket *packet = NULL;
+    AVRational frameTimeBase = (AVRational){1, video->frameRate};
+    int streamIndex = -1;
+    int64_t offset = 0;
+    int64_t packetNumber = 0;
+    double elapsedAudioTime = 0.0;
+    bool moreAudio = true;
+    int status = VIDEO_OK;
+
+    // First segment defines the stream parameters
+    status = openSegment(workers[0].state.videoState.outputFilename, &input, &streamIndex);
+    if (status != VIDEO_OK)
+        goto cleanup;
+
+    avformat_alloc_output_context2(&video->videoContext, NULL, "mp4", video->outputFilename);
+    if (!video->videoContext)
+    {
+        fprintf(stderr, "Problem initializing output context\n");
+        status = VIDEO_OUTPUT_CONTEXT;
+        goto cleanup;
+    }
+    video->videoStream = avformat_new_stream(video->videoContext, NULL);
+    if (!video->videoStream)
+    {
+        fprintf(stderr, "Problem initializing output video stream\n");
+        status = VIDEO_OUTPUT_STREAM;
+        goto cleanup;
+    }
+    video->videoStream->id = 0;
+    status = avcodec_parameters_copy(video->videoStream->codecpar, input->streams[streamIndex]->codecpar);
+    if (status < 0)
+    {
+        fprintf(stderr, "Problem copying stream parameters.\n");
+        status = VIDEO_STREAM_PARAMETERS;
+        goto cleanup;
+    }
+    video->videoStream->codecpar->codec_tag = 0;
+    video->videoStream->time_base = frameTimeBase;
+    video->videoStream->avg_frame_rate = (AVRational){video->frameRate, 1};
+
+    // Audio setup, as for a single render
+    if (strcmp("none", audio->audioFilename) != 0 && !audio->bypassAudio)
+    {
+        status = initAudio(audio, video->videoContext);
+        if (status != VIDEO_OK)
+        {
+            fprintf(stderr, "Could not initialize audio.\n");
+            status = VIDEO_AUDIO_OPEN;
+            goto cleanup;
+        }
+        audio->haveAudio = true;
+    }
+    else
+        audio->haveAudio = false;
+
+    status = avio_open(&video->videoContext->pb, video->outputFilename, AVIO_FLAG_WRITE);
+    if (status < 0)
+    {
+        fprintf(stderr, "Problem opening video file for writing\n");
+        goto cleanup;
+    }
+    av_dict_set(&video->dict, "movflags", "faststart", 0);
+    status = avformat_write_header(video->videoContext, &video->dict);
+    if (status < 0)
+    {
+        fprintf(stderr, "Problem writing video header: %s\n", av_err2str(status));
+        goto cleanup;
+    }
+
+    packet = av_packet_alloc();
+    if (packet == NULL)
+    {
+        status = VIDEO_NO_PACKET;
+        goto cleanup;
+    }
+
+    for (int s = 0; s < nSegments; s++)
+    {
+        if (s > 0)
+        {
+            status = openSegment(workers[s].state.videoState.outputFilename, &input, &streamIndex);
+            if (status != VIDEO_OK)
+                goto cleanup;
+        }
+        inStream = input->streams[streamIndex];
+        // Segments are encoded from pts 0
+        offset = av_rescale_q(workers[s].state.firstFrame, frameTimeBase, video->videoStream->time_base);
+
+        while (av_read_frame(input, packet) >= 0)
+        {
+            if (packet->stream_index != streamIndex)
+            {
+                av_packet_unref(packet);
+                continue;
+            }
+            av_packet_rescale_ts(packet, inStream->time_base, video->videoStream->time_base);
+            if (packet->pts != AV_NOPTS_VALUE)
+                packet->pts += offset;
+            if (packet->dts != AV_NOPTS_VALUE)
+                packet->dts += offset;
+            packet->stream_index = video->videoStream->index;
+            packet->pos = -1;
+
+            while (audio->haveAudio && moreAudio && packet->pts != AV_NOPTS_VALUE && elapsedAudioTime < (double)packet->pts * av_q2d(video->videoStream->time_base))
+            {
+                status = transcodeAudioFrames(audio, (int)packetNumber, &elapsedAudioTime, video->videoContext, NULL);
+                if (status == VIDEO_AUDIO_EOF)
+                    moreAudio = false;
+            }
+
+            status = av_interleaved_write_frame(video->videoContext, packet);
+            if (status < 0)
+            {
+                fprintf(stderr, "Problem writing packet: %s\n", av_err2str(status));
+                status = VIDEO_FRAME_WRITE;
+                goto cleanup;
+            }
+            packetNumber++;
+        }
+        avformat_close_input(&input);
+    }
+
+    av_write_trailer(video->videoContext);
+    status = VIDEO_OK;
+
+cleanup:
+    av_packet_free(&packet);
+    avformat_close_input(&input);
+
+    return status;
+}
+
+int flowSegments(State *state)
+{
+    if (state == NULL || state->song == NULL || state->nSegments < 1)
+        return VIDEO_ARG;
+
+    int status = VIDEO_OK;
+    int64_t nFrames = countVideoFrames(state);
+    int nSegments = state->nSegments;
+    if (nSegments > nFrames)
+        nSegments = (int)nFrames;
+    if (nSegments < 1)
+        return VIDEO_MISSING_NOTES;
+
+    // One random shear field for all segments, as a single render would make
+    if (state->randomSeed != (unsigned int)-1)
+        srand(state->randomSeed);
+    status = initShearField(&state->shearField, state->nShearYPoints, state->shearDeltaT, state->song->maxTime, state->videoState.frameHeight);
+    if (status != SHEAR_OK)
+        return VIDEO_MEMORY;
+
+    SegmentWorker *workers = calloc(nSegments, sizeof *workers);
+    if (workers == NULL)
+        return VIDEO_MEMORY;
+
+    SegmentWorker *worker = NULL;
+    VideoState *video = NULL;
+    size_t filenameLength = strlen(state->videoState.outputFilename) + 32;
+    int64_t firstFrame = 0;
+
+    // Video processors are set up here, SDL and FFMPEG initialization is not thread safe
+    for (int s = 0; s < nSegments; s++)
+    {
+        worker = &workers[s];
+        worker->state = *state;
+        worker->state.segmentWorker = true;
+        worker->state.firstFrame = firstFrame;
+        worker->state.nFrames = nFrames / nSegments + (s < nFrames % nSegments ? 1 : 0);
+        firstFrame += worker->state.nFrames;
+        worker->state.audioState.haveAudio = false;
+        worker->state.song = copyMidiSong(state->song);
+        if (worker->state.song == NULL)
+        {
+            status = VIDEO_MEMORY;
+            goto cleanup;
+        }
+
+        video = &worker->state.videoState;
+        video->sdlRendering = false;
+        video->closedGop = true;
+        // Share the processors between segments
+        if (video->rgb2yuvThreads == 0)
+            video->rgb2yuvThreads = availableProcessors() / nSegments > 1 ? availableProcessors() / nSegments : 1;
+        if (video->postThreads == 0)
+            video->postThreads = availableProcessors() / nSegments > 1 ? availableProcessors() / nSegments : 1;
+        if (video->videoThreads == 0)
+            video->videoThreads = availableProcessors() / nSegments > 1 ? availableProcessors() / nSegments : 1;
+        video->outputFilename = malloc(filenameLength);
+        if (video->outputFilename == NULL)
+        {
+            status = VIDEO_MEMORY;
+            goto cleanup;
+        }
+        snprintf(video->outputFilename, filenameLength, "%s.segment%03d.mp4", state->videoState.outputFilename, s);
+
+        worker->videoOpen = true;
+        status = initVideoProcessor(video);
+        if (status < 0)
+        {
+            fprintf(stderr, "Problem intializing video for segment %d: got status %d.\n", s, status);
+            goto cleanup;
+        }
+        status = avformat_write_header(video->videoContext, &video->dict);
+        if (status < 0)
+        {
+            fprintf(stderr, "Problem writing video header: %s\n", av_err2str(status));
+            goto cleanup;
+        }
+    }
+
+    if (state->verbose)
+        fprintf(stdout, "Rendering %lld frames in %d segments\n", (long long)nFrames, nSegments);
+
+    for (int s = 0; s < nSegments; s++)
+    {
+        if (pthread_create(&workers[s].thread, NULL, segmentWorker, &workers[s]) != 0)
+        {
+            fprintf(stderr, "Unable to start segment %d\n", s);
+            status = VIDEO_MEMORY;
+            goto cleanup;
+        }
+        workers[s].started = true;
+    }
+
+    // Progress
+    int nDone = 0;
+    int64_t framesRendered = 0;
+    while (nDone < nSegments)
+    {
+        usleep(SEGMENT_PROGRESS_INTERVAL);
+        nDone = 0;
+        framesRendered = 0;
+        for (int s = 0; s < nSegments; s++)
+        {
+            framesRendered += __atomic_load_n(&workers[s].state.framesRendered, __ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&workers[s].done, __ATOMIC_ACQUIRE))
+                nDone++;
+        }
+        fprintf(stdout, "\r%lld of %lld frames, %d of %d segments done", (long long)framesRendered, (long long)nFrames, nDone, nSegments);
+        fflush(stdout);
+    }
+    fprintf(stdout, "\n");
+
+    for (int s = 0; s < nSegments; s++)
+    {
+        pthread_join(workers[s].thread, NULL);
+        workers[s].started = false;
+        if (workers[s].status != VIDEO_OK && status == VIDEO_OK)
+        {
+            fprintf(stderr, "Segment %d failed with status %d\n", s, workers[s].status);
+            status = workers[s].status;
+        }
+        // Closes the segment file
+        cleanupVideo(&workers[s].state.videoState);
+        workers[s].videoOpen = false;
+    }
+
+    if (status == VIDEO_OK)
+        status = stitchSegments(state, workers, nSegments);
+
+cleanup:
+    for (int s = 0; s < nSegments; s++)
+    {
+        worker = &workers[s];
+        if (worker->started)
+            pthread_join(worker->thread, NULL);
+        if (worker->videoOpen)
+            cleanupVideo(&worker->state.videoState);
+        // Workers past a failed setup are still zeroed
+        if (worker->state.videoState.outputFilename != NULL && worker->state.videoState.outputFilename != state->videoState.outputFilename)
+        {
+            unlink(worker->state.videoState.outputFilename);
+            free(worker->state.videoState.outputFilename);
+        }
+        freeMidiSongCopy(worker->state.song);
+    }
+    free(workers);
+
+    return status;
+}
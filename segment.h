@@ -0,0 +1,45 @@
+/*
+
+    flow: segment.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SEGMENT_H
+#define _SEGMENT_H
+
+#include "flow.h"
+
+#include <pthread.h>
+
+#define SEGMENT_PROGRESS_INTERVAL 500000 // microseconds
+
+typedef struct SegmentWorker
+{
+    State state;
+    pthread_t thread;
+    int status;
+    bool started;
+    bool videoOpen;
+    bool done;
+} SegmentWorker;
+
+// Renders state->nSegments parts of the video in parallel, each to its own
+// closed-GOP file, then concatenates them into the output file with the audio.
+// Expects the song to be loaded and the video and audio not yet initialized.
+int flowSegments(State *state);
+
+#endif // _SEGMENT_H
@@ -0,0 +1,134 @@
+/*
+
+    flow: shear.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "shear.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+int initShearField(ShearField *field, int nY, double deltaT, double maxTime, double frameHeight)
+{
+    if (field == NULL || nY < 2 || deltaT <= 0.0 || maxTime <= 0.0 || frameHeight <= 0.0)
+        return SHEAR_ARG;
+
+    double rMax = (double)RAND_MAX;
+    double r = 0;
+    double yFrac = 0;
+
+    field->nY = nY;
+    field->nTimes = (int) floor(maxTime / deltaT) + 1;
+    field->maxTime = maxTime;
+    field->frameHeight = frameHeight;
+
+    free(field->table);
+    field->table = calloc(field->nTimes * nY, sizeof *field->table);
+    if (field->table == NULL)
+        return SHEAR_MEMORY;
+
+    for (int ti = 0; ti < field->nTimes; ti++)
+    {
+        for (int yi = 0; yi < nY; yi++)
+        {
+
+            // Pseudo random number between -1 and 1
+            r = 2.0 * rand() / rMax - 1.0;
+            yFrac = (double) yi / (double) (nY - 1);
+            field->table[ti * nY + yi] = r * yFrac * yFrac;
+        }
+    }
+
+    return SHEAR_OK;
+}
+
+void freeShearField(ShearField *field)
+{
+    if (field == NULL)
+        return;
+
+    free(field->table);
+    field->table = NULL;
+
+    return;
+}
+
+int initShearProfile(ShearProfile *profile, const ShearField *field)
+{
+    if (profile == NULL || field == NULL || field->nY < 2)
+        return SHEAR_ARG;
+
+    profile->nY = field->nY;
+    profile->value = calloc(field->nY, sizeof *profile->value);
+    profile->slope = calloc(field->nY, sizeof *profile->slope);
+    if (profile->value == NULL || profile->slope == NULL)
+    {
+        freeShearProfile(profile);
+        return SHEAR_MEMORY;
+    }
+    profile->indexScale = (float)((double)(field->nY - 1) / field->frameHeight * (double)(1 << SHEAR_FRACTION_BITS));
+    profile->maxIndex = (int32_t)(field->nY - 1) << SHEAR_FRACTION_BITS;
+
+    return SHEAR_OK;
+}
+
+void freeShearProfile(ShearProfile *profile)
+{
+    if (profile == NULL)
+        return;
+
+    free(profile->value);
+    free(profile->slope);
+    profile->value = NULL;
+    profile->slope = NULL;
+
+    return;
+}
+
+void shearProfileAt(const ShearField *field, double videoTime, ShearProfile *profile)
+{
+    int nY = field->nY;
+    int nT = field->nTimes;
+
+    // Linear interpolation in time
+    double deltaT = 1.0 / (double) (nT - 1);
+    double tVal = videoTime / field->maxTime / deltaT;
+    int ti1 = floor(tVal);
+    int ti2 = ti1 + 1;
+    if (ti1 < 0)
+    {
+        ti1 = 0;
+        ti2 = 0;
+    }
+    if (ti2 >= nT)
+    {
+        ti2 = nT - 1;
+        ti1 = nT - 1;
+    }
+
+    const double *a1 = field->table + ti1 * nY;
+    const double *a2 = field->table + ti2 * nY;
+    for (int yi = 0; yi < nY; yi++)
+        profile->value[yi] = (float)(a1[yi] + (tVal - (double) ti1) * (a2[yi] - a1[yi]) / deltaT);
+
+    // The original interpolation in y divides by the y point spacing as well
+    for (int yi = 0; yi < nY; yi++)
+        profile->slope[yi] = yi + 1 < nY ? (profile->value[yi + 1] - profile->value[yi]) * (float)(nY - 1) : 0.0f;
+
+    return;
+}
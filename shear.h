@@ -0,0 +1,79 @@
+/*
+
+    flow: shear.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SHEAR_H
+#define _SHEAR_H
+
+#include <stdint.h>
+#include <math.h>
+
+enum SHEAR_ERR
+{
+    SHEAR_OK = 0,
+    SHEAR_ARG = -1,
+    SHEAR_MEMORY = -2
+};
+
+#define SHEAR_FRACTION_BITS 16
+
+// Random sideways acceleration over (time, height) that shears the notes.
+// Built once per song and read-only after that, so renders can share it.
+typedef struct ShearField
+{
+    double *table; // nTimes rows of nY
+    int nY;
+    int nTimes;
+    double maxTime;
+    double frameHeight;
+} ShearField;
+
+// The field at one time, as a function of y only
+typedef struct ShearProfile
+{
+    float *value;
+    float *slope; // per y point, with the interpolation scaling of the original xAcceleration()
+    int nY;
+    float indexScale; // fixed-point y point index per pixel
+    int32_t maxIndex;
+} ShearProfile;
+
+// Fills the table from rand(); seed beforehand for reproducible renders
+int initShearField(ShearField *field, int nY, double deltaT, double maxTime, double frameHeight);
+void freeShearField(ShearField *field);
+
+int initShearProfile(ShearProfile *profile, const ShearField *field);
+void freeShearProfile(ShearProfile *profile);
+
+// Interpolates the field to videoTime, once per frame
+void shearProfileAt(const ShearField *field, double videoTime, ShearProfile *profile);
+
+static inline float sampleShearProfile(const ShearProfile *profile, float y)
+{
+    float clamped = y > 0.0f ? y : 0.0f;
+    // Clamped in float: far below the frame the product overflows int32_t
+    int32_t q = (int32_t)fminf(clamped * profile->indexScale, (float)profile->maxIndex);
+    if (q > profile->maxIndex)
+        q = profile->maxIndex;
+    int32_t i = q >> SHEAR_FRACTION_BITS;
+
+    return profile->value[i] + (float)(q & ((1 << SHEAR_FRACTION_BITS) - 1)) * (1.0f / (1 << SHEAR_FRACTION_BITS)) * profile->slope[i];
+}
+
+#endif // _SHEAR_H
@@ -0,0 +1,388 @@
+/*
+
+    flow: songcache.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "songcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+static const size_t trackStringOffsets[SONG_CACHE_TRACK_STRINGS] = {
+    offsetof(MidiTrack, trackName),
+    offsetof(MidiTrack, copyright),
+    offsetof(MidiTrack, text),
+    offsetof(MidiTrack, instrumentName),
+    offsetof(MidiTrack, lyric),
+    offsetof(MidiTrack, marker),
+    offsetof(MidiTrack, cuePoint),
+    offsetof(MidiTrack, sequencerMetaData)
+};
+
+#define TRACK_STRING(track, i) (*(char **)((uint8_t *)(track) + trackStringOffsets[i]))
+
+static char *cacheFilename(State *state)
+{
+    size_t length = strlen(state->audioState.midiFilename) + strlen(SONG_CACHE_SUFFIX) + 1;
+    char *filename = malloc(length);
+    if (filename != NULL)
+        snprintf(filename, length, "%s%s", state->audioState.midiFilename, SONG_CACHE_SUFFIX);
+
+    return filename;
+}
+
+uint64_t songCacheHash(const uint8_t *data, size_t size)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint64_t word = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8)
+    {
+        memcpy(&word, data + i, 8);
+        hash ^= word;
+        hash *= FNV_PRIME;
+    }
+    for (; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    hash ^= (uint64_t) size;
+    hash *= FNV_PRIME;
+
+    return hash;
+}
+
+static bool validSection(uint64_t offset, uint64_t count, uint64_t size, uint64_t fileSize)
+{
+    if (offset % 8 != 0 || offset > fileSize)
+        return false;
+    if (count != 0 && size > (fileSize - offset) / count)
+        return false;
+
+    return true;
+}
+
+int loadSongCache(State *state, uint64_t midiHash, uint64_t midiSize)
+{
+    if (state == NULL || state->audioState.midiFilename == NULL)
+        return SONG_CACHE_ARG;
+
+    char *filename = cacheFilename(state);
+    if (filename == NULL)
+        return SONG_CACHE_MEMORY;
+    int fd = open(filename, O_RDONLY);
+    free(filename);
+    if (fd < 0)
+        return SONG_CACHE_MISSING;
+
+    struct stat fileStat = {0};
+    if (fstat(fd, &fileStat) != 0 || (size_t) fileStat.st_size < sizeof(SongCacheHeader))
+    {
+        close(fd);
+        return SONG_CACHE_CORRUPT;
+    }
+    uint64_t fileSize = (uint64_t) fileStat.st_size;
+
+    // Private mapping: notes are updated while rendering, the file is not
+    uint8_t *map = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return SONG_CACHE_CORRUPT;
+
+    int status = SONG_CACHE_OK;
+    MidiSong *song = NULL;
+    const SongCacheHeader *header = (const SongCacheHeader *) map;
+    const SongCacheTrack *cachedTracks = NULL;
+
+    if (memcmp(header->magic, SONG_CACHE_MAGIC, 8) != 0 || header->version != SONG_CACHE_VERSION || header->noteSize != sizeof(MidiNote) || header->fileSize != fileSize)
+    {
+        status = SONG_CACHE_STALE;
+        goto done;
+    }
+    if (header->midiHash != midiHash || header->midiSize != midiSize || header->trackToDisplay != state->trackToDisplay || header->pedalSustainsNotes != state->pedalModifiesNotelength)
+    {
+        status = SONG_CACHE_STALE;
+        goto done;
+    }
+    if (header->nTracks < 0 || header->nTempoPoints < 1 || header->nIndexedNotes < 0 || header->nControllerPoints < 0
+        || !validSection(header->controllersOffset, MIDI_CHANNELS * MIDI_CONTROLLERS, sizeof(ControllerTimeline), fileSize)
+        || !validSection(header->controllerTimeOffset, header->nControllerPoints, sizeof(double), fileSize)
+        || !validSection(header->controllerValueOffset, header->nControllerPoints, sizeof(uint16_t), fileSize)
+        || !validSection(header->tracksOffset, header->nTracks, sizeof(SongCacheTrack), fileSize)
+        || !validSection(header->tempoMapOffset, header->nTempoPoints, sizeof(TempoPoint), fileSize)
+        || !validSection(header->noteIndexOffset, header->nIndexedNotes, sizeof(NoteRef), fileSize))
+    {
+        status = SONG_CACHE_CORRUPT;
+        goto done;
+    }
+
+    song = calloc(1, sizeof *song);
+    if (song == NULL)
+    {
+        status = SONG_CACHE_MEMORY;
+        goto done;
+    }
+    song->format = header->format;
+    song->nTracks = header->nTracks;
+    song->division = header->division;
+    song->tempo = header->tempo;
+    song->timeSignatureTop = header->timeSignatureTop;
+    song->timeSignatureBottom = header->timeSignatureBottom;
+    song->maxTime = header->maxTime;
+    song->minNote = header->minNote;
+    song->maxNote = header->maxNote;
+    song->tempoMap = (TempoPoint *)(map + header->tempoMapOffset);
+    song->nTempoPoints = header->nTempoPoints;
+    song->noteIndex = (NoteRef *)(map + header->noteIndexOffset);
+    song->nIndexedNotes = header->nIndexedNotes;
+    song->controllers = (ControllerTimeline *)(map + header->controllersOffset);
+    song->controllerTime = (double *)(map + header->controllerTimeOffset);
+    song->controllerValue = (uint16_t *)(map + header->controllerValueOffset);
+    song->nControllerPoints = header->nControllerPoints;
+    for (int i = 0; i < MIDI_CHANNELS * MIDI_CONTROLLERS; i++)
+    {
+        if (song->controllers[i].first < 0 || song->controllers[i].nPoints < 0 || song->controllers[i].first > song->nControllerPoints - song->controllers[i].nPoints)
+        {
+            status = SONG_CACHE_CORRUPT;
+            goto done;
+        }
+    }
+
+    song->tracks = calloc(song->nTracks > 0 ? song->nTracks : 1, sizeof *song->tracks);
+    if (song->tracks == NULL)
+    {
+        status = SONG_CACHE_MEMORY;
+        goto done;
+    }
+
+    MidiTrack *track = NULL;
+    uint64_t stringOffset = 0;
+    cachedTracks = (const SongCacheTrack *)(map + header->tracksOffset);
+    for (int tr = 0; tr < song->nTracks; tr++)
+    {
+        track = &song->tracks[tr];
+        if (cachedTracks[tr].nNotes < 0 || !validSection(cachedTracks[tr].notesOffset, cachedTracks[tr].nNotes, sizeof(MidiNote), fileSize))
+        {
+            status = SONG_CACHE_CORRUPT;
+            goto done;
+        }
+        track->notes = (MidiNote *)(map + cachedTracks[tr].notesOffset);
+        track->nNotes = cachedTracks[tr].nNotes;
+        track->allocatedNotes = track->nNotes;
+        track->instrument = cachedTracks[tr].instrument;
+        track->tempoTrack = cachedTracks[tr].tempoTrack;
+        track->transportTrack = cachedTracks[tr].transportTrack;
+        for (int s = 0; s < SONG_CACHE_TRACK_STRINGS; s++)
+        {
+            stringOffset = cachedTracks[tr].strings[s];
+            if (stringOffset == SONG_CACHE_NO_STRING)
+                continue;
+            if (stringOffset >= fileSize || memchr(map + stringOffset, '\0', fileSize - stringOffset) == NULL)
+            {
+                status = SONG_CACHE_CORRUPT;
+                goto done;
+            }
+            TRACK_STRING(track, s) = (char *)(map + stringOffset);
+        }
+    }
+
+    state->song = song;
+
+done:
+    if (status != SONG_CACHE_OK)
+    {
+        if (song != NULL)
+            free(song->tracks);
+        free(song);
+        munmap(map, fileSize);
+    }
+
+    return status;
+}
+
+static bool writePadding(FILE *f, uint64_t *position, uint64_t offset)
+{
+    static const uint8_t zeros[8] = {0};
+    if (offset < *position || offset - *position > sizeof zeros)
+        return false;
+    if (fwrite(zeros, 1, offset - *position, f) != offset - *position)
+        return false;
+    *position = offset;
+
+    return true;
+}
+
+static bool writeBytes(FILE *f, uint64_t *position, const void *data, uint64_t size)
+{
+    if (size > 0 && fwrite(data, 1, size, f) != size)
+        return false;
+    *position += size;
+
+    return true;
+}
+
+int writeSongCache(State *state, uint64_t midiHash, uint64_t midiSize)
+{
+    if (state == NULL || state->song == NULL || state->song->controllers == NULL || state->audioState.midiFilename == NULL)
+        return SONG_CACHE_ARG;
+
+    MidiSong *song = state->song;
+    MidiTrack *track = NULL;
+    char *string = NULL;
+
+    SongCacheHeader header = {0};
+    memcpy(header.magic, SONG_CACHE_MAGIC, 8);
+    header.version = SONG_CACHE_VERSION;
+    header.noteSize = sizeof(MidiNote);
+    header.midiHash = midiHash;
+    header.midiSize = midiSize;
+    header.trackToDisplay = state->trackToDisplay;
+    header.pedalSustainsNotes = state->pedalModifiesNotelength;
+    header.format = song->format;
+    header.nTracks = song->nTracks;
+    header.division = song->division;
+    header.tempo = song->tempo;
+    header.timeSignatureTop = song->timeSignatureTop;
+    header.timeSignatureBottom = song->timeSignatureBottom;
+    header.maxTime = song->maxTime;
+    header.minNote = song->minNote;
+    header.maxNote = song->maxNote;
+    header.nTempoPoints = song->nTempoPoints;
+    header.nIndexedNotes = song->nIndexedNotes;
+    header.nControllerPoints = song->nControllerPoints;
+
+    SongCacheTrack *cachedTracks = calloc(song->nTracks > 0 ? song->nTracks : 1, sizeof *cachedTracks);
+    if (cachedTracks == NULL)
+        return SONG_CACHE_MEMORY;
+
+    // Lay out the sections
+    uint64_t offset = ALIGN8(sizeof header);
+    header.tracksOffset = offset;
+    offset += (uint64_t) song->nTracks * sizeof *cachedTracks;
+    for (int tr = 0; tr < song->nTracks; tr++)
+    {
+        offset = ALIGN8(offset);
+        cachedTracks[tr].notesOffset = offset;
+        cachedTracks[tr].nNotes = song->tracks[tr].nNotes;
+        cachedTracks[tr].instrument = song->tracks[tr].instrument;
+        cachedTracks[tr].tempoTrack = song->tracks[tr].tempoTrack;
+        cachedTracks[tr].transportTrack = song->tracks[tr].transportTrack;
+        offset += (uint64_t) song->tracks[tr].nNotes * sizeof(MidiNote);
+    }
+    offset = ALIGN8(offset);
+    header.tempoMapOffset = offset;
+    offset += (uint64_t) song->nTempoPoints * sizeof(TempoPoint);
+    offset = ALIGN8(offset);
+    header.noteIndexOffset = offset;
+    offset += (uint64_t) song->nIndexedNotes * sizeof(NoteRef);
+    offset = ALIGN8(offset);
+    header.controllersOffset = offset;
+    offset += (uint64_t) MIDI_CHANNELS * MIDI_CONTROLLERS * sizeof(ControllerTimeline);
+    offset = ALIGN8(offset);
+    header.controllerTimeOffset = offset;
+    offset += (uint64_t) song->nControllerPoints * sizeof(double);
+    header.controllerValueOffset = offset;
+    offset += (uint64_t) song->nControllerPoints * sizeof(uint16_t);
+    for (int tr = 0; tr < song->nTracks; tr++)
+    {
+        for (int s = 0; s < SONG_CACHE_TRACK_STRINGS; s++)
+        {
+            string = TRACK_STRING(&song->tracks[tr], s);
+            cachedTracks[tr].strings[s] = string != NULL ? offset : SONG_CACHE_NO_STRING;
+            if (string != NULL)
+                offset += strlen(string) + 1;
+        }
+    }
+    header.fileSize = offset;
+
+    int status = SONG_CACHE_WRITE;
+    char *filename = cacheFilename(state);
+    size_t tmpLength = filename != NULL ? strlen(filename) + 32 : 0;
+    char *tmpFilename = filename != NULL ? malloc(tmpLength) : NULL;
+    if (tmpFilename == NULL)
+    {
+        free(filename);
+        free(cachedTracks);
+        return SONG_CACHE_MEMORY;
+    }
+    // Written aside and renamed, so readers never see a partial cache
+    snprintf(tmpFilename, tmpLength, "%s.%ld", filename, (long) getpid());
+    FILE *f = fopen(tmpFilename, "wb");
+    if (f == NULL)
+        goto done;
+
+    uint64_t position = 0;
+    if (!writeBytes(f, &position, &header, sizeof header)
+        || !writePadding(f, &position, header.tracksOffset)
+        || !writeBytes(f, &position, cachedTracks, (uint64_t) song->nTracks * sizeof *cachedTracks))
+        goto done;
+    for (int tr = 0; tr < song->nTracks; tr++)
+    {
+        track = &song->tracks[tr];
+        if (!writePadding(f, &position, cachedTracks[tr].notesOffset) || !writeBytes(f, &position, track->notes, (uint64_t) track->nNotes * sizeof(MidiNote)))
+            goto done;
+    }
+    if (!writePadding(f, &position, header.tempoMapOffset)
+        || !writeBytes(f, &position, song->tempoMap, (uint64_t) song->nTempoPoints * sizeof(TempoPoint))
+        || !writePadding(f, &position, header.noteIndexOffset)
+        || !writeBytes(f, &position, song->noteIndex, (uint64_t) song->nIndexedNotes * sizeof(NoteRef))
+        || !writePadding(f, &position, header.controllersOffset)
+        || !writeBytes(f, &position, song->controllers, (uint64_t) MIDI_CHANNELS * MIDI_CONTROLLERS * sizeof(ControllerTimeline))
+        || !writePadding(f, &position, header.controllerTimeOffset)
+        || !writeBytes(f, &position, song->controllerTime, (uint64_t) song->nControllerPoints * sizeof(double))
+        || !writeBytes(f, &position, song->controllerValue, (uint64_t) song->nControllerPoints * sizeof(uint16_t)))
+        goto done;
+    for (int tr = 0; tr < song->nTracks; tr++)
+    {
+        for (int s = 0; s < SONG_CACHE_TRACK_STRINGS; s++)
+        {
+            string = TRACK_STRING(&song->tracks[tr], s);
+            if (string != NULL && !writeBytes(f, &position, string, strlen(string) + 1))
+                goto done;
+        }
+    }
+    if (position != header.fileSize)
+        goto done;
+
+    status = SONG_CACHE_OK;
+
+done:
+    if (f != NULL && fclose(f) != 0)
+        status = SONG_CACHE_WRITE;
+    if (status == SONG_CACHE_OK && rename(tmpFilename, filename) != 0)
+        status = SONG_CACHE_WRITE;
+    if (status != SONG_CACHE_OK)
+        unlink(tmpFilename);
+    free(tmpFilename);
+    free(filename);
+    free(cachedTracks);
+
+    return status;
+}
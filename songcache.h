@@ -0,0 +1,109 @@
+/*
+
+    flow: songcache.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SONGCACHE_H
+#define _SONGCACHE_H
+
+#include "flow.h"
+#include "midi.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SONG_CACHE_SUFFIX ".flowcache"
+#define SONG_CACHE_MAGIC "FLOWSONG"
+#define SONG_CACHE_VERSION 5
+#define SONG_CACHE_NO_STRING UINT64_MAX
+#define SONG_CACHE_TRACK_STRINGS 8
+
+enum SONG_CACHE_ERR {
+    SONG_CACHE_OK = 0,
+    SONG_CACHE_ARG,
+    SONG_CACHE_MISSING,
+    SONG_CACHE_STALE,
+    SONG_CACHE_CORRUPT,
+    SONG_CACHE_MEMORY,
+    SONG_CACHE_WRITE
+};
+
+// Flat file layout: header, track records, notes of every track, tempo map,
+// note index, controller timelines with their times and values, then the
+// track strings. Sections are 8-byte aligned and
+// referenced by offsets from the start of the file.
+typedef struct SongCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t noteSize; // sizeof(MidiNote) of the writer
+    uint64_t fileSize;
+
+    // Key: the MIDI file and the options used to parse it
+    uint64_t midiHash;
+    uint64_t midiSize;
+    int32_t trackToDisplay;
+    int32_t pedalSustainsNotes;
+
+    int32_t format;
+    int32_t nTracks;
+    int32_t division;
+    double tempo;
+    int32_t timeSignatureTop;
+    int32_t timeSignatureBottom;
+    double maxTime;
+    int32_t minNote;
+    int32_t maxNote;
+
+    int32_t nTempoPoints;
+    int32_t nIndexedNotes;
+    uint64_t tracksOffset;
+    uint64_t tempoMapOffset;
+    uint64_t noteIndexOffset;
+
+    int32_t nControllerPoints;
+    int32_t reserved;
+    uint64_t controllersOffset; // MIDI_CHANNELS * MIDI_CONTROLLERS timelines
+    uint64_t controllerTimeOffset;
+    uint64_t controllerValueOffset;
+} SongCacheHeader;
+
+typedef struct SongCacheTrack
+{
+    uint64_t notesOffset;
+    int32_t nNotes;
+    int32_t instrument;
+    uint8_t tempoTrack;
+    uint8_t transportTrack;
+    uint8_t reserved[6];
+    // trackName, copyright, text, instrumentName, lyric, marker, cuePoint, sequencerMetaData
+    uint64_t strings[SONG_CACHE_TRACK_STRINGS];
+} SongCacheTrack;
+
+// FNV-1a over 64-bit words of the MIDI file, then its trailing bytes
+uint64_t songCacheHash(const uint8_t *data, size_t size);
+
+// Maps a valid cache of the MIDI file into state->song. The notes are a
+// private copy-on-write mapping that stays for the life of the process,
+// so they can be changed while rendering but not grown with addNote().
+int loadSongCache(State *state, uint64_t midiHash, uint64_t midiSize);
+
+// Writes state->song next to the MIDI file, replacing any stale cache
+int writeSongCache(State *state, uint64_t midiHash, uint64_t midiSize);
+
+#endif // _SONGCACHE_H
@@ -0,0 +1,250 @@
+/*
+
+    flow: text.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "text.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <SDL2/SDL_ttf.h>
+
+#define TEXT_MAX_FONTS 16
+
+typedef struct TextFont
+{
+    char *name;
+    int size;
+    TTF_Font *font;
+} TextFont;
+
+// SDL_ttf shares one FreeType library between all renders
+static pthread_mutex_t textLock = PTHREAD_MUTEX_INITIALIZER;
+static TextFont fonts[TEXT_MAX_FONTS] = {0};
+static int nFonts = 0;
+
+// Call with textLock held
+static TTF_Font *openFont(const char *name, int size)
+{
+    for (int i = 0; i < nFonts; i++)
+        if (fonts[i].size == size && strcmp(fonts[i].name, name) == 0)
+            return fonts[i].font;
+
+    if (nFonts == TEXT_MAX_FONTS)
+        return NULL;
+
+    TTF_Font *font = TTF_OpenFont(name, size);
+    if (font == NULL)
+        return NULL;
+    char *fontName = strdup(name);
+    if (fontName == NULL)
+    {
+        TTF_CloseFont(font);
+        return NULL;
+    }
+    fonts[nFonts].name = fontName;
+    fonts[nFonts].size = size;
+    fonts[nFonts].font = font;
+    nFonts++;
+
+    return font;
+}
+
+void closeTextFonts(void)
+{
+    pthread_mutex_lock(&textLock);
+    for (int i = 0; i < nFonts; i++)
+    {
+        TTF_CloseFont(fonts[i].font);
+        free(fonts[i].name);
+    }
+    memset(fonts, 0, sizeof fonts);
+    nFonts = 0;
+    pthread_mutex_unlock(&textLock);
+
+    return;
+}
+
+static uint64_t textHash(const char *fontName, int fontSize, const char *string)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = fontName; *c; c++)
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+    hash = (hash ^ (uint64_t)fontSize) * 0x100000001b3ULL;
+    for (const char *c = string; *c; c++)
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+static void clearEntry(TextTexture *entry)
+{
+    if (entry->texture != NULL)
+        SDL_DestroyTexture(entry->texture);
+    free(entry->mask);
+    free(entry->fontName);
+    free(entry->string);
+    memset(entry, 0, sizeof *entry);
+
+    return;
+}
+
+int initTextCache(TextCache *cache, SDL_Renderer *renderer, Raster *raster)
+{
+    if (cache == NULL || (renderer == NULL && raster == NULL))
+        return TEXT_ARG;
+
+    memset(cache, 0, sizeof *cache);
+    cache->entries = calloc(TEXT_CACHE_MAX_ENTRIES, sizeof *cache->entries);
+    if (cache->entries == NULL)
+        return TEXT_MEMORY;
+    cache->renderer = renderer;
+    cache->raster = raster;
+
+    return TEXT_OK;
+}
+
+void freeTextCache(TextCache *cache)
+{
+    if (cache == NULL || cache->entries == NULL)
+        return;
+
+    for (int i = 0; i < cache->nEntries; i++)
+        clearEntry(&cache->entries[i]);
+    free(cache->entries);
+    memset(cache, 0, sizeof *cache);
+
+    return;
+}
+
+// The text is white, so its alpha is all there is
+static uint8_t *textMask(SDL_Surface *surface)
+{
+    SDL_Surface *rgba = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+    if (rgba == NULL)
+        return NULL;
+
+    uint8_t *mask = malloc((size_t)rgba->w * rgba->h);
+    if (mask != NULL)
+    {
+        SDL_LockSurface(rgba);
+        const uint8_t *row = NULL;
+        for (int y = 0; y < rgba->h; y++)
+        {
+            row = (const uint8_t *)rgba->pixels + (size_t)y * rgba->pitch;
+            for (int x = 0; x < rgba->w; x++)
+                mask[(size_t)y * rgba->w + x] = row[4 * x + 3];
+        }
+        SDL_UnlockSurface(rgba);
+    }
+    SDL_FreeSurface(rgba);
+
+    return mask;
+}
+
+TextTexture *cachedText(TextCache *cache, const char *fontName, int fontSize, const char *string)
+{
+    if (cache == NULL || cache->entries == NULL || fontName == NULL || string == NULL || string[0] == '\0')
+        return NULL;
+
+    uint64_t hash = textHash(fontName, fontSize, string);
+    TextTexture *entry = NULL;
+    cache->clock++;
+    for (int i = 0; i < cache->nEntries; i++)
+    {
+        entry = &cache->entries[i];
+        if (entry->hash == hash && entry->fontSize == fontSize && strcmp(entry->string, string) == 0 && strcmp(entry->fontName, fontName) == 0)
+        {
+            entry->lastUsed = cache->clock;
+            return entry;
+        }
+    }
+
+    // New string: take a free entry or the least recently used one
+    if (cache->nEntries < TEXT_CACHE_MAX_ENTRIES)
+        entry = &cache->entries[cache->nEntries++];
+    else
+    {
+        entry = &cache->entries[0];
+        for (int i = 1; i < cache->nEntries; i++)
+            if (cache->entries[i].lastUsed < entry->lastUsed)
+                entry = &cache->entries[i];
+        clearEntry(entry);
+    }
+
+    pthread_mutex_lock(&textLock);
+    TTF_Font *font = openFont(fontName, fontSize);
+    SDL_Surface *surface = font != NULL ? TTF_RenderText_Blended(font, string, (SDL_Color){255, 255, 255, 255}) : NULL;
+    pthread_mutex_unlock(&textLock);
+    if (surface == NULL)
+        goto failed;
+
+    entry->width = surface->w;
+    entry->height = surface->h;
+    if (cache->raster != NULL)
+        entry->mask = textMask(surface);
+    else
+        entry->texture = SDL_CreateTextureFromSurface(cache->renderer, surface);
+    SDL_FreeSurface(surface);
+    entry->fontName = strdup(fontName);
+    entry->string = strdup(string);
+    if ((entry->texture == NULL && entry->mask == NULL) || entry->fontName == NULL || entry->string == NULL)
+        goto failed;
+    if (entry->texture != NULL)
+        SDL_SetTextureBlendMode(entry->texture, SDL_BLENDMODE_BLEND);
+    entry->fontSize = fontSize;
+    entry->hash = hash;
+    entry->lastUsed = cache->clock;
+
+    return entry;
+
+failed:
+    // Keep the entries packed
+    clearEntry(entry);
+    if (entry != &cache->entries[cache->nEntries - 1])
+        *entry = cache->entries[cache->nEntries - 1];
+    memset(&cache->entries[cache->nEntries - 1], 0, sizeof *entry);
+    cache->nEntries--;
+
+    return NULL;
+}
+
+int drawText(TextCache *cache, TextTexture *text, int x, int y, RGBAColour colour)
+{
+    if (cache == NULL || text == NULL)
+        return TEXT_ARG;
+
+    if (text->mask != NULL)
+    {
+        rasterBlendMask(cache->raster, text->mask, text->width, text->width, text->height, x, y, colour.r, colour.g, colour.b, colour.a);
+        return TEXT_OK;
+    }
+    if (text->texture == NULL)
+        return TEXT_ARG;
+
+    SDL_Rect destination = {x, y, text->width, text->height};
+    SDL_SetTextureColorMod(text->texture, colour.r, colour.g, colour.b);
+    SDL_SetTextureAlphaMod(text->texture, colour.a);
+    if (SDL_RenderCopy(cache->renderer, text->texture, NULL, &destination) != 0)
+        return TEXT_RENDER;
+
+    return TEXT_OK;
+}
@@ -0,0 +1,80 @@
+/*
+
+    flow: text.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TEXT_H
+#define _TEXT_H
+
+#include "colour.h"
+#include "raster.h"
+
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+#define TEXT_CACHE_MAX_ENTRIES 256
+#define TEXT_OVERLAY_FONT "DejaVuSans.ttf"
+#define TEXT_OVERLAY_FONTSIZE 24
+
+enum TEXT_ERR {
+    TEXT_OK = 0,
+    TEXT_ARG,
+    TEXT_MEMORY,
+    TEXT_FONT,
+    TEXT_RENDER
+};
+
+// A string rendered once in white, tinted and faded when drawn
+typedef struct TextTexture
+{
+    char *fontName;
+    int fontSize;
+    char *string;
+    uint64_t hash;
+    SDL_Texture *texture;
+    uint8_t *mask; // coverage, width by height, when a raster draws the text
+    int width;
+    int height;
+    uint64_t lastUsed;
+} TextTexture;
+
+// Text textures of one renderer, least recently used dropped first
+typedef struct TextCache
+{
+    SDL_Renderer *renderer;
+    Raster *raster; // NULL: drawn by the renderer
+    TextTexture *entries;
+    int nEntries;
+    uint64_t clock;
+} TextCache;
+
+// With a raster, text is blended into its target instead, e.g. YUV planes
+int initTextCache(TextCache *cache, SDL_Renderer *renderer, Raster *raster);
+void freeTextCache(TextCache *cache);
+
+// Texture of string in the font, rendered on first use. NULL for an empty
+// string or if the font cannot be opened. Valid until the next call.
+TextTexture *cachedText(TextCache *cache, const char *fontName, int fontSize, const char *string);
+
+int drawText(TextCache *cache, TextTexture *text, int x, int y, RGBAColour colour);
+
+// Fonts are opened once per process and shared by all renders
+void closeTextFonts(void);
+
+#endif // _TEXT_H
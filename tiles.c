@@ -0,0 +1,151 @@
+/*
+
+    flow: tiles.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "tiles.h"
+#include "rgb2yuv.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+int initTileMask(TileMask *mask, int width, int height)
+{
+    if (mask == NULL || width < 1 || height < 1)
+        return TILES_ARG;
+
+    memset(mask, 0, sizeof *mask);
+    mask->width = width;
+    mask->height = height;
+    mask->columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+    mask->rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+    mask->dirty = calloc((size_t)mask->columns * mask->rows, 1);
+    mask->spare = calloc((size_t)mask->columns * mask->rows, 1);
+    if (mask->dirty == NULL || mask->spare == NULL)
+    {
+        freeTileMask(mask);
+        return TILES_MEMORY;
+    }
+
+    return TILES_OK;
+}
+
+void freeTileMask(TileMask *mask)
+{
+    if (mask == NULL)
+        return;
+
+    free(mask->dirty);
+    free(mask->spare);
+    mask->dirty = NULL;
+    mask->spare = NULL;
+
+    return;
+}
+
+void resetTileMask(TileMask *mask, uint8_t r, uint8_t g, uint8_t b)
+{
+    memset(mask->dirty, 0, (size_t)mask->columns * mask->rows);
+    rgb2YuvColour(r, g, b, mask->background);
+
+    return;
+}
+
+void markTiles(TileMask *mask, float x0, float y0, float x1, float y1)
+{
+    // NaN and off-frame rectangles mark nothing
+    if (!(x1 >= x0 && y1 >= y0))
+        return;
+    if (x1 < -1.0f || y1 < -1.0f || x0 > (float)mask->width || y0 > (float)mask->height)
+        return;
+    // Sheared notes drift far off frame, clamp before converting to int
+    x0 = fmaxf(x0, -2.0f);
+    y0 = fmaxf(y0, -2.0f);
+    x1 = fminf(x1, (float)mask->width + 2.0f);
+    y1 = fminf(y1, (float)mask->height + 2.0f);
+
+    int left = (int)floorf(x0) - 1;
+    int top = (int)floorf(y0) - 1;
+    int right = (int)ceilf(x1) + 1;
+    int bottom = (int)ceilf(y1) + 1;
+    left = left < 0 ? 0 : left / TILE_SIZE;
+    top = top < 0 ? 0 : top / TILE_SIZE;
+    right = right >= mask->width ? mask->columns - 1 : right / TILE_SIZE;
+    bottom = bottom >= mask->height ? mask->rows - 1 : bottom / TILE_SIZE;
+
+    for (int row = top; row <= bottom; row++)
+        memset(mask->dirty + (size_t)row * mask->columns + left, 1, right - left + 1);
+
+    return;
+}
+
+// Separable maximum over k tiles either side
+void dilateTileMask(TileMask *mask, int halo)
+{
+    int k = (halo + TILE_SIZE - 1) / TILE_SIZE;
+    if (k < 1)
+        return;
+
+    int columns = mask->columns;
+    int rows = mask->rows;
+    uint8_t *in = NULL;
+    uint8_t *out = NULL;
+
+    for (int row = 0; row < rows; row++)
+    {
+        in = mask->dirty + (size_t)row * columns;
+        out = mask->spare + (size_t)row * columns;
+        memset(out, 0, columns);
+        for (int c = 0; c < columns; c++)
+        {
+            if (!in[c])
+                continue;
+            int lo = c - k > 0 ? c - k : 0;
+            int hi = c + k < columns - 1 ? c + k : columns - 1;
+            memset(out + lo, 1, hi - lo + 1);
+        }
+    }
+
+    memset(mask->dirty, 0, (size_t)columns * rows);
+    for (int row = 0; row < rows; row++)
+    {
+        in = mask->spare + (size_t)row * columns;
+        int lo = row - k > 0 ? row - k : 0;
+        int hi = row + k < rows - 1 ? row + k : rows - 1;
+        for (int r = lo; r <= hi; r++)
+        {
+            out = mask->dirty + (size_t)r * columns;
+            for (int c = 0; c < columns; c++)
+                out[c] |= in[c];
+        }
+    }
+
+    return;
+}
+
+int copyTileMask(TileMask *destination, const TileMask *source)
+{
+    if (destination == NULL || source == NULL || destination->columns != source->columns || destination->rows != source->rows)
+        return TILES_ARG;
+
+    memcpy(destination->dirty, source->dirty, (size_t)source->columns * source->rows);
+    memcpy(destination->background, source->background, sizeof destination->background);
+
+    return TILES_OK;
+}
@@ -0,0 +1,70 @@
+/*
+
+    flow: tiles.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TILES_H
+#define _TILES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define TILE_SIZE 64 // pixels; a multiple of the conversion and blur row jobs, and even for chroma
+
+enum TILES_ERR
+{
+    TILES_OK = 0,
+    TILES_ARG = -1,
+    TILES_MEMORY = -2
+};
+
+// Tiles of a frame that may differ from the solid background. Clean
+// tiles hold only the background colour, whose YUV values are kept so
+// that conversion can fill them without reading the frame.
+typedef struct TileMask
+{
+    int width; // pixels
+    int height;
+    int columns; // tiles
+    int rows;
+    uint8_t *dirty; // columns * rows, row major
+    uint8_t *spare;
+    uint8_t background[3]; // YUV
+} TileMask;
+
+int initTileMask(TileMask *mask, int width, int height);
+void freeTileMask(TileMask *mask);
+
+// Every tile clean, on a background of r, g, b
+void resetTileMask(TileMask *mask, uint8_t r, uint8_t g, uint8_t b);
+
+// Tiles under the rectangle x0 <= x < x1, y0 <= y < y1, with a pixel of margin for anti-aliasing
+void markTiles(TileMask *mask, float x0, float y0, float x1, float y1);
+
+// Grow dirty tiles by halo pixels, the reach of a blur
+void dilateTileMask(TileMask *mask, int halo);
+
+int copyTileMask(TileMask *destination, const TileMask *source);
+
+static inline bool tileDirty(const TileMask *mask, int column, int row)
+{
+    return mask->dirty[(size_t)row * mask->columns + column] != 0;
+}
+
+#endif // _TILES_H
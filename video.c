@@ -25,8 +25,11 @@
 #include "colour.h"
 
 #include <math.h>
+#include <string.h>
 #include <libavutil/pixdesc.h>
 
+static int initSwsSlices(VideoState *state);
+
 int initVideoProcessor(VideoState *state)
 {
     int status = VIDEO_OK;
@@ -44,6 +47,14 @@ int initVideoProcessor(VideoState *state)
 
     TTF_Init();
 
+    if (state->fastRgb2Yuv)
+    {
+        if (state->rgb2yuvThreads == 0)
+            state->rgb2yuvThreads = availableProcessors();
+        status = initWorkerPool(&state->rgb2yuvPool, state->rgb2yuvThreads - 1);
+        if (status != WORKERS_OK)
+            return VIDEO_MEMORY;
+    }
 
     state->frameBuffer = malloc(state->frameWidth * state->frameHeight * sizeof *state->frameBuffer);
     if (state->frameBuffer == NULL)
@@ -52,8 +63,27 @@ int initVideoProcessor(VideoState *state)
     // Try to be quiet
     av_log_set_level(AV_LOG_FATAL);
 
-    // Something to draw on
-    state->surface = SDL_CreateRGBSurface(0, state->frameWidth, state->frameHeight, 32, 0, 0, 0, 255);
+    // The native rasterizer needs the pixels in memory
+    if (state->sdlRendering && state->noteRasterizer == NOTE_RASTERIZER_NATIVE)
+        state->noteRasterizer = NOTE_RASTERIZER_SDL_GEOMETRY;
+    if (state->noteRasterizer != NOTE_RASTERIZER_NATIVE)
+        state->yuvRenderTarget = false;
+
+    // Something to draw on. Natively rendered frames are drawn in frameBuffer, no read back needed.
+    if (state->noteRasterizer == NOTE_RASTERIZER_NATIVE)
+    {
+        state->surface = SDL_CreateRGBSurfaceWithFormatFrom(state->frameBuffer, state->frameWidth, state->frameHeight, 32, state->frameWidth * sizeof *state->frameBuffer, SDL_PIXELFORMAT_RGBA32);
+        if (state->surface == NULL)
+            return VIDEO_MEMORY;
+        if (state->yuvRenderTarget)
+            status = initRasterYuv(&state->raster, state->frameWidth, state->frameHeight);
+        else
+            status = initRaster(&state->raster, state->frameBuffer, state->frameWidth, state->frameHeight);
+        if (status != RASTER_OK)
+            return VIDEO_MEMORY;
+    }
+    else
+        state->surface = SDL_CreateRGBSurface(0, state->frameWidth, state->frameHeight, 32, 0, 0, 0, 255);
     if (state->sdlRendering)
     {
         state->window = SDL_CreateWindow(state->videoTitleText, 0, 0, state->frameWidth, state->frameHeight, SDL_WINDOW_HIDDEN | SDL_WINDOW_OPENGL);
@@ -135,6 +165,8 @@ int initVideoProcessor(VideoState *state)
     state->videoCodecContext->pix_fmt = AV_PIX_FMT_YUV420P;
     if (state->videoContext->oformat->flags & AVFMT_GLOBALHEADER)
         state->videoCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (state->closedGop)
+        state->videoCodecContext->flags |= AV_CODEC_FLAG_CLOSED_GOP;
 
     status = avcodec_open2(state->videoCodecContext, state->videoCodec, &state->dict);
     if (status < 0)
@@ -191,6 +223,46 @@ int initVideoProcessor(VideoState *state)
         return status;
     }
 
+    if (state->videoThreads == 0)
+        state->videoThreads = availableProcessors();
+
+    // The native blur stands in for libavfilter unless a graph was given
+    if (!state->applyVideoFilter || state->videoFilterGraph != NULL)
+        state->postOptions.blurPasses = 0;
+    if (state->videoFilterGraph == NULL)
+        state->applyVideoFilter = false;
+    // Nothing to convert when rendering in YUV
+    if (state->yuvRenderTarget)
+        state->postOptions.fusedBlur = false;
+    state->postOptions.sparseTiles = state->sparseTiles;
+    if (state->postOptions.blurPasses > 0 || state->postOptions.bloomStrength > 0.0 || state->postOptions.lutFilename != NULL)
+    {
+        if (state->postThreads == 0)
+            state->postThreads = availableProcessors();
+        status = initWorkerPool(&state->postPool, state->postThreads - 1);
+        if (status != WORKERS_OK)
+            return VIDEO_MEMORY;
+        status = initPostProcess(&state->post, &state->postOptions, state->frameWidth, state->frameHeight, &state->postPool);
+        if (status == POSTPROCESS_LUT_FILE)
+        {
+            fprintf(stderr, "Unable to read 3D colour LUT %s\n", state->postOptions.lutFilename);
+            return VIDEO_FILTER;
+        }
+        else if (status != POSTPROCESS_OK)
+            return VIDEO_MEMORY;
+    }
+
+    // Dirty tiles of each frame, grown by what the blur reads around them
+    if (state->sparseTiles)
+    {
+        if (initTileMask(&state->tiles, state->frameWidth, state->frameHeight) != TILES_OK)
+            return VIDEO_MEMORY;
+        state->tileHalo = postProcessHalo(&state->post);
+        // swscale's chroma filters reach a few pixels past what was drawn
+        if (state->tileHalo > 0 && !state->fastRgb2Yuv && !state->postOptions.fusedBlur && !state->yuvRenderTarget)
+            state->tileHalo += 8;
+    }
+
     // Video filter setup
     if (state->applyVideoFilter)
     {
@@ -206,105 +278,185 @@ int initVideoProcessor(VideoState *state)
     state->in_linesize[0] = state->videoFrame->width * sizeof *state->frameBuffer;
     state->colorConversionContext = sws_getCachedContext(state->colorConversionContext, state->videoFrame->width, state->videoFrame->height, AV_PIX_FMT_RGBA, state->videoFrame->width, state->videoFrame->height, AV_PIX_FMT_YUV420P, 0, NULL, NULL, NULL);
 
+    // swscale on several threads, when it does the conversion
+    if (state->videoThreads > 1 && !state->fastRgb2Yuv && !state->yuvRenderTarget && !state->postOptions.fusedBlur && state->colorConversionContext != NULL)
+    {
+        status = initSwsSlices(state);
+        if (status != VIDEO_OK)
+        {
+            fprintf(stderr, "Problem setting up swscale slices.\n");
+            return status;
+        }
+    }
+
     return VIDEO_OK;
 
 }
 
 // Based on https://stackoverflow.com/questions/9465815/rgb-to-yuv420-algorithm-efficiency
-void rgba2Yuv420p(uint8_t *destination[8], uint8_t *rgb, size_t width, size_t height)
+// FFMPEG API version
+static void rgbToYuv(struct SwsContext *context, uint32_t *rgba, int *rgbaLinesize, AVFrame *frame)
 {
-    size_t i = 0;
-    uint8_t r = 0;
-    uint8_t g = 0;
-    uint8_t b = 0;
-    size_t upos = 0;
-    size_t vpos = 0;
-    size_t imageSize = width * height;
+    sws_scale(context, (const uint8_t * const *)&rgba, rgbaLinesize, 0, frame->height, frame->data, frame->linesize);
 
-    for( size_t line = 0; line < height; line+=2)
+    return;
+}
+
+// Every slice context sees the whole frame and produces its own rows, so
+// the output is what one context would give
+static int initSwsSlices(VideoState *state)
+{
+    int nSlices = state->videoThreads;
+    int alignment = (int)sws_receive_slice_alignment(state->colorConversionContext);
+    if (alignment < 1)
+        alignment = 1;
+    state->sliceRows = (state->frameHeight + nSlices - 1) / nSlices;
+    state->sliceRows = (state->sliceRows + alignment - 1) / alignment * alignment;
+    nSlices = (state->frameHeight + state->sliceRows - 1) / state->sliceRows;
+    if (nSlices < 2)
+        return VIDEO_OK;
+
+    state->sliceContexts = calloc(nSlices, sizeof *state->sliceContexts);
+    state->rgbaFrame = av_frame_alloc();
+    if (state->sliceContexts == NULL || state->rgbaFrame == NULL)
+        return VIDEO_MEMORY;
+    for (int i = 0; i < nSlices; i++)
     {
-        for( size_t x = 0; x < width; x += 2 )
-        {
-            r = rgb[4 * i];
-            g = rgb[4 * i + 1];
-            b = rgb[4 * i + 2];
-            destination[1][upos++] = ((-38*r + -74*g + 112*b) >> 8) + 128;
-            destination[2][vpos++] = ((112*r + -94*g + -18*b) >> 8) + 128;
-            i+=2;
-        }
-        i += width;
+        state->sliceContexts[i] = sws_getCachedContext(NULL, state->frameWidth, state->frameHeight, AV_PIX_FMT_RGBA, state->frameWidth, state->frameHeight, AV_PIX_FMT_YUV420P, 0, NULL, NULL, NULL);
+        if (state->sliceContexts[i] == NULL)
+            return VIDEO_MEMORY;
+        state->nSlices++;
     }
-    for( size_t p = 0; p < imageSize; p++ )
+    if (initWorkerPool(&state->swsPool, nSlices - 1) != WORKERS_OK)
+        return VIDEO_MEMORY;
+
+    return VIDEO_OK;
+}
+
+typedef struct SwsSliceTask
+{
+    VideoState *state;
+    AVFrame *frame;
+} SwsSliceTask;
+
+static void swsSliceJob(void *arg, int index)
+{
+    SwsSliceTask *task = (SwsSliceTask *)arg;
+    VideoState *state = task->state;
+    struct SwsContext *context = state->sliceContexts[index];
+
+    int rowStart = index * state->sliceRows;
+    int rows = state->frameHeight - rowStart < state->sliceRows ? state->frameHeight - rowStart : state->sliceRows;
+    if (sws_frame_start(context, task->frame, state->rgbaFrame) < 0)
+        return;
+    // All input rows are there; only this slice's output rows are made
+    if (sws_send_slice(context, 0, state->frameHeight) >= 0)
+        sws_receive_slice(context, rowStart, rows);
+    sws_frame_end(context);
+
+    return;
+}
+
+// The frame buffer stays ours
+static void keepBuffer(void *opaque, uint8_t *data)
+{
+    (void)opaque;
+    (void)data;
+}
+
+static void rgbToYuvSliced(VideoState *state, uint32_t *rgba, AVFrame *frame)
+{
+    // Reference counted, so the slice contexts share it rather than copy it
+    AVFrame *src = state->rgbaFrame;
+    av_frame_unref(src);
+    src->format = AV_PIX_FMT_RGBA;
+    src->width = state->frameWidth;
+    src->height = state->frameHeight;
+    src->buf[0] = av_buffer_create((uint8_t *)rgba, (size_t)state->in_linesize[0] * state->frameHeight, keepBuffer, NULL, 0);
+    if (src->buf[0] == NULL)
     {
-        r = rgb[4 * p];
-        g = rgb[4 * p + 1];
-        b = rgb[4 * p + 2];
-        destination[0][p] = ((66*r + 129*g + 25*b) >> 8) + 16;
+        rgbToYuv(state->colorConversionContext, rgba, state->in_linesize, frame);
+        return;
     }
+    src->data[0] = (uint8_t *)rgba;
+    src->linesize[0] = state->in_linesize[0];
+
+    SwsSliceTask task = {0};
+    task.state = state;
+    task.frame = frame;
+    runWorkers(&state->swsPool, swsSliceJob, &task, state->nSlices);
+    av_frame_unref(src);
 
     return;
 }
 
-// FFMPEG API version
-static void rgbToYuv(VideoState *state)
+int readFrame(VideoState *state, uint32_t *rgba)
+{
+    if (state == NULL || rgba == NULL)
+        return VIDEO_ARG;
+
+    if (state->yuvRenderTarget)
+        return VIDEO_OK;
+    else if (state->noteRasterizer == NOTE_RASTERIZER_NATIVE)
+    {
+        if (rgba != state->frameBuffer)
+            memcpy(rgba, state->frameBuffer, state->frameWidth * state->frameHeight * sizeof *rgba);
+    }
+    else
+        SDL_RenderReadPixels(state->renderer, NULL, 0, rgba, state->frameWidth * sizeof *rgba);
+
+    return VIDEO_OK;
+}
+
+// tiles: the frame's dirty tiles, NULL to convert every pixel
+void convertFrame(VideoState *state, struct SwsContext *context, uint32_t *rgba, AVFrame *frame, const TileMask *tiles)
 {
-    sws_scale(state->colorConversionContext, (const uint8_t * const *)&state->frameBuffer, state->in_linesize, 0, state->videoFrame->height, state->videoFrame->data, state->videoFrame->linesize);
+    // Already drawn in YUV
+    if (state->yuvRenderTarget)
+        return;
+
+    // Converted and blurred in one pass over bands of rows
+    if (state->post.options.fusedBlur)
+        postProcessRgba(&state->post, frame->data, frame->linesize, (const uint8_t *)rgba, tiles);
+    // SIMD, rows split over the conversion threads. Clean tiles are filled.
+    else if (state->fastRgb2Yuv)
+        rgba2Yuv420pTiles(frame->data, frame->linesize, (uint8_t*)rgba, state->frameWidth, state->frameHeight, tiles, &state->rgb2yuvPool);
+    // The pipeline's conversion threads have contexts of their own
+    else if (state->nSlices > 1 && context == state->colorConversionContext)
+        rgbToYuvSliced(state, rgba, frame);
+    else
+        rgbToYuv(context, rgba, state->in_linesize, frame);
 
     return;
 }
 
-int generateFrame(VideoState *state, int frameNumber)
+int filterVideoFrame(VideoState *state, AVFrame *frame, AVFrame *filtered)
 {
-    if (state == NULL)
+    if (state == NULL || frame == NULL || filtered == NULL)
         return VIDEO_ARG;
 
-    int status = 0;
-    int audioStatus = 0;
-    int got_output = 0;
-    int color = 0;
+    int status = av_buffersrc_add_frame_flags(state->filterSourceContext, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+    if (status < 0)
+        return VIDEO_FILTER;
 
-    if (!state->noMoreFrames)
-    {
-        SDL_RenderReadPixels(state->renderer, NULL, 0, state->frameBuffer, state->frameWidth * sizeof *state->frameBuffer);
+    // One frame out per frame in, as for boxblur and friends
+    status = av_buffersink_get_frame(state->filterSinkContext, filtered);
+    if (status == AVERROR(EAGAIN) || status == AVERROR_EOF)
+        return status;
+    if (status < 0)
+        return VIDEO_FILTER;
+    filtered->pts = frame->pts;
 
-        // Faster but lower quality
-        if (state->fastRgb2Yuv)
-            rgba2Yuv420p(state->videoFrame->data, (uint8_t*)state->frameBuffer, state->frameWidth, state->frameHeight);
-        else
-           rgbToYuv(state);        
-        state->videoFrame->pts = frameNumber;
+    return VIDEO_OK;
+}
 
-        // Filter the frame
-        if (state->applyVideoFilter)
-        {
-            status = av_buffersrc_add_frame_flags(state->filterSourceContext, state->videoFrame, AV_BUFFERSRC_FLAG_KEEP_REF);
-            if (status < 0)
-                return VIDEO_FILTER;
-
-            while (1)
-            {
-                status = av_buffersink_get_frame(state->filterSinkContext, state->filterFrame);
-                if (status == AVERROR(EAGAIN) || status == AVERROR_EOF)
-                    goto frameSent;
-                if (status < 0)
-                    return VIDEO_FILTER;
-                state->filterFrame->pts = frameNumber;
-                status = avcodec_send_frame(state->videoCodecContext, state->filterFrame);
-                av_frame_unref(state->filterFrame);
-                goto frameSent;
-
-            }
-        }
-        else
-        {
-            status = avcodec_send_frame(state->videoCodecContext, state->videoFrame);
-        }
-    }
-    else 
-    {
-        status = avcodec_send_frame(state->videoCodecContext, NULL);
-    }
-frameSent:
+// Pass NULL to flush the encoder
+int encodeVideoFrame(VideoState *state, AVFrame *frame)
+{
+    if (state == NULL)
+        return VIDEO_ARG;
+
+    int status = avcodec_send_frame(state->videoCodecContext, frame);
     if (status < 0)
         return VIDEO_FRAME_SEND;
 
@@ -333,9 +485,58 @@ frameSent:
     }
     av_packet_unref(state->videoPacket);
 
+    // Encoder wants more input (EAGAIN) or is drained (EOF)
+    return VIDEO_OK;
+}
+
+int generateFrame(VideoState *state, int frameNumber)
+{
+    if (state == NULL)
+        return VIDEO_ARG;
+
+    int status = 0;
+
+    if (state->noMoreFrames)
+        return encodeVideoFrame(state, NULL);
+
+    state->haveStaticFrame = false;
+    const TileMask *tiles = state->sparseTiles ? &state->tiles : NULL;
+    readFrame(state, state->frameBuffer);
+    convertFrame(state, state->colorConversionContext, state->frameBuffer, state->videoFrame, tiles);
+    state->videoFrame->pts = frameNumber;
+    postProcessFrame(&state->post, state->videoFrame->data, state->videoFrame->linesize, tiles);
+
+    // Filter the frame. The filtered frame is kept until the next, for repeatFrame().
+    if (state->applyVideoFilter)
+    {
+        av_frame_unref(state->filterFrame);
+        status = filterVideoFrame(state, state->videoFrame, state->filterFrame);
+        if (status != VIDEO_OK)
+            return status == VIDEO_FILTER ? VIDEO_FILTER : VIDEO_FRAME_SEND;
+        status = encodeVideoFrame(state, state->filterFrame);
+    }
+    else
+        status = encodeVideoFrame(state, state->videoFrame);
+    state->haveStaticFrame = status == VIDEO_OK;
+
     return status;
 }
 
+// Encode the last generated frame again, with no readback, conversion or filtering
+int repeatFrame(VideoState *state, int frameNumber)
+{
+    if (state == NULL)
+        return VIDEO_ARG;
+
+    if (!state->haveStaticFrame)
+        return VIDEO_NO_FRAME;
+
+    AVFrame *frame = state->applyVideoFilter ? state->filterFrame : state->videoFrame;
+    frame->pts = frameNumber;
+
+    return encodeVideoFrame(state, frame);
+}
+
 int finishVideo(VideoState *state)
 {
     fprintf(stdout, "\r                          \n");
@@ -357,9 +558,20 @@ void cleanupVideo(VideoState *state)
     av_frame_free(&state->filterFrame);
     av_packet_free(&state->videoPacket);
     sws_freeContext(state->colorConversionContext);
-    avio_closep(&state->videoContext->pb);
+    for (int i = 0; i < state->nSlices; i++)
+        sws_freeContext(state->sliceContexts[i]);
+    free(state->sliceContexts);
+    av_frame_free(&state->rgbaFrame);
+    freeWorkerPool(&state->swsPool);
+    if (state->videoContext != NULL)
+        avio_closep(&state->videoContext->pb);
     avformat_free_context(state->videoContext);
+    freeRaster(&state->raster);
+    freeTileMask(&state->tiles);
+    freePostProcess(&state->post);
+    freeWorkerPool(&state->postPool);
     free(state->frameBuffer);
+    freeWorkerPool(&state->rgb2yuvPool);
 
     // Seems to be the convention
     SDL_DestroyTexture(state->videoTexture);
@@ -389,6 +601,17 @@ int videoFilter(VideoState *state)
     AVRational timebase = state->videoStream->time_base;
 
     state->filterGraph = avfilter_graph_alloc();
+    if (state->filterGraph == NULL)
+    {
+        status = VIDEO_MEMORY;
+        goto cleanup;
+    }
+    // Filters that support it split each frame into slices; otherwise libavfilter picks its own thread count
+    if (state->videoThreads > 1)
+    {
+        state->filterGraph->nb_threads = state->videoThreads;
+        state->filterGraph->thread_type = AVFILTER_THREAD_SLICE;
+    }
 
     snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d", state->videoCodecContext->width, state->videoCodecContext->height, state->videoCodecContext->pix_fmt, timebase.num, timebase.den, state->videoCodecContext->sample_aspect_ratio.num, state->videoCodecContext->sample_aspect_ratio.den);
 
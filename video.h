@@ -22,6 +22,10 @@
 #define _VIDEO_H
 
 #include "colour.h"
+#include "rgb2yuv.h"
+#include "raster.h"
+#include "tiles.h"
+#include "postprocess.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -105,9 +109,15 @@ typedef struct VideoState
     AVFilterContext *filterSinkContext;
     AVFilterGraph *filterGraph;
 
-    char *videoFilterGraph;
+    char *videoFilterGraph; // libavfilter graph in place of the native blur, NULL for none
     bool applyVideoFilter;
 
+    // Native blur, bloom and colour LUT, in place on each YUV frame
+    PostProcessOptions postOptions;
+    PostProcess post;
+    int postThreads; // 0: one per processor
+    WorkerPool postPool;
+
     // Draw info
     SDL_Window *window;
     SDL_Surface *surface;
@@ -119,9 +129,39 @@ typedef struct VideoState
     int in_linesize[1];
 
     bool fastRgb2Yuv;
+    int rgb2yuvThreads; // 0: one per processor
+    WorkerPool rgb2yuvPool;
+
+    // swscale slices, each with its own context, and libavfilter slice threads
+    int videoThreads; // 0: one per processor
+    WorkerPool swsPool;
+    struct SwsContext **sliceContexts;
+    int nSlices;
+    int sliceRows;
+    AVFrame *rgbaFrame; // wraps the frame being converted
 
     bool sdlRendering;
 
+    // Notes drawn by the native rasterizer straight into frameBuffer, or by SDL2_gfx
+    int noteRasterizer;
+    Raster raster;
+
+    // Native rasterizer draws straight into videoFrame, no readback or conversion
+    bool yuvRenderTarget;
+
+    // Every GOP self-contained, so segments can be concatenated
+    bool closedGop;
+
+    // Tiles drawn on this frame; the rest is background that conversion and blur skip
+    bool sparseTiles;
+    TileMask tiles;
+    int tileHalo; // pixels the mask is dilated by, the reach of the blur and chroma filters
+
+    // Frames of bare background, as the one before, reuse its converted and filtered frame
+    bool reuseStaticFrames;
+    bool variableFrameRate; // Static frames are dropped, the last one shown until the next
+    bool haveStaticFrame; // The last frame sent to the encoder can be sent again
+
     bool noMoreFrames;
 
     bool verbose;
@@ -130,10 +170,14 @@ typedef struct VideoState
 
 int initVideoProcessor(VideoState *state);
 
-void rgba2Yuv420p(uint8_t *destination[8], uint8_t *rgb, size_t width, size_t height);
-static void rgbToYuv(VideoState *state);
+// Stages of generateFrame(), usable separately by the frame pipeline
+int readFrame(VideoState *state, uint32_t *rgba);
+void convertFrame(VideoState *state, struct SwsContext *context, uint32_t *rgba, AVFrame *frame, const TileMask *tiles);
+int filterVideoFrame(VideoState *state, AVFrame *frame, AVFrame *filtered);
+int encodeVideoFrame(VideoState *state, AVFrame *frame);
 
 int generateFrame(VideoState *state, int frameNumber);
+int repeatFrame(VideoState *state, int frameNumber);
 
 int finishVideo(VideoState *state);
 void cleanupVideo(VideoState *state);
@@ -0,0 +1,163 @@
+/*
+
+    flow: workers.c
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "workers.h"
+
+#include <unistd.h>
+
+// Run jobs of the current task until there are none left. Called with pool->lock held.
+static void runJobs(WorkerPool *pool)
+{
+    int index = 0;
+    WorkerJob job = pool->job;
+    void *arg = pool->arg;
+
+    while (pool->nextJob < pool->nJobs)
+    {
+        index = pool->nextJob++;
+        pthread_mutex_unlock(&pool->lock);
+        job(arg, index);
+        pthread_mutex_lock(&pool->lock);
+        pool->nFinished++;
+    }
+    if (pool->nFinished == pool->nJobs)
+        pthread_cond_broadcast(&pool->finished);
+
+    return;
+}
+
+static void *workerThread(void *arg)
+{
+    WorkerPool *pool = (WorkerPool *)arg;
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        while (!pool->quit && pool->generation == generation)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
+            break;
+        generation = pool->generation;
+        runJobs(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int availableProcessors(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > WORKERS_MAX_THREADS)
+        n = WORKERS_MAX_THREADS;
+
+    return (int)n;
+}
+
+int initWorkerPool(WorkerPool *pool, int nThreads)
+{
+    if (pool == NULL || nThreads < 0 || nThreads > WORKERS_MAX_THREADS)
+        return WORKERS_ARG;
+
+    pool->nThreads = 0;
+    pool->job = NULL;
+    pool->arg = NULL;
+    pool->nJobs = 0;
+    pool->nextJob = 0;
+    pool->nFinished = 0;
+    pool->generation = 0;
+    pool->quit = false;
+
+    pthread_mutex_init(&pool->submitLock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->initialized = true;
+
+    for (int i = 0; i < nThreads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, workerThread, pool) != 0)
+        {
+            freeWorkerPool(pool);
+            return WORKERS_THREAD;
+        }
+        pool->nThreads++;
+    }
+
+    return WORKERS_OK;
+}
+
+int runWorkers(WorkerPool *pool, WorkerJob job, void *arg, int nJobs)
+{
+    if (job == NULL || nJobs < 0)
+        return WORKERS_ARG;
+
+    // No helpers: plain loop
+    if (pool == NULL || !pool->initialized || pool->nThreads == 0 || nJobs == 1)
+    {
+        for (int i = 0; i < nJobs; i++)
+            job(arg, i);
+        return WORKERS_OK;
+    }
+
+    pthread_mutex_lock(&pool->submitLock);
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->arg = arg;
+    pool->nJobs = nJobs;
+    pool->nextJob = 0;
+    pool->nFinished = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+
+    runJobs(pool);
+    while (pool->nFinished < pool->nJobs)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submitLock);
+
+    return WORKERS_OK;
+}
+
+void freeWorkerPool(WorkerPool *pool)
+{
+    if (pool == NULL || !pool->initialized)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nThreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pool->nThreads = 0;
+
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submitLock);
+    pool->initialized = false;
+
+    return;
+}
@@ -0,0 +1,74 @@
+/*
+
+    flow: workers.h
+
+    Copyright (C) 2023  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _WORKERS_H
+#define _WORKERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define WORKERS_MAX_THREADS 64
+
+enum WORKERS_ERR
+{
+    WORKERS_OK = 0,
+    WORKERS_ARG = -1,
+    WORKERS_MEMORY = -2,
+    WORKERS_THREAD = -3
+};
+
+// One piece of a parallel loop: job runs once for each index 0 to nJobs - 1
+typedef void (*WorkerJob)(void *arg, int index);
+
+// Persistent threads for splitting one task (rows of a frame, tracks of a
+// song) into independent jobs. The submitting thread runs jobs too.
+typedef struct WorkerPool
+{
+    int nThreads;
+    pthread_t threads[WORKERS_MAX_THREADS];
+
+    pthread_mutex_t submitLock;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finished;
+
+    WorkerJob job;
+    void *arg;
+    int nJobs;
+    int nextJob;
+    int nFinished;
+    uint64_t generation;
+    bool quit;
+
+    bool initialized;
+} WorkerPool;
+
+int availableProcessors(void);
+
+// nThreads helper threads; 0 runs every job on the submitting thread
+int initWorkerPool(WorkerPool *pool, int nThreads);
+
+// Returns when all jobs are done. Safe to call from several threads; submissions are serialized.
+int runWorkers(WorkerPool *pool, WorkerJob job, void *arg, int nJobs);
+
+void freeWorkerPool(WorkerPool *pool);
+
+#endif // _WORKERS_H